@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+# Write a ttm snapshot (see saveSnapshot in ttm.c) defining the
+# string "big" with a body of more than 2^32 characters, for
+# "make bigcheck".  The body is all 'a' except for "0123456789"
+# straddling character 2^32 and "xyz" at its very end.
+# The snapshot is read by ttm -L through mmap, so the body never
+# has to fit in memory; the file does need about 17GB of disk
+# (BODYLEN characters of 4 bytes each).
+import struct, sys
+
+MAGIC = 0x434d5454
+VERSION = 2
+BODYLEN = (1 << 32) + (1 << 20)
+MARK = (1 << 32) - 5
+CHUNK = 1 << 20  # characters per write
+
+def size(n):
+    return struct.pack('=II', n & 0xFFFFFFFF, n >> 32)
+
+def utf32(s):
+    return b''.join(struct.pack('=i', ord(c)) for c in s)
+
+out = open(sys.argv[1], 'wb')
+out.write(struct.pack('=11I', MAGIC, VERSION, ord('#'), ord('<'),
+                      ord(';'), ord('>'), ord('\\'), ord('\n'), 0, 1, 0))
+# flags minargs maxargs residual:2 maxsegmark namelen:2 bodylen:2
+out.write(struct.pack('=3I', 0, 0, 0) + size(0) + struct.pack('=I', 0)
+          + size(3) + size(BODYLEN))
+out.write(utf32('big\0'))
+filler = utf32('a' * CHUNK)
+pos = 0
+for at, text in ((MARK, '0123456789'), (BODYLEN - 3, 'xyz')):
+    while pos + CHUNK <= at:
+        out.write(filler)
+        pos += CHUNK
+    out.write(utf32('a' * (at - pos) + text))
+    pos = at + len(text)
+out.write(utf32('\0'))
+out.close()
+assert pos == BODYLEN
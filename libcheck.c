@@ -0,0 +1,230 @@
+/**
+This software is released under the terms of the Apache License version 2.
+For details of the license, see http://www.apache.org/licenses/LICENSE-2.0.
+*/
+
+/* Exercise the library interface of ttm.h; see "make libcheck" */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "ttm.h"
+
+struct Output {
+    char text[1024];
+    size_t length;
+    int refuse; /* 1 => fail every write */
+};
+
+static int
+collect(void* closure, const char* bytes, size_t length)
+{
+    struct Output* out = (struct Output*)closure;
+    if(out->refuse || out->length + length >= sizeof(out->text))
+        return -1;
+    memcpy(out->text+out->length,bytes,length);
+    out->length += length;
+    out->text[out->length] = '\0';
+    return 0;
+}
+
+/* Evaluate program in ttm; return 1 unless it produced
+   expected, and failed if and only if fails is set */
+static int
+expect(TTM* ttm, const char* program, int fails, const char* expected)
+{
+    struct Output out;
+    TTMSink sink;
+    int err;
+
+    memset((void*)&out,0,sizeof(out));
+    sink.write = collect;
+    sink.closure = &out;
+    err = ttm_eval(ttm,program,strlen(program),&sink);
+    if((err != TTM_OK) != fails || strcmp(out.text,expected) != 0) {
+        fprintf(stderr,"FAIL: %s\n  output |%s| expected |%s|\n  error %d: %s\n",
+                program,out.text,expected,err,ttm_error(ttm));
+        return 1;
+    }
+    return 0;
+}
+
+/* Peak resident memory, in kilobytes */
+static long
+peakMemory(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return (long)usage.ru_maxrss;
+}
+
+#define BIGSIZE (512*1024)
+#define NREADERS 64
+
+/* Clones that move the residual of a large shared string
+   should each cost a record, not a copy of the string */
+static int
+residualCost(void)
+{
+    TTM* base = ttm_create();
+    TTM* readers[NREADERS];
+    char* program = (char*)malloc(BIGSIZE+16);
+    long before, grown;
+    int i, failures = 0;
+
+    if(base == NULL || program == NULL) return 1;
+    strcpy(program,"#<ds;big;");
+    memset(program+9,'x',BIGSIZE);
+    strcpy(program+9+BIGSIZE,">");
+    failures += expect(base,program,0,"");
+    free(program);
+    for(i=0;i<NREADERS;i++) readers[i] = NULL;
+    before = peakMemory();
+    for(i=0;i<NREADERS && failures == 0;i++) {
+        readers[i] = ttm_clone(base);
+        if(readers[i] == NULL) return failures+1;
+        failures += expect(readers[i],"#<cc;big>#<cn;3;big>#<sn;4;big>#<cc;big>",0,"xxxxx");
+    }
+    grown = peakMemory() - before;
+    printf("%d clones reading a %dKB string grew memory by %ldKB\n",
+           NREADERS,BIGSIZE/1024,grown);
+    if(grown > (NREADERS*(BIGSIZE/1024))/2) { /* a copy each would be all of it */
+        fprintf(stderr,"FAIL: reading a shared string copied it\n");
+        failures++;
+    }
+    for(i=0;i<NREADERS;i++) {
+        if(readers[i] != NULL) ttm_destroy(readers[i]);
+    }
+    ttm_destroy(base);
+    return failures;
+}
+
+#define LIBFILE "libcheck.lib"
+
+/* A stored program can be copied back by a new interpreter,
+   but a library whose index was hashed with another seed
+   (the fourth word of its header) is refused */
+static int
+libraryHeader(void)
+{
+    TTM* ttm = ttm_create();
+    FILE* f;
+    unsigned int seed;
+    int failures = 0;
+
+    if(ttm == NULL) return 1;
+    remove(LIBFILE);
+    failures += expect(ttm,"#<libs;lc;" LIBFILE ">#<ds;p;stored>#<store;prog;p>",0,"");
+    ttm_destroy(ttm);
+    ttm = ttm_create();
+    if(ttm == NULL) return failures+1;
+    failures += expect(ttm,"#<libs;lc;" LIBFILE ">#<copy;prog>#<p>",0,"stored");
+    ttm_destroy(ttm);
+    f = fopen(LIBFILE,"r+b");
+    if(f == NULL || fseek(f,12,SEEK_SET) != 0 || fread(&seed,sizeof(seed),1,f) != 1)
+        return failures+1;
+    seed ^= 1;
+    if(fseek(f,12,SEEK_SET) != 0 || fwrite(&seed,sizeof(seed),1,f) != 1)
+        return failures+1;
+    fclose(f);
+    ttm = ttm_create();
+    if(ttm == NULL) return failures+1;
+    failures += expect(ttm,"#<libs;lc;" LIBFILE ">#<copy;prog>#<p>",1,"");
+    if(strstr(ttm_error(ttm),"Storage") == NULL) {
+        fprintf(stderr,"FAIL: library with another seed: %s\n",ttm_error(ttm));
+        failures++;
+    }
+    ttm_destroy(ttm);
+    remove(LIBFILE);
+    return failures;
+}
+
+int
+main(int argc, char** argv)
+{
+    TTM* a;
+    TTM* b;
+    TTM* c;
+    TTM* d;
+    struct Output out;
+    TTMSink sink;
+    int failures = 0;
+    long i;
+
+    a = ttm_create();
+    b = ttm_create();
+    if(a == NULL || b == NULL) {
+        fprintf(stderr,"FAIL: ttm_create\n");
+        return 1;
+    }
+    failures += expect(a,"#<ds;f;hello x>#<ss;f;x>#<f;world>",0,"hello world");
+    /* definitions carry over, but only within one interpreter */
+    failures += expect(a,"#<f;again>",0,"hello again");
+    failures += expect(b,"[#<f;b>]",1,"");
+    failures += expect(b,"#<ps;printed >#<ad;1;2>",0,"printed 3");
+    /* an error abandons the evaluation but not the interpreter */
+    failures += expect(a,"#<ds;g;ok>#<ad;1;x>",1,"");
+    failures += expect(a,"#<g> #<f;after>",0,"ok hello after");
+    /* #<try> catches an error inside the evaluation */
+    failures += expect(a,"#<ds;e;<(C)>>#<ss;e;C>[#<try;<#<ad;1;x>>;e>]",0,"[(6)]");
+    failures += expect(a,"caf\xc3\xa9 #<exit>never",0,"caf\xc3\xa9 ");
+    failures += expect(a,"\xe4\xb8",1,"");
+    /* a sink that fails fails the evaluation */
+    memset((void*)&out,0,sizeof(out));
+    out.refuse = 1;
+    sink.write = collect;
+    sink.closure = &out;
+    if(ttm_eval(a,"text",4,&sink) == TTM_OK) {
+        fprintf(stderr,"FAIL: refused output\n");
+        failures++;
+    }
+    if(ttm_eval(a,"#<ds;h;1>",9,NULL) != TTM_OK) failures++;
+    failures += expect(a,"#<h>",0,"1");
+    /* a clone starts with a's definitions, and changes only its own */
+    failures += expect(a,"#<ds;s;abc>",0,"");
+    c = ttm_clone(a);
+    if(c == NULL) {
+        fprintf(stderr,"FAIL: ttm_clone\n");
+        return 1;
+    }
+    failures += expect(c,"#<f;clone>",0,"hello clone");
+    failures += expect(c,"#<ds;f;mine>#<f> #<cc;s>#<cc;s>",0,"mine ab");
+    failures += expect(a,"#<f;still> #<cc;s>",0,"hello still a");
+    failures += expect(c,"#<es;g>[#<ndf;g;y;n>]",0,"[n]");
+    failures += expect(a,"[#<ndf;g;y;n>]",0,"[y]");
+    failures += expect(c,"#<ds;g;new>#<g>",0,"new");
+    d = ttm_clone(c);
+    if(d == NULL) {
+        fprintf(stderr,"FAIL: ttm_clone of a clone\n");
+        return 1;
+    }
+    failures += expect(d,"#<f>#<g>#<cc;s>",0,"minenewc");
+    failures += expect(d,"#<es;g;f>[#<ndf;f;y;n>]",0,"[n]");
+    failures += expect(c,"#<f>",0,"mine");
+    /* changing a body one clone shares with the base changes only its own */
+    failures += expect(c,"#<rrp;s>#<ss;s;b>#<s;X>",0,"aXc");
+    failures += expect(d,"#<rrp;s>#<cr;s;c>#<s>|#<ap;s;d>#<rrp;s>#<s>",0,"ab0001|ab0002d");
+    failures += expect(a,"#<rrp;s>#<s;X>",0,"abc");
+    ttm_destroy(a);
+    failures += expect(c,"#<g>#<h>",0,"new1");
+    ttm_destroy(c);
+    ttm_destroy(d);
+    /* the execution count is per evaluation, not per instance */
+    for(i=0;i<200000;i++) {
+        if(expect(b,"#<ad;1;1>#<ad;2;2>#<ad;3;3>#<ad;4;4>#<ad;5;5>#<ad;6;6>",0,"24681012") != 0) {
+            fprintf(stderr,"  at evaluation %ld\n",i);
+            failures++;
+            break;
+        }
+    }
+    ttm_destroy(b);
+    failures += residualCost();
+    failures += libraryHeader();
+    if(failures > 0) {
+        fprintf(stderr,"%d library checks failed\n",failures);
+        return 1;
+    }
+    printf("library checks passed\n");
+    return 0;
+}
@@ -0,0 +1,12 @@
+first card   
+second card
+0123456789ABCDEF
+padded    
+      X = 1 +
+     &    2 +
+     1    3
+C a comment card
+      Y = 4                                                             SEQ00009
+      Z = 5 +
+     *    6
+last
\ No newline at end of file
@@ -22,6 +22,29 @@ This is in lieu of the typical config.h.
 /* Define if the equivalent of the standard Unix memove() is available */
 #define HAVE_MEMMOVE 
 
+/* Define if the SSE2 intrinsics are available; they are used
+   for the ascii fast paths of utf-8 encoding and decoding */
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define HAVE_SSE2
+#endif
+
+/* Define if POSIX threads and semaphores are available; they are
+   used to run the I/O of -Xp in threads of its own */
+#if !defined _WIN32 && !defined _MSC_VER
+#define HAVE_PTHREADS
+#endif
+
+/* Define if zlib is available (link with -lz); it is used to
+   read and write gzip compressed files */
+#if !defined _WIN32 && !defined _MSC_VER
+#define HAVE_ZLIB
+#endif
+
+/* Define if libzstd is available (link with -lzstd); it is used
+   to read and write zstd compressed files.  It is not everywhere,
+   so it is left to the command line; see "make zstdcheck" */
+/* #define HAVE_ZSTD */
+
 /**************************************************/
 
 /* It is not clear what the correct Windows CPP Tag should be.
@@ -43,6 +66,11 @@ This is in lieu of the typical config.h.
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
+#include <setjmp.h>
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
 
 #ifdef MSWINDOWS
 #include <windows.h>  /* To get GetProcessTimes() */
@@ -51,7 +79,28 @@ This is in lieu of the typical config.h.
 #include <unistd.h> /* This defines getopt */
 #include <sys/times.h> /* to get times() */
 #include <sys/time.h> /* to get gettimeofday() */
+#include <time.h> /* to get ctime() */
+#include <sys/stat.h> /* to get fstat() */
+#include <sys/mman.h> /* to get mmap() */
+#include <fcntl.h> /* to get open() */
+#include <signal.h>
+#include <sys/socket.h> /* to get the --serve socket */
+#include <sys/un.h>
+#include <sys/wait.h> /* to get waitpid() */
+#include <errno.h> /* to get errno */
 #endif /*!MSWINDOWS*/
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "ttm.h"
 
 /**************************************************/
 /* Unix/Linux versus Windows Definitions */
@@ -62,6 +111,16 @@ This is in lieu of the typical config.h.
 #define strdup _strdup
 #endif /*!MSWINDOWS*/
 
+/* errno.h spells some of its codes as enum ERR does below;
+   keep the ones that serve() needs and give up the names */
+#ifndef MSWINDOWS
+static const int SYSEINTR = EINTR;
+static const int SYSECONNABORTED = ECONNABORTED;
+#undef EIO
+#undef ERANGE
+#undef ETIME
+#endif /*!MSWINDOWS*/
+
 /* Getopt */
 #ifdef MSWINDOWS
 static char* optarg;            /* global argument pointer */
@@ -116,7 +175,7 @@ typedef int utf32; /* 32-bit utf char type; signed is ok
 That is, dst might point int the range src,src+len.
 */
 static void
-makespace(utf32* dst, utf32* src, unsigned int len)
+makespace(utf32* dst, utf32* src, size_t len)
 {
 #ifdef HAVE_MEMMOVE
     memmove((void*)dst,(void*)src,len*sizeof(utf32));
@@ -168,8 +227,65 @@ Constants
 
 #define CREATELEN 4 /* # of characters for a create mark */
 
+/* Files are read and decoded this many bytes at a time */
+#define READBLOCKSIZE (1<<16)
+
+/* Output is encoded into buffers of this many bytes,
+   which are written out when full; see the "Output" section */
+#define WRITEBLOCKSIZE (1<<16)
+
+/* While scanning the -p file, finished passive text is written
+   out once there are this many characters of it; see emit() */
+#define EMITSIZE (1<<16)
+
+/* After passing call-free text straight through to the output,
+   decode only this many bytes past the next bit of syntax
+   before looking for more call-free text; see refill() */
+#define PASSWINDOW (1<<12)
+
+/* Indices of TTM.writers */
+#define WSTDOUT 0
+#define WSTDERR 1
+#define WOUTPUT 2 /* the -o file */
+#define NWRITERS 3
+
+/* Card images for #<cd> and friends; columns past
+   FORTRANCOLUMNS are ignored by #<for> */
+#define CARDCOLUMNS 80
+#define FORTRANCOLUMNS 72
+
+/* Values for TTM.run.phase; see "Checkpoints" */
+#define RUN_NONE 0
+#define RUN_E 1 /* scanning a -e string */
+#define RUN_P 2 /* scanning the -p file */
+
+/* Kinds of compressed file; see openCodec() */
+#define CODEC_GZIP 1
+#define CODEC_ZSTD 2
+
+/* Max # of files open at once through #<fopen> */
+#define MAXHANDLES 32
+
+/* Under -Xm, bodies smaller than this (in bytes) are never spilled */
+#define SPILLMIN (1<<16)
+
+/* Max # of things a builtin holds at once; see holdScratch() */
+#define MAXSCRATCH 16
+
+/* Kinds of TTM.recover.scratch entry */
+#define SCRATCHMEMORY 0 /* free() */
+#define SCRATCHFILE 1 /* fclose() */
+#define SCRATCHCODEC 2 /* closeCodec() */
+#define SCRATCHBUFFER 3 /* freeBuffer() */
+#define SCRATCHMAP 4 /* munmap() */
+
 #define HASHSIZE 128
 
+/* Size of the builtin perfect hash table and of its displacement table;
+   both must be powers of 2; see the "Builtin Dispatch" section */
+#define BUILTINHASHSIZE 256
+#define BUILTINDISPSIZE 64
+
 /*Mnemonics*/
 #define NESTED 1
 #define KEEPESCAPE 1
@@ -188,6 +304,7 @@ Constants
 #define FLAG_EXIT  1
 #define FLAG_TRACE 2
 #define FLAG_BARE 4 /* Do not do startup initializations */
+#define FLAG_EMIT 8 /* Write out passive text as it is finished */
 
 /**************************************************/
 /* Error Numbers */
@@ -204,18 +321,16 @@ EMANYSEGMARKS   =  8, /* Too Many Segment Marks */
 EMEMORY         =  9, /* Dynamic Storage Overflow */
 EPARMROLL       = 10, /* Parm Roll Overflow */
 EINPUTROLL      = 11, /* Input Roll Overflow */
-#ifdef IMPLEMENTED
 EDUPLIBNAME     = 12, /* Name Already On Library */
 ELIBNAME        = 13, /* Name Not On Library */
 ELIBSPACE       = 14, /* No Space On Library */
 EINITIALS       = 15, /* Initials Not Allowed */
 EATTACH         = 16, /* Could Not Attach */
-#endif
 EIO             = 17, /* An I/O Error Occurred */
 #ifdef IMPLEMENTED
 ETTM            = 18, /* A TTM Processing Error Occurred */
-ESTORAGE        = 19, /* Error In Storage Format */
 #endif
+ESTORAGE        = 19, /* Error In Storage Format */
 ENOTNEGATIVE    = 20, 
 /* Error messages new to this implementation */
 ESTACKOVERFLOW  = 30, /* Leave room */
@@ -232,6 +347,11 @@ EUTF32          = 40, /* Illegal utf-32 character set */
 ETTMCMD         = 41, /* Illegal #<ttm> command */
 ETIME           = 42, /* gettimeofday failed */
 EEXECCOUNT	= 43, /* too many execution calls */
+ETHREAD         = 44, /* could not start an I/O thread */
+EHANDLE         = 45, /* unknown, busy or misused file handle */
+EOPEN           = 46, /* cannot open file */
+ECODEC          = 47, /* cannot read or write a compressed file */
+ECHECKPOINT     = 48, /* cannot take or resume a checkpoint */
 /* Default case */
 EOTHER          = 99
 } ERR;
@@ -271,11 +391,14 @@ EOTHER          = 99
 Structure Type declarations
 */
 
-typedef struct TTM TTM;
 typedef struct Name Name;
 typedef struct Charclass Charclass;
 typedef struct Frame Frame;
 typedef struct Buffer Buffer;
+typedef struct Pipe Pipe;
+typedef struct Diversion Diversion;
+typedef struct Codec Codec;
+typedef struct Base Base;
 
 typedef void (*TTMFCN)(TTM*, Frame*);
 
@@ -298,19 +421,68 @@ static void hashRemove(struct HashTable* table, struct HashEntry* prev, struct H
 static void hashInsert(struct HashTable* table, struct HashEntry* prev, struct HashEntry* entry);
 
 /**************************************************/
+
+/* A cached #<include> file; see includeFile() */
+struct Included {
+    struct Included* next;
+    char* path; /* canonical */
+    time_t mtime;
+    long size; /* bytes */
+    utf32* text;
+    size_t length;
+};
+
+/* A block of diverted output; see #<divert> */
+struct Block {
+    struct Block* next;
+    char_t* bytes; /* utf-8 */
+    size_t length;
+};
+
+struct Diversion {
+    Diversion* next;
+    utf32* name;
+    struct Block* first;
+    struct Block* last;
+    struct Writer* writer; /* encodes text into blocks */
+};
+
 /**
 TTM state object
 */
 
 struct TTM {
     struct Limits {
-        unsigned int buffersize;
+        size_t buffersize;
         unsigned int stacksize;
         unsigned int execcount;
+        unsigned int execlimit; /* execcount as set; ttm_eval() restores it */
+        unsigned int pipeslots; /* -Xp; 0 => no I/O threads */
+        size_t membudget; /* -Xm; 0 => no limit on body memory */
     } limits;
     unsigned int flags;
     unsigned int exitcode;
     unsigned int crcounter; /* for cr marks */
+    /* The command line options; each list is null terminated */
+    struct Options {
+        char* e[MAXEOPTIONS+1]; /* -e strings */
+        char* args[MAXARGS+1]; /* for #<argv>; args[0] is the program */
+        char* include[MAXINCLUDES+1]; /* -I directories */
+    } options;
+    /* Where fail() goes instead of exiting; see ttm_eval() */
+    struct Recover {
+        jmp_buf* jump; /* NULL => report the error and exit */
+        ERR err; /* the error that ended the evaluation */
+        char msg[256];
+        unsigned int tries; /* #<try> bodies being scanned */
+        /* What the running builtins hold; see holdScratch() */
+        struct Scratch {
+            int kind;
+            void* ptr;
+            size_t size; /* of a SCRATCHMAP mapping */
+        } scratch[MAXSCRATCH];
+        unsigned int nscratch;
+    } recover;
     utf32 sharpc; /* sharp-like char */
     utf32 openc; /* <-like char */
     utf32 closec; /* >-like char */
@@ -328,6 +500,133 @@ struct TTM {
     /* Following 2 fields are hashtables indexed by low order 7 bits of some character */
     struct HashTable dictionary;
     struct HashTable charclasses;
+    /* Frozen names shared with other TTMs, consulted after the
+       dictionary; NULL => none.  See freezeDictionary() */
+    Base* base;
+    /* shadow[i] != 0 => the i'th static builtin has been redefined
+       or erased and the dictionary is authoritative for its name */
+    unsigned char shadow[BUILTINHASHSIZE];
+    /* Bodies spilled to a temporary file; see "Spilling" */
+    struct Spill {
+        size_t inuse; /* bytes of malloc'd bodies */
+        unsigned long clock; /* ticks at each dictionary lookup */
+        int fd; /* the temporary file; -1 until first needed */
+        size_t end; /* bytes used in the file */
+        size_t live; /* bodies mapped from the file */
+    } spill;
+    /* The snapshot loaded by -L, if any */
+    struct Snapshot {
+        void* image; /* contents of the snapshot file */
+        size_t size;
+        int mmapped; /* 1 => image was mmap'd, else malloc'd */
+        Name* names; /* arena holding the snapshot's Name records */
+    } snapshot;
+    /* Decoded, but not yet consumed, characters from the -f file */
+    struct Reader {
+        utf32 chars[READBLOCKSIZE];
+        unsigned int next; /* next character to return */
+        unsigned int count; /* characters in chars */
+        unsigned char carry[MAXCHARSIZE]; /* partial utf-8 sequence */
+        unsigned int ncarry;
+        Codec* codec; /* != NULL => the -f file is compressed */
+        unsigned long long offset; /* bytes read from the -f file */
+    } reader;
+    /* Cards (lines of the -f file) for #<cd>, #<pk> and #<for> */
+    struct Cards {
+        utf32* text; /* the next card, once read */
+        size_t length;
+        size_t alloc;
+        int ahead; /* 1 => text holds the next card */
+        struct CardSwitch {
+            int sup; /* 1 => suppress trailing blanks */
+            unsigned int cols; /* # of columns returned */
+        } cd, pk;
+        int forsup; /* like CardSwitch.sup, for #<for> */
+        int foreol; /* 1 => put a newline between continued cards */
+    } cards;
+    /* The -p file while it is being scanned; see refill() */
+    struct Source {
+        FILE* file; /* NULL => the buffer holds all of its input */
+        int eof; /* 1 => file has been read to its end */
+        unsigned char bytes[READBLOCKSIZE+MAXCHARSIZE];
+        size_t next; /* next byte to decode or pass through */
+        size_t count; /* bytes read into bytes */
+        Pipe* pipe; /* != NULL => read by a thread; see -Xp */
+        Codec* codec; /* != NULL => the file is compressed */
+        unsigned long long offset; /* bytes read from the file */
+    } source;
+    /* What main() is running, for #<ttm;checkpoint> */
+    struct Run {
+        int phase; /* RUN_NONE, RUN_E or RUN_P */
+        char** rest; /* the -e strings after this one, in RUN_E */
+        char* pfile; /* the -p file, if any */
+        char* ffile; /* the -f file, if any */
+    } run;
+    /* Buffered, utf-8 encoded output; see writerFor() */
+    struct Writer {
+        FILE* file;
+        int fd; /* >= 0 => written with write(2), bypassing stdio */
+        char_t* bytes;
+        size_t length; /* bytes waiting to be written */
+        size_t alloc;
+        Pipe* pipe; /* != NULL => written by a thread; see -Xp */
+        Diversion* keep; /* != NULL => blocks are kept; see #<divert> */
+        Codec* codec; /* != NULL => compressed on the way out */
+        TTMSink* sink; /* != NULL => written to this; see ttm_eval() */
+    } writers[NWRITERS];
+    /* The program library declared by #<libs> */
+    struct Library {
+        char* filename;
+        utf32* initials; /* qualify program names */
+        FILE* file; /* NULL until first used */
+    } library;
+    /* Files opened by #<fopen>; see the File Handles section */
+    struct Handle {
+        utf32* name; /* NULL => slot is free */
+        FILE* file;
+        int writing; /* 1 => opened for writing, else reading */
+        unsigned char* bytes; /* read buffer */
+        size_t next; /* next byte to decode */
+        size_t count; /* bytes read into bytes */
+        Codec* codec; /* != NULL => read compressed */
+        struct Writer writer;
+    } handles[MAXHANDLES];
+    /* Finished text held back by #<divert>; see the Diversions section */
+    struct Diversions {
+        Diversion* list; /* in order of creation */
+        Diversion* current; /* NULL => the output */
+        size_t sent; /* characters of the buffer already delivered */
+    } diversions;
+    /* Decoded #<include> files; see includeFile() */
+    struct Includes {
+        struct Included* files; /* most recently used first */
+        unsigned long chars; /* total size of the cached text */
+        unsigned long hits;
+        unsigned long misses;
+    } includes;
+    /* A builtin may leave its value here, in storage that it
+       owns, instead of copying it into ttm->result; see exec() */
+    struct Value {
+        utf32* text;
+        size_t length;
+    } value;
+};
+
+/**
+A dictionary frozen by freezeDictionary() so that several TTMs
+can share it, each with a dictionary of its own over it.
+Its names are all readonly: a TTM that changes one changes a
+private copy of its record, which shares the body until the body
+itself is changed (see privateName()), and one that erases one
+puts a tombstone over it (see eraseName()).
+*/
+struct Base {
+    struct HashTable dictionary;
+    struct Snapshot snapshot; /* the -L snapshot its names may point into */
+    unsigned int refs; /* TTMs using it */
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock; /* for refs */
+#endif
 };
 
 /**
@@ -339,9 +638,9 @@ we can use pointers into the buffer space in e.g. struct Name.
  */
 
 struct Buffer {
-    unsigned int alloc;  /* including trailing NUL */
-    unsigned int length;  /* including trailing NUL; defines what of
-                             the allocated space is actual content. */
+    size_t alloc;  /* including trailing NUL */
+    size_t length;  /* including trailing NUL; defines what of
+                       the allocated space is actual content. */
     utf32* active; /* characters yet to be scanned */
     utf32* passive; /* characters that will never be scanned again */
     utf32* end; /* into content */
@@ -356,6 +655,7 @@ struct Frame {
   utf32* argv[MAXARGS+1];
   unsigned int argc;
   int active; /* 1 => # 0 => ## */
+  utf32* passive; /* bb->passive when the call began */
 };
 
 /**
@@ -373,16 +673,37 @@ struct Name {
     int trace;
     int locked;
     int builtin;
+    int readonly; /* static builtin record; shared, never modified */
     unsigned int minargs;
     unsigned int maxargs;
     int novalue; /* must always return no value */
-    unsigned int residual;
+    size_t residual;
     unsigned int maxsegmark; /* highest segment mark number
                                 in use in this string */
     TTMFCN fcn; /* builtin == 1 */
-    utf32* body; /* builtin == 0 */
+    void* body; /* builtin == 0; see "String Bodies" */
+    unsigned int mapped; /* parts that live in a snapshot image */
+    int kind; /* bytes per character of body: 1, 2 or 4 */
+    size_t length; /* characters in body */
+    struct Mark* marks; /* kind < 4: the marks in body, by position */
+    size_t nmarks;
+    unsigned long lastuse; /* ttm->spill.clock when last looked up */
+    int tombstone; /* erased; hides the name of the same name in ttm->base */
+};
+
+/* A segment or create mark in a 1 or 2 byte body */
+struct Mark {
+    size_t pos;
+    utf32 mark;
 };
 
+/* Values for Name.mapped; such parts are never freed or reallocated */
+#define MAPPEDNAME 1 /* entry.name points into the image */
+#define MAPPEDBODY 2 /* body points into the image */
+#define MAPPEDREC  4 /* the record itself is in the snapshot arena */
+#define SPILLEDBODY 8 /* body is mapped from the spill file */
+#define SHAREDBODY 16 /* body and marks are those of a name in ttm->base */
+
 /**
 Character Classes  and the Charclass table
 */
@@ -396,20 +717,43 @@ struct Charclass {
 /**************************************************/
 /* Forward */
 
-static TTM* newTTM(long,long,long);
+static TTM* newTTM(size_t,long,long);
+static void initTTM(TTM*,size_t,long,long);
+static void cloneTTM(TTM*,TTM*);
 static void freeTTM(TTM*);
-static Buffer* newBuffer(TTM*, unsigned intbuffersize);
+static void freeDictionary(TTM*);
+static void freezeDictionary(TTM*);
+static void releaseBase(TTM*);
+static void freeOptions(char** list);
+static Buffer* newBuffer(TTM*, size_t buffersize);
 static void freeBuffer(TTM*, Buffer* bb);
-static void expandBuffer(TTM*, Buffer* bb, unsigned int len);
+static void expandBuffer(TTM*, Buffer* bb, size_t len);
 static void resetBuffer(TTM*, Buffer* bb);
-static void setBufferLength(TTM*, Buffer* bb, unsigned int len);
+static void setBufferLength(TTM*, Buffer* bb, size_t len);
 static Frame* pushFrame(TTM*);
 static Frame* popFrame(TTM*);
 static Name* newName(TTM*);
 static void freeName(TTM*, Name* f);
+static void setBody(TTM*, Name* str, utf32* s, size_t len);
+static void freeBody(TTM*, Name* str);
+static size_t bodySize(Name* str);
+static void spillBodies(TTM*, Name* keep);
+static utf32 bodyAt(Name* str, size_t i);
+static utf32 bodyNext(Name* str, size_t i, size_t* markp);
+static void bodyChars(Name* str, size_t from, size_t n, utf32* dst);
+static int bodyMatch(Name* str, size_t i, utf32* s, size_t len);
+static utf32* unpackBody(TTM*, Name* str);
+static void appendBody(TTM*, Name* str, utf32* s, size_t len);
+static void dupBody(TTM*, Name* dst, Name* src);
 static int dictionaryInsert(TTM*, Name* str);
 static Name* dictionaryLookup(TTM*, utf32* name);
 static Name* dictionaryRemove(TTM*, utf32* name);
+static Name* privateName(TTM*, Name* str);
+static void eraseName(TTM*, utf32* name);
+static int hiddenName(TTM*, Name* str);
+static Name* builtinLookup(TTM*, utf32* name);
+static int builtinIndex(utf32* name);
+static Name* builtinName(int index);
 static Charclass* newCharclass(TTM*);
 static void freeCharclass(TTM*, Charclass* cl);
 static int charclassInsert(TTM*, Charclass* cl);
@@ -418,13 +762,55 @@ static Charclass* charclassRemove(TTM*, utf32* name);
 static int charclassMatch(utf32 c, utf32* charclass);
 static void scan(TTM*);
 static void exec(TTM*, Buffer* bb);
+static void invoke(TTM*, Buffer* bb, Frame* frame);
+static void resumeCalls(TTM*, unsigned int level);
 static void parsecall(TTM*, Frame*);
-static void call(TTM*, Frame*, utf32* body);
+static void call(TTM*, Frame*, Name* str);
 static void printstring(TTM*, FILE* output, utf32* s32);
+static void writestring(TTM*, struct Writer* w, utf32* s32);
+static struct Writer* writerFor(TTM*, FILE* f);
+static void initWriter(TTM*, struct Writer* w, FILE* f, int fd, size_t size);
+static void writeChars(TTM*, struct Writer* w, utf32* s, size_t len);
+static void writeBytes(TTM*, struct Writer* w, char_t* p, size_t len);
+static void writeOut(TTM*, struct Writer* w, char_t* p, size_t len);
+static int writeAll(FILE* f, int fd, Codec* z, char_t* p, size_t len);
+static int compressedFile(FILE* f);
+static int compressedName(const char* name);
+static int haveCodec(int kind);
+static Codec* openCodec(TTM*, FILE* f, int kind, int writing);
+static long readCodec(Codec* z, unsigned char* dst, size_t n);
+static int writeCodec(Codec* z, char_t* p, size_t len);
+static int closeCodec(Codec* z);
+static long readBytes(FILE* f, Codec* z, unsigned char* dst, size_t n);
+static size_t readBlock(TTM*, FILE* f, Codec* z, unsigned char* dst, size_t n);
+static Codec* readerCodec(TTM*, FILE* f);
+static void sendWriter(TTM*, struct Writer* w);
+#ifdef HAVE_PTHREADS
+static Pipe* newPipe(TTM*, unsigned int nslots, size_t blocksize, FILE* f, int fd);
+static void freePipe(Pipe*);
+static void passBlock(TTM*, struct Writer* w);
+static void drainPipe(TTM*, Pipe* pp);
+static size_t pipeRead(TTM*, Pipe* pp, unsigned char* dst);
+static void startReaderPipe(TTM*, struct Source* src);
+static void stopReaderPipe(TTM*, struct Source* src);
+static void startWriterPipe(TTM*, struct Writer* w);
+static void stopWriterPipe(TTM*, struct Writer* w);
+#endif
+static void flushWriter(TTM*, struct Writer* w);
+static void flushOutput(TTM*);
+static struct Writer* outputWriter(TTM*);
+static void deliver(TTM*, utf32* upto);
+static Diversion* findDiversion(TTM*, utf32* name, int create);
+static void keepBlock(TTM*, struct Writer* w);
+static void undivert(TTM*, Diversion* d);
+static void freeDiversions(TTM*);
+static void ttm_divert(TTM*, Frame*);
+static void ttm_undivert(TTM*, Frame*);
 static void ttm_ap(TTM*, Frame*);
 static void ttm_cf(TTM*, Frame*);
 static void ttm_cr(TTM*, Frame*);
 static void ttm_ds(TTM*, Frame*);
+static Name* defineName(TTM*, utf32* name);
 static void ttm_es(TTM*, Frame*);
 static int ttm_ss0(TTM*, Frame*);
 static void ttm_sc(TTM*, Frame*);
@@ -466,7 +852,13 @@ static void ttm_psr(TTM*, Frame*);
 static void ttm_rs(TTM*, Frame*);
 static void ttm_pf(TTM*, Frame*);
 static void ttm_cm(TTM*, Frame*);
+static unsigned int cardSwitch(TTM*, utf32* arg, long long lo, long long hi);
 static void ttm_classes(TTM*, Frame*);
+static void ttm_store(TTM*, Frame*);
+static void ttm_delete(TTM*, Frame*);
+static void ttm_copy(TTM*, Frame*);
+static void ttm_show(TTM*, Frame*);
+static void ttm_libs(TTM*, Frame*);
 static void ttm_names(TTM*, Frame*);
 static void ttm_exit(TTM*, Frame*);
 static void ttm_ndf(TTM*, Frame*);
@@ -479,10 +871,32 @@ static void ttm_tn(TTM*, Frame*);
 static void ttm_argv(TTM*, Frame*);
 static void ttm_argc(TTM*, Frame*);
 static void ttm_include(TTM*, Frame*);
+static void ttm_load(TTM*, Frame*);
+static int outsidePath(const char* name);
+static FILE* openInclude(TTM*, const char* name, char* path, size_t pathsize);
+static void includeFile(TTM*, const char* name);
+static utf32* loadFile(TTM*, const char* name);
+static void ttm_fopen(TTM*, Frame*);
+static void ttm_readln(TTM*, Frame*);
+static void ttm_fwrite(TTM*, Frame*);
+static void ttm_fclose(TTM*, Frame*);
+static struct Handle* findHandle(TTM*, utf32* name);
+static size_t fillHandle(TTM*, struct Handle* h);
+static void closeHandle(TTM*, struct Handle* h);
+static void closeHandles(TTM*);
+static void freeIncludes(TTM*);
+static void ttm_ttm_info_include(TTM*, Frame*);
 static void ttm_lf(TTM*, Frame*);
 static void ttm_uf(TTM*, Frame*);
+static void ttm_try(TTM*, Frame*);
 static void fail(TTM*, ERR eno);
 static void fatal(TTM*, const char* msg);
+static void* holdScratch(TTM*, int kind, void* ptr, size_t size);
+static void dropScratch(TTM*, void* ptr);
+static void keepScratch(TTM*, void* ptr);
+static void releaseScratch(TTM*, unsigned int mark);
+static void freeScratch(TTM*, struct Scratch* s);
+static int unholdScratch(TTM*, void* ptr, struct Scratch* s);
 static const char* errstring(ERR err);
 static int int2string(utf32* dst, long long n);
 static ERR toInt64(utf32* s, long long* lp);
@@ -495,24 +909,57 @@ static void dbgprint32(utf32* s, char quote);
 static void dbgprint32c(utf32 c, char quote);
 static int getOptionNameLength(char** list);
 static int pushOptionName(char* option, unsigned int max, char** list);
-static void initglobals();
 static void usage(const char*);
 static void readinput(TTM*, const char* filename,Buffer* bb);
+static void openinput(TTM*, const char* filename, unsigned long long skip);
+static void skipBytes(TTM*, FILE* f, Codec* z, unsigned long long n);
+static void closeinput(TTM*);
+static void compact(TTM*, Buffer* bb);
+static int refill(TTM*, Buffer* bb, int passthrough);
+static int moreinput(TTM*, Buffer* bb, int passthrough);
+static void lookahead(TTM*, Buffer* bb, unsigned int n);
+static void emit(TTM*, Buffer* bb, unsigned int atleast);
 static int readbalanced(TTM*);
 static void printbuffer(TTM*);
-static int readfile(TTM*, FILE* file, Buffer* bb);
+static size_t readfile(TTM*, FILE* file, Buffer* bb);
+static utf32 readc32(TTM*);
+static int fillReader(TTM*);
+static int readCard(TTM*);
+static void appendCard(TTM*, utf32* s, size_t len);
+static unsigned int cardLength(TTM*, unsigned int from, unsigned int cols, int sup);
+static void ttm_cd(TTM*, Frame*);
+static void ttm_cdsw(TTM*, Frame*);
+static void ttm_for(TTM*, Frame*);
+static void ttm_forsw(TTM*, Frame*);
+static void ttm_pk(TTM*, Frame*);
+static void ttm_pksw(TTM*, Frame*);
+static void saveSnapshot(TTM*, const char* filename);
+static utf32* loadSnapshot(TTM*, const char* filename);
+static void writeSnapshot(TTM*, FILE* f);
+static void saveCheckpoint(TTM*, const char* filename);
+static void restoreCheckpoint(TTM*, const char* filename);
+static void resumeScan(TTM*);
+static void freeSnapshot(TTM*);
+static void libraryClose(TTM*);
+static void libraryStore(TTM*, utf32* prog, utf32* namelist);
+static void libraryDelete(TTM*, utf32* prog);
+static void libraryCopy(TTM*, utf32* prog);
+static void libraryShow(TTM*, utf32* initials);
 
 /* utf32 replacements for common unix strXXX functions */
-static unsigned int strlen32(utf32* s);
+static size_t strlen32(utf32* s);
 static void strcpy32(utf32* dst, utf32* src);
-static void strncpy32(utf32* dst, utf32* src, unsigned int len);
+static void strncpy32(utf32* dst, utf32* src, size_t len);
 static utf32* strdup32(utf32* src);
 static int strcmp32(utf32* s1, utf32* s2);
-static int strncmp32(utf32* s1, utf32* s2, unsigned int len);
-static void memcpy32(utf32* dst, utf32* src, int len);
+static int strncmp32(utf32* s1, utf32* s2, size_t len);
+static void memcpy32(utf32* dst, utf32* src, size_t len);
 /* Read/Write Management */
 static void fputc32(utf32 c, FILE* f);
 static utf32 fgetc32(FILE* f);
+static size_t decode8(TTM*, unsigned char* src, size_t srclen, utf32* dst, size_t dstlen, size_t* usedp);
+static size_t span8(TTM*, unsigned char* src, size_t srclen, int s1, int s2, int s3);
+static int encode8(utf32* src, size_t srclen, char_t* dst, size_t dstlen, size_t* usedp);
 
 /* UTF32 <-> char management */
 static int streq32ascii(utf32* s32, char_t* s8);
@@ -523,12 +970,6 @@ static int toString32(utf32* dst, char_t* src, int len);
 #ifndef ISO_8859
 static int utf8count(unsigned int c);
 #endif
-/**************************************************/
-/* Global variables */
-
-static char* eoptions[MAXEOPTIONS+1]; /* null terminated */
-static char* argoptions[MAXARGS+1]; /* null terminated */
-
 /**************************************************/
 /**
 HashTable Management.  The table is only pseudo-hash
@@ -603,6 +1044,9 @@ hashInsert(struct HashTable* table, struct HashEntry* prev, struct HashEntry* en
 /**************************************************/
 /* Provide subtype specific wrappers for the HashTable operations. */
 
+/* The static builtins are consulted first;
+   see builtinLookup for how user redefinitions are handled.
+   Then the dictionary, and then any base under it. */
 static Name*
 dictionaryLookup(TTM* ttm, utf32* name)
 {
@@ -611,10 +1055,16 @@ dictionaryLookup(TTM* ttm, utf32* name)
     struct HashEntry* entry;
     Name* def = NULL;
 
+    if((def = builtinLookup(ttm,name)) != NULL)
+        return def;
     if(hashLocate(table,name,&prev)) {
 	entry = prev->next;
 	def = (Name*)entry;
-    } /*else Not found */
+        if(def->tombstone) return NULL;
+        def->lastuse = ++ttm->spill.clock;
+    } else if(ttm->base != NULL && hashLocate(&ttm->base->dictionary,name,&prev))
+        def = (Name*)prev->next; /* shared, so lastuse is left alone */
+    /*else Not found */
     return def;
 }
 
@@ -640,15 +1090,75 @@ dictionaryInsert(TTM* ttm, Name* str)
 {
     struct HashTable* table = &ttm->dictionary;
     struct HashEntry* prev;    
-
-    if(hashLocate(table,str->entry.name,&prev))
-	return 0;
+    int index;
+
+    if(hashLocate(table,str->entry.name,&prev)) {
+        Name* old = (Name*)prev->next;
+        if(!old->tombstone)
+	    return 0;
+        /* Replaces the tombstone, and so still hides the base */
+        hashRemove(table,prev,prev->next);
+        freeName(ttm,old);
+    }
     /* Does not already exist */
     computehash(str->entry.hash,str->entry.name);/*make sure*/
     hashInsert(table,prev,(struct HashEntry*)str);
+    /* From now on, the dictionary speaks for any builtin of this name */
+    if((index = builtinIndex(str->entry.name)) >= 0)
+        ttm->shadow[index] = 1;
     return 1;
 }
 
+/* Static builtin records and the names of a base are shared
+   and must never be modified; return a private copy, entered
+   into the dictionary, of any such record so that it can be changed.
+   The copy of a base name shares its body, which setBody() and
+   appendBody() replace rather than change, so that moving the
+   residual costs only the record.
+*/
+static Name*
+privateName(TTM* ttm, Name* str)
+{
+    Name* copy;
+
+    if(!str->readonly) return str;
+    copy = newName(ttm);
+    *copy = *str;
+    copy->readonly = 0;
+    copy->mapped = 0;
+    copy->entry.name = strdup32(str->entry.name);
+    copy->entry.next = NULL;
+    if(!copy->builtin && copy->body != NULL)
+        copy->mapped = SHAREDBODY;
+    if(!dictionaryInsert(ttm,copy))
+        fatal(ttm,"Dictionary insertion failed");
+    return copy;
+}
+
+/* Remove the name from the dictionary; if the base has a name
+   of the same name, leave a tombstone in its place to hide it */
+static void
+eraseName(TTM* ttm, utf32* name)
+{
+    Name* str = dictionaryRemove(ttm,name);
+
+    if(str != NULL) freeName(ttm,str);
+    if(ttm->base != NULL && hashLocate(&ttm->base->dictionary,name,NULL)) {
+        str = newName(ttm);
+        str->tombstone = 1;
+        str->entry.name = strdup32(name);
+        if(str->entry.name == NULL) fail(ttm,EMEMORY);
+        dictionaryInsert(ttm,str);
+    }
+}
+
+/* Whether str, a name of ttm->base, is hidden by the dictionary */
+static int
+hiddenName(TTM* ttm, Name* str)
+{
+    return hashLocate(&ttm->dictionary,str->entry.name,NULL);
+}
+
 static Charclass*
 charclassLookup(TTM* ttm, utf32* name)
 {
@@ -698,13 +1208,23 @@ charclassInsert(TTM* ttm, Charclass* cl)
 /**************************************************/
 
 static TTM*
-newTTM(long buffersize, long stacksize, long execcount)
+newTTM(size_t buffersize, long stacksize, long execcount)
 {
     TTM* ttm = (TTM*)calloc(1,sizeof(TTM));
     if(ttm == NULL) return NULL;
+    initTTM(ttm,buffersize,stacksize,execcount);
+    return ttm;
+}
+
+/* Set up a zeroed TTM */
+static void
+initTTM(TTM* ttm, size_t buffersize, long stacksize, long execcount)
+{
+    ttm->spill.fd = -1; /* before anything can fail */
     ttm->limits.buffersize = buffersize;
     ttm->limits.stacksize = stacksize;
     ttm->limits.execcount = execcount;
+    ttm->limits.execlimit = ttm->limits.execcount;
     ttm->sharpc = (utf32)'#';
     ttm->openc = (utf32)'<';
     ttm->closec = (utf32)'>';
@@ -718,32 +1238,263 @@ newTTM(long buffersize, long stacksize, long execcount)
     if(ttm->stack == NULL) fail(ttm,EMEMORY);
     memset((void*)&ttm->dictionary,0,sizeof(ttm->dictionary));
     memset((void*)&ttm->charclasses,0,sizeof(ttm->charclasses));
+    initWriter(ttm,&ttm->writers[WSTDOUT],stdout,-1,WRITEBLOCKSIZE);
+    initWriter(ttm,&ttm->writers[WSTDERR],stderr,-1,WRITEBLOCKSIZE);
+    ttm->cards.cd.sup = 1;
+    ttm->cards.cd.cols = CARDCOLUMNS;
+    ttm->cards.pk = ttm->cards.cd;
+    ttm->cards.forsup = 1;
 #ifdef DEBUG
     ttm->flags |= FLAG_TRACE;
 #endif
-    return ttm;
+}
+
+/**
+Set up a zeroed TTM as a copy of base, as base stands between
+runs: its limits, special characters, switches and options, its
+names and character classes, and any text its -e strings left
+in the buffer.  The names of base->base are shared, not copied;
+see freezeDictionary().  Nothing of base is changed, so several
+TTMs may be cloned from it at once; see runBatch().
+*/
+static void
+cloneTTM(TTM* ttm, TTM* base)
+{
+    struct HashEntry* entry;
+    Name* str;
+    Name* copy;
+    Charclass* cl;
+    Charclass* clcopy;
+    size_t pending;
+    int i;
+
+    initTTM(ttm,base->limits.buffersize,(long)base->limits.stacksize,
+            (long)base->limits.execlimit);
+    ttm->flags = base->flags & ~(FLAG_EXIT|FLAG_EMIT);
+    ttm->crcounter = base->crcounter;
+    ttm->sharpc = base->sharpc;
+    ttm->openc = base->openc;
+    ttm->closec = base->closec;
+    ttm->semic = base->semic;
+    ttm->escapec = base->escapec;
+    ttm->metac = base->metac;
+    ttm->cards.cd = base->cards.cd;
+    ttm->cards.pk = base->cards.pk;
+    ttm->cards.forsup = base->cards.forsup;
+    ttm->cards.foreol = base->cards.foreol;
+    for(i=0;base->options.e[i] != NULL;i++)
+        pushOptionName(base->options.e[i],MAXEOPTIONS,ttm->options.e);
+    for(i=0;base->options.args[i] != NULL;i++)
+        pushOptionName(base->options.args[i],MAXARGS,ttm->options.args);
+    for(i=0;base->options.include[i] != NULL;i++)
+        pushOptionName(base->options.include[i],MAXINCLUDES,ttm->options.include);
+    if(base->library.filename != NULL
+       && (ttm->library.filename = strdup(base->library.filename)) == NULL)
+        fail(ttm,EMEMORY);
+    if(base->library.initials != NULL
+       && (ttm->library.initials = strdup32(base->library.initials)) == NULL)
+        fail(ttm,EMEMORY);
+    memcpy((void*)ttm->shadow,(void*)base->shadow,sizeof(ttm->shadow));
+    if(base->base != NULL) {
+#ifdef HAVE_PTHREADS
+        pthread_mutex_lock(&base->base->lock);
+#endif
+        base->base->refs++;
+#ifdef HAVE_PTHREADS
+        pthread_mutex_unlock(&base->base->lock);
+#endif
+        ttm->base = base->base;
+    }
+    for(i=0;i<HASHSIZE;i++) {
+        for(entry=base->dictionary.table[i].next;entry != NULL;entry=entry->next) {
+            str = (Name*)entry;
+            copy = newName(ttm);
+            *copy = *str;
+            copy->entry.next = NULL;
+            copy->mapped = 0;
+            copy->body = NULL;
+            copy->marks = NULL;
+            copy->nmarks = 0;
+            copy->entry.name = strdup32(str->entry.name);
+            if(copy->entry.name == NULL) fail(ttm,EMEMORY);
+            if(str->mapped & SHAREDBODY) {
+                /* ttm has the same base, so may share it too */
+                copy->body = str->body;
+                copy->marks = str->marks;
+                copy->nmarks = str->nmarks;
+                copy->mapped = SHAREDBODY;
+            } else if(!copy->builtin)
+                dupBody(ttm,copy,str);
+            if(!dictionaryInsert(ttm,copy))
+                fatal(ttm,"Dictionary insertion failed");
+        }
+        for(entry=base->charclasses.table[i].next;entry != NULL;entry=entry->next) {
+            cl = (Charclass*)entry;
+            clcopy = newCharclass(ttm);
+            clcopy->negative = cl->negative;
+            clcopy->entry.name = strdup32(cl->entry.name);
+            clcopy->characters = strdup32(cl->characters);
+            if(clcopy->entry.name == NULL || clcopy->characters == NULL)
+                fail(ttm,EMEMORY);
+            if(!charclassInsert(ttm,clcopy))
+                fatal(ttm,"Dictionary insertion failed");
+        }
+    }
+    pending = (size_t)(base->buffer->passive - base->buffer->content);
+    setBufferLength(ttm,ttm->buffer,pending);
+    memcpy((void*)ttm->buffer->content,(void*)base->buffer->content,
+           pending*sizeof(utf32));
+    ttm->buffer->passive = ttm->buffer->content + pending;
 }
 
 static void
 freeTTM(TTM* ttm)
 {
-    freeBuffer(ttm,ttm->buffer);
-    freeBuffer(ttm,ttm->result);
+    int i;
+    releaseScratch(ttm,0); /* if a builtin failed for good */
+    if(ttm->buffer != NULL)
+        freeBuffer(ttm,ttm->buffer);
+    if(ttm->result != NULL)
+        freeBuffer(ttm,ttm->result);
     if(ttm->stack != NULL)
         free(ttm->stack);
+    for(i=0;i<NWRITERS;i++) {
+        if(ttm->writers[i].bytes != NULL)
+            free(ttm->writers[i].bytes);
+    }
+    freeDictionary(ttm); /* before the snapshot it may point into */
+    freeSnapshot(ttm);
+    releaseBase(ttm);
+    freeIncludes(ttm);
+    closeHandles(ttm);
+    freeDiversions(ttm);
+#ifndef MSWINDOWS
+    if(ttm->spill.fd >= 0)
+        close(ttm->spill.fd);
+#endif
+    if(ttm->cards.text != NULL)
+        free(ttm->cards.text);
+    libraryClose(ttm);
+    if(ttm->library.filename != NULL)
+        free(ttm->library.filename);
+    if(ttm->library.initials != NULL)
+        free(ttm->library.initials);
+    freeOptions(ttm->options.e);
+    freeOptions(ttm->options.args);
+    freeOptions(ttm->options.include);
     free(ttm);
 }
 
+/* Free every name and character class */
+static void
+freeDictionary(TTM* ttm)
+{
+    struct HashEntry* entry;
+    struct HashEntry* next;
+    int i;
+
+    for(i=0;i<HASHSIZE;i++) {
+        for(entry=ttm->dictionary.table[i].next;entry != NULL;entry=next) {
+            next = entry->next;
+            freeName(ttm,(Name*)entry);
+        }
+        ttm->dictionary.table[i].next = NULL;
+        for(entry=ttm->charclasses.table[i].next;entry != NULL;entry=next) {
+            next = entry->next;
+            freeCharclass(ttm,(Charclass*)entry);
+        }
+        ttm->charclasses.table[i].next = NULL;
+    }
+}
+
+/**
+Move the names of the dictionary into a new base, which
+the TTMs cloned from this one then share (see cloneTTM()),
+so that each of them holds only the names it defines or changes.
+Its snapshot, if any, goes with them.  A TTM that already has
+a base keeps it, with its dictionary over it.
+*/
+static void
+freezeDictionary(TTM* ttm)
+{
+    struct HashEntry* entry;
+    Base* base;
+    int i;
+
+    if(ttm->base != NULL) return;
+    base = (Base*)calloc(1,sizeof(Base));
+    if(base == NULL) fail(ttm,EMEMORY);
+    base->dictionary = ttm->dictionary;
+    memset((void*)&ttm->dictionary,0,sizeof(ttm->dictionary));
+    for(i=0;i<HASHSIZE;i++) {
+        for(entry=base->dictionary.table[i].next;entry != NULL;entry=entry->next)
+            ((Name*)entry)->readonly = 1;
+    }
+    base->snapshot = ttm->snapshot;
+    memset((void*)&ttm->snapshot,0,sizeof(ttm->snapshot));
+    base->refs = 1;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&base->lock,NULL);
+#endif
+    ttm->base = base;
+}
+
+/* Stop using ttm->base, and free it if nothing else is */
+static void
+releaseBase(TTM* ttm)
+{
+    Base* base = ttm->base;
+    struct HashEntry* entry;
+    struct HashEntry* next;
+    unsigned int refs;
+    int i;
+
+    if(base == NULL) return;
+    ttm->base = NULL;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&base->lock);
+#endif
+    refs = --base->refs;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&base->lock);
+#endif
+    if(refs > 0) return;
+    for(i=0;i<HASHSIZE;i++) {
+        for(entry=base->dictionary.table[i].next;entry != NULL;entry=next) {
+            next = entry->next;
+            ((Name*)entry)->readonly = 0;
+            freeName(ttm,(Name*)entry);
+        }
+    }
+    /* ttm is going away, and its own snapshot is gone already */
+    ttm->snapshot = base->snapshot;
+    freeSnapshot(ttm);
+#ifdef HAVE_PTHREADS
+    pthread_mutex_destroy(&base->lock);
+#endif
+    free(base);
+}
+
+static void
+freeOptions(char** list)
+{
+    for(;*list != NULL;list++) {
+        free(*list);
+        *list = NULL;
+    }
+}
+
 /**************************************************/
 
 static Buffer*
-newBuffer(TTM* ttm, unsigned int buffersize)
+newBuffer(TTM* ttm, size_t buffersize)
 {
     Buffer* bb;
+    if(buffersize > ((size_t)-1) / sizeof(utf32)) fail(ttm,EBUFFERSIZE);
     bb = (Buffer*)calloc(1,sizeof(Buffer));
     if(bb == NULL) fail(ttm,EMEMORY);
     bb->content = (utf32*)malloc(buffersize*sizeof(utf32));
-    if(bb->content == NULL) fail(ttm,EMEMORY);
+    if(bb->content == NULL) {free(bb); fail(ttm,EMEMORY);}
     bb->alloc = buffersize;
     bb->length = 0;
     bb->active = bb->content;
@@ -762,13 +1513,13 @@ freeBuffer(TTM* ttm, Buffer* bb)
 
 /* Make room for a string of length n at current active position. */
 static void
-expandBuffer(TTM* ttm, Buffer* bb, unsigned int len)
+expandBuffer(TTM* ttm, Buffer* bb, size_t len)
 {
     assert(bb != NULL);
     if((bb->alloc - bb->length) < len) fail(ttm,EBUFFERSIZE);
     if(bb->active < bb->end) {
         /* make room for len characters by moving bb->active and up*/
-        unsigned int tomove = (bb->end - bb->active);
+        size_t tomove = (size_t)(bb->end - bb->active);
         makespace(bb->active+len,bb->active,tomove);
     }
     bb->active += len;
@@ -780,7 +1531,7 @@ expandBuffer(TTM* ttm, Buffer* bb, unsigned int len)
 #if 0
 /* Remove len characters at current position */
 static void
-compressBuffer(TTM* ttm, Buffer* bb, unsigned int len)
+compressBuffer(TTM* ttm, Buffer* bb, size_t len)
 {
     assert(bb != NULL);
     if(len > 0 && bb->active < bb->end) {
@@ -808,7 +1559,7 @@ resetBuffer(TTM* ttm, Buffer* bb)
    If space is added, its content is undefined.
 */
 static void
-setBufferLength(TTM* ttm, Buffer* bb, unsigned int len)
+setBufferLength(TTM* ttm, Buffer* bb, size_t len)
 {
     if(len >= bb->alloc) fail(ttm,EBUFFERSIZE);
     bb->length = len;
@@ -858,10 +1609,395 @@ newName(TTM* ttm)
 static void
 freeName(TTM* ttm, Name* f)
 {
-    assert(f != NULL);
-    if(f->entry.name != NULL) free(f->entry.name);
-    if(!f->builtin && f->body != NULL) free(f->body);
-    free(f);
+    assert(f != NULL && !f->readonly);
+    if(f->entry.name != NULL && !(f->mapped & MAPPEDNAME))
+        free(f->entry.name);
+    if(!f->builtin)
+        freeBody(ttm,f);
+    if(!(f->mapped & MAPPEDREC))
+        free(f);
+}
+
+/**************************************************/
+/* String Bodies */
+
+/**
+A body is stored at 1, 2 or 4 bytes per character (Name.kind),
+the narrowest that holds its widest character, in the manner
+of Python's PEP 393: most templates are ascii, and take a
+quarter of the space they would as utf32.  A segment or create
+mark does not fit in 1 or 2 bytes, so there each mark is stored
+as a 0, which cannot otherwise occur in a body, and its value
+is kept in Name.marks in order of position.  A 4 byte body
+holds its marks in place, and is an ordinary NUL terminated
+utf32 string, which is what a snapshot image provides.
+Characters are fetched by index with bodyAt(), which is O(1)
+except at a mark, or in order with bodyNext().
+*/
+
+/* Return the narrowest kind that holds the len characters of s */
+static int
+bodyKind(utf32* s, size_t len)
+{
+    int kind = 1;
+    size_t i;
+    for(i=0;i<len;i++) {
+        unsigned int c = (unsigned int)s[i];
+        if(ismark(s[i])) continue;
+        if(c > 0xFFFF) return 4;
+        if(c > 0xFF) kind = 2;
+    }
+    return kind;
+}
+
+/* Store the len characters of s at kind bytes apiece,
+   starting at character at of str's body, which must have
+   room for them; marks are appended to str->marks, which
+   must have room for them as well. */
+static void
+packBody(Name* str, size_t at, utf32* s, size_t len)
+{
+    size_t i;
+    utf32 c;
+    switch (str->kind) {
+    case 1: {
+        unsigned char* b = (unsigned char*)str->body + at;
+        for(i=0;i<len;i++) {
+            c = s[i];
+            if(ismark(c)) {
+                str->marks[str->nmarks].pos = at+i;
+                str->marks[str->nmarks++].mark = c;
+                c = NUL32;
+            }
+            b[i] = (unsigned char)c;
+        }
+        b[len] = 0;
+        } break;
+    case 2: {
+        unsigned short* b = (unsigned short*)str->body + at;
+        for(i=0;i<len;i++) {
+            c = s[i];
+            if(ismark(c)) {
+                str->marks[str->nmarks].pos = at+i;
+                str->marks[str->nmarks++].mark = c;
+                c = NUL32;
+            }
+            b[i] = (unsigned short)c;
+        }
+        b[len] = 0;
+        } break;
+    default:
+        memcpy32((utf32*)str->body+at,s,len);
+        ((utf32*)str->body)[at+len] = NUL32;
+        break;
+    }
+}
+
+static size_t
+countMarks(utf32* s, size_t len)
+{
+    size_t i, n = 0;
+    for(i=0;i<len;i++) {if(ismark(s[i])) n++;}
+    return n;
+}
+
+/* Replace the body of str with a copy of the len characters of s */
+static void
+setBody(TTM* ttm, Name* str, utf32* s, size_t len)
+{
+    size_t nmarks;
+    int kind = bodyKind(s,len);
+
+    freeBody(ttm,str);
+    nmarks = (kind < 4 ? countMarks(s,len) : 0);
+    str->body = malloc((len+1)*(size_t)kind);
+    if(str->body == NULL) fail(ttm,EMEMORY);
+    if(nmarks > 0) {
+        str->marks = (struct Mark*)malloc(nmarks*sizeof(struct Mark));
+        if(str->marks == NULL) fail(ttm,EMEMORY);
+    }
+    str->kind = kind;
+    str->length = len;
+    packBody(str,0,s,len);
+    ttm->spill.inuse += bodySize(str);
+    if(ttm->limits.membudget > 0 && ttm->spill.inuse > ttm->limits.membudget)
+        spillBodies(ttm,str);
+}
+
+static void
+freeBody(TTM* ttm, Name* str)
+{
+#ifndef MSWINDOWS
+    if(str->body != NULL && (str->mapped & SPILLEDBODY)) {
+        munmap(str->body,bodySize(str));
+        /* Start the file over once nothing is mapped from it */
+        if(--ttm->spill.live == 0) {
+            ttm->spill.end = 0;
+            if(ftruncate(ttm->spill.fd,0) < 0) {/* just keep the space */}
+        }
+    } else
+#endif
+    if(str->mapped & SHAREDBODY) {
+        /* Neither is ours to free */
+    } else if(str->body != NULL && !(str->mapped & MAPPEDBODY)) {
+        free(str->body);
+        ttm->spill.inuse -= bodySize(str);
+    }
+    if(str->marks != NULL && !(str->mapped & SHAREDBODY))
+        free(str->marks);
+    str->mapped &= ~(MAPPEDBODY|SPILLEDBODY|SHAREDBODY);
+    str->body = NULL;
+    str->marks = NULL;
+    str->nmarks = 0;
+    str->length = 0;
+}
+
+/* Return the index in str->marks of the first mark at or after pos */
+static size_t
+findMark(Name* str, size_t pos)
+{
+    size_t lo = 0, hi = str->nmarks;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if(str->marks[mid].pos < pos) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+/* Return character i (< str->length) of the body of str */
+static utf32
+bodyAt(Name* str, size_t i)
+{
+    utf32 c;
+    switch (str->kind) {
+    case 1: c = ((unsigned char*)str->body)[i]; break;
+    case 2: c = ((unsigned short*)str->body)[i]; break;
+    default: return ((utf32*)str->body)[i];
+    }
+    if(c == NUL32) c = str->marks[findMark(str,i)].mark;
+    return c;
+}
+
+/* As bodyAt, for a walk in order through the body; *markp is
+   the index of the next mark, findMark(str,i) to begin with */
+static utf32
+bodyNext(Name* str, size_t i, size_t* markp)
+{
+    utf32 c;
+    switch (str->kind) {
+    case 1: c = ((unsigned char*)str->body)[i]; break;
+    case 2: c = ((unsigned short*)str->body)[i]; break;
+    default: return ((utf32*)str->body)[i];
+    }
+    if(c == NUL32) c = str->marks[(*markp)++].mark;
+    return c;
+}
+
+/* Copy the n characters of str's body starting at from into dst */
+static void
+bodyChars(Name* str, size_t from, size_t n, utf32* dst)
+{
+    size_t i, m;
+    if(str->kind == 4) {
+        memcpy32(dst,(utf32*)str->body+from,n);
+        return;
+    }
+    m = findMark(str,from);
+    for(i=0;i<n;i++)
+        dst[i] = bodyNext(str,from+i,&m);
+}
+
+/* Return 1 if the len characters of str's body at i are those of s */
+static int
+bodyMatch(Name* str, size_t i, utf32* s, size_t len)
+{
+    size_t j;
+    if(len > str->length || i > str->length - len) return 0;
+    for(j=0;j<len;j++) {
+        if(bodyAt(str,i+j) != s[j]) return 0;
+    }
+    return 1;
+}
+
+/* Return the body of str as a NUL terminated utf32 string;
+   the caller frees it */
+static utf32*
+unpackBody(TTM* ttm, Name* str)
+{
+    utf32* s = (utf32*)malloc((str->length+1)*sizeof(utf32));
+    if(s == NULL) fail(ttm,EMEMORY);
+    bodyChars(str,0,str->length,s);
+    s[str->length] = NUL32;
+    return s;
+}
+
+/* Append the len characters of s to the body of str, in place
+   unless the body must be widened, is in a snapshot image,
+   or is shared with ttm->base */
+static void
+appendBody(TTM* ttm, Name* str, utf32* s, size_t len)
+{
+    int kind = bodyKind(s,len);
+    size_t nmarks;
+    void* body;
+
+    if(str->body == NULL || kind > str->kind
+       || (str->mapped & (MAPPEDBODY|SPILLEDBODY|SHAREDBODY))) {
+        utf32* whole = (utf32*)holdScratch(ttm,SCRATCHMEMORY,
+                           malloc((str->length+len+1)*sizeof(utf32)),0);
+        if(str->body != NULL) bodyChars(str,0,str->length,whole);
+        memcpy32(whole+str->length,s,len);
+        setBody(ttm,str,whole,str->length+len);
+        dropScratch(ttm,whole);
+        return;
+    }
+    nmarks = (str->kind < 4 ? countMarks(s,len) : 0);
+    body = realloc(str->body,(str->length+len+1)*(size_t)str->kind);
+    if(body == NULL) fail(ttm,EMEMORY);
+    str->body = body;
+    if(nmarks > 0) {
+        struct Mark* marks = (struct Mark*)realloc(str->marks,
+                                 (str->nmarks+nmarks)*sizeof(struct Mark));
+        if(marks == NULL) fail(ttm,EMEMORY);
+        str->marks = marks;
+    }
+    packBody(str,str->length,s,len);
+    str->length += len;
+    ttm->spill.inuse += len*(size_t)str->kind;
+    if(ttm->limits.membudget > 0 && ttm->spill.inuse > ttm->limits.membudget)
+        spillBodies(ttm,str);
+}
+
+/* Give dst a copy of the body of src */
+static void
+dupBody(TTM* ttm, Name* dst, Name* src)
+{
+    size_t size = (src->length+1)*(size_t)src->kind;
+    dst->body = NULL;
+    dst->marks = NULL;
+    dst->nmarks = 0;
+    if(src->body == NULL) return;
+    dst->body = malloc(size);
+    if(dst->body == NULL) fail(ttm,EMEMORY);
+    memcpy(dst->body,src->body,size);
+    if(src->nmarks > 0) {
+        dst->marks = (struct Mark*)malloc(src->nmarks*sizeof(struct Mark));
+        if(dst->marks == NULL) fail(ttm,EMEMORY);
+        memcpy(dst->marks,src->marks,src->nmarks*sizeof(struct Mark));
+        dst->nmarks = src->nmarks;
+    }
+    ttm->spill.inuse += size;
+    if(ttm->limits.membudget > 0 && ttm->spill.inuse > ttm->limits.membudget)
+        spillBodies(ttm,dst);
+}
+
+/* Bytes occupied by the body of str */
+static size_t
+bodySize(Name* str)
+{
+    return (str->length+1)*(size_t)str->kind;
+}
+
+/**************************************************/
+/* Spilling */
+
+/**
+With -Xm, the malloc'd bodies are held to a memory budget.
+When it is exceeded, the least recently looked up bodies of at
+least SPILLMIN bytes are written to an unlinked temporary file
+(in $TMPDIR, else /tmp) and mapped back read only.  A spilled
+body is used in place like a snapshot body; its pages are
+read in on access and may be dropped again by the kernel, so
+a job larger than memory runs slower instead of failing with
+EMEMORY.  Only the characters move; residual, the segment
+marks and the rest of the Name are unchanged.  Modifying a
+spilled body (#<ap>, #<ss>, ...) makes a new malloc'd copy.
+The file is not compacted, but starts over when no spilled
+body remains.  Spilling is not available under Windows.
+*/
+
+#ifndef MSWINDOWS
+/* Write the body of str to the spill file and map it back;
+   return 0 if that is not possible, leaving str as it was */
+static int
+spillBody(TTM* ttm, Name* str)
+{
+    size_t size = bodySize(str);
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t at = ttm->spill.end;
+    size_t done;
+    void* image;
+
+    if(ttm->spill.fd < 0) {
+        char path[8192];
+        const char* dir = getenv("TMPDIR");
+        if(dir == NULL || *dir == NUL) dir = "/tmp";
+        snprintf(path,sizeof(path),"%s/ttmspillXXXXXX",dir);
+        ttm->spill.fd = mkstemp(path);
+        if(ttm->spill.fd < 0) return 0;
+        unlink(path);
+    }
+    for(done=0;done < size;) {
+        ssize_t count = pwrite(ttm->spill.fd,(char*)str->body+done,
+                               size-done,(off_t)(at+done));
+        if(count <= 0) return 0;
+        done += (size_t)count;
+    }
+    /* The mapping must start on a page boundary */
+    image = mmap(NULL,size,PROT_READ,MAP_SHARED,ttm->spill.fd,(off_t)at);
+    if(image == MAP_FAILED) return 0;
+    ttm->spill.end = at + ((size + pagesize - 1) / pagesize) * pagesize;
+    ttm->spill.live++;
+    free(str->body);
+    ttm->spill.inuse -= size;
+    str->body = image;
+    str->mapped |= SPILLEDBODY;
+    return 1;
+}
+
+/* Order spill candidates by last use, oldest first */
+static int
+spillOrder(const void* a, const void* b)
+{
+    unsigned long ua = (*(Name**)a)->lastuse;
+    unsigned long ub = (*(Name**)b)->lastuse;
+    return (ua < ub ? -1 : (ua > ub ? 1 : 0));
+}
+#endif /*!MSWINDOWS*/
+
+/* Spill bodies, other than that of keep, until the budget is met */
+static void
+spillBodies(TTM* ttm, Name* keep)
+{
+#ifndef MSWINDOWS
+    Name** cold;
+    size_t ncold, i;
+    int h;
+    struct HashEntry* entry;
+
+    /* Collect the candidates */
+    for(ncold=0,h=0;h<HASHSIZE;h++) {
+        for(entry=ttm->dictionary.table[h].next;entry!=NULL;entry=entry->next)
+            ncold++;
+    }
+    cold = (Name**)malloc((ncold+1)*sizeof(Name*));
+    if(cold == NULL) return; /* just carry on over budget */
+    for(ncold=0,h=0;h<HASHSIZE;h++) {
+        for(entry=ttm->dictionary.table[h].next;entry!=NULL;entry=entry->next) {
+            Name* str = (Name*)entry;
+            if(str == keep || str->builtin || str->body == NULL
+               || (str->mapped & (MAPPEDBODY|SPILLEDBODY|SHAREDBODY))
+               || bodySize(str) < SPILLMIN)
+                continue;
+            cold[ncold++] = str;
+        }
+    }
+    qsort(cold,ncold,sizeof(Name*),spillOrder);
+    for(i=0;i<ncold && ttm->spill.inuse > ttm->limits.membudget;i++) {
+        if(!spillBody(ttm,cold[i])) break; /* e.g. the disk is full */
+    }
+    free(cold);
+#endif
 }
 
 /**************************************************/
@@ -905,11 +2041,23 @@ scan(TTM* ttm)
     for(;;) {
         c = *bb->active; /* NOTE that we do not bump here */
         if(c == NUL32) { /* End of buffer */
+            emit(ttm,bb,EMITSIZE);
+            if(moreinput(ttm,bb,1)) continue;
+            /* The end of a #<try> body; the rest of the buffer follows */
+            if(ttm->stacknext > 0) goto exiting;
             break;
         } else if(isescape(c)) {
+            lookahead(ttm,bb,2);
             bb->active++; /* skip the escape */
             *bb->passive++ = *bb->active++;
         } else if(c == ttm->sharpc) {/* Start of call? */
+            emit(ttm,bb,EMITSIZE);
+            /* Reclaim space while no frame pins the buffer,
+               in case the call needs to read more of the input */
+            if(ttm->source.file != NULL
+               && (size_t)(bb->active - bb->passive) > bb->alloc/4)
+                compact(ttm,bb);
+            lookahead(ttm,bb,3);
             if(bb->active[1] == ttm->openc
                || (bb->active[1] == ttm->sharpc
                     && bb->active[2] == ttm->openc)) {
@@ -926,10 +2074,14 @@ scan(TTM* ttm)
             bb->active++;
             for(;;) {
                 c = *(bb->active);
-                if(c == NUL32) fail(ttm,EEOS); /* Unexpected EOF */
+                if(c == NUL32) {
+                    if(moreinput(ttm,bb,0)) continue;
+                    fail(ttm,EEOS); /* Unexpected EOF */
+                }
                 *bb->passive++ = c;
                 bb->active++;
                 if(isescape(c)) {
+                    lookahead(ttm,bb,1);
                     *bb->passive++ = *bb->active++;
                 } else if(c == ttm->openc) {
                     depth++;
@@ -945,9 +2097,9 @@ scan(TTM* ttm)
 
     /* When we get here, we are finished, so clean up */
     { 
-        unsigned int newlen;
+        size_t newlen;
         /* reset the buffer length using bb->passive.*/
-        newlen = bb->passive - bb->content;
+        newlen = (size_t)(bb->passive - bb->content);
         setBufferLength(ttm,bb,newlen);
         /* reset bb->active */
         bb->active = bb->passive;
@@ -960,8 +2112,6 @@ static void
 exec(TTM* ttm, Buffer* bb)
 {
     Frame* frame;
-    Name* fcn;
-    utf32* savepassive;
 
     if(ttm->limits.execcount-- <= 0)
 	fail(ttm,EEXECCOUNT);	
@@ -975,15 +2125,30 @@ exec(TTM* ttm, Buffer* bb)
         frame->active = 0;
     }
     /* Parse and store relevant pointers into frame. */
-    savepassive = bb->passive;
+    frame->passive = bb->passive;
     parsecall(ttm,frame);
-    bb->passive = savepassive;
-    if(ttm->flags & FLAG_EXIT) goto exiting;
+    invoke(ttm,bb,frame);
+}
 
-    /* Now execute this function, which will leave result in bb->result */
-    if(frame->argc == 0) fail(ttm,ENONAME);
-    if(strlen32(frame->argv[0])==0) fail(ttm,ENONAME);
-    /* Locate the function to execute */
+/**
+Run the call whose arguments parsecall() has collected in
+frame, the top of the stack, put its result into the buffer
+and pop the frame.
+*/
+static void
+invoke(TTM* ttm, Buffer* bb, Frame* frame)
+{
+    Name* fcn;
+    utf32* value;
+    size_t resultlen;
+
+    bb->passive = frame->passive;
+    if(ttm->flags & FLAG_EXIT) goto exiting;
+
+    /* Now execute this function, which will leave result in bb->result */
+    if(frame->argc == 0) fail(ttm,ENONAME);
+    if(strlen32(frame->argv[0])==0) fail(ttm,ENONAME);
+    /* Locate the function to execute */
     fcn = dictionaryLookup(ttm,frame->argv[0]);
     if(fcn == NULL) fail(ttm,ENONAME);
     if(fcn->minargs > (frame->argc - 1)) /* -1 to account for function name*/
@@ -997,7 +2162,7 @@ exec(TTM* ttm, Buffer* bb)
         if(fcn->novalue) resetBuffer(ttm,ttm->result);
         if(ttm->flags & FLAG_EXIT) goto exiting;
     } else /* invoke the pseudo function "call" */
-        call(ttm,frame,fcn->body);
+        call(ttm,frame,fcn);
 
 #ifdef DEBUG
 fprintf(stderr,"result: ");
@@ -1005,15 +2170,27 @@ dbgprint32(ttm->result->content,'|');
 fprintf(stderr,"\n");
 #endif
 
-    if(ttm->flags & FLAG_TRACE || fcn->trace)
+    if(ttm->flags & FLAG_TRACE || fcn->trace) {
+        if(ttm->value.text != NULL) { /* so that trace can show it */
+            setBufferLength(ttm,ttm->result,ttm->value.length);
+            memcpy32(ttm->result->content,ttm->value.text,ttm->value.length);
+            ttm->value.text = NULL;
+        }
         trace(ttm,0,TRACING);
+    }
 
     /* Now, put the result into the buffer */
-    if(!fcn->novalue && ttm->result->length > 0) {
+    value = ttm->result->content;
+    resultlen = ttm->result->length;
+    if(ttm->value.text != NULL) { /* insert it without a copy to result */
+        value = ttm->value.text;
+        resultlen = ttm->value.length;
+        ttm->value.text = NULL;
+    }
+    if(!fcn->novalue && resultlen > 0) {
         utf32* insertpos;
-        unsigned int resultlen = ttm->result->length;
         /*Compute the space avail between bb->passive and bb->active */
-        unsigned int avail = (bb->active - bb->passive); 
+        size_t avail = (size_t)(bb->active - bb->passive); 
         /* Compute amount we need to expand, if any */
         if(avail < resultlen)
             expandBuffer(ttm,bb,(resultlen - avail));/*will change bb->active*/
@@ -1028,7 +2205,7 @@ fprintf(stderr,"\n");
             insertpos = bb->passive;
             bb->passive += resultlen;
         }
-        memcpy32((void*)insertpos,ttm->result->content,ttm->result->length);
+        memcpy32((void*)insertpos,value,resultlen);
 #ifdef DEBUG
 fprintf(stderr,"context:\n\tpassive=|");
 /* Since passive is not normally null terminated, we need to fake it */
@@ -1058,14 +2235,22 @@ parsecall(TTM* ttm, Frame* frame)
     int done,depth;
     utf32 c;
     Buffer* bb = ttm->buffer;
+    utf32* arg; /* start of ith argument */
 
+    /* When resuming a checkpoint, some of the arguments may
+       have been collected already; argv[argc] then holds the
+       start of the one in progress; see resumeCalls() */
+    arg = (frame->argc == 0 ? frame->passive : frame->argv[frame->argc]);
     done = 0;
     do {
-        utf32* arg = bb->passive;/* start of ith argument */
         while(!done) {
             c = *bb->active; /* Note that we do not bump here */
-            if(c == NUL32) fail(ttm,EEOS); /* Unexpected end of buffer */
+            if(c == NUL32) {
+                if(moreinput(ttm,bb,0)) continue;
+                fail(ttm,EEOS); /* Unexpected end of buffer */
+            }
             if(isescape(c)) {
+                lookahead(ttm,bb,2);
                 bb->active++;
                 *bb->passive++ = *bb->active++;
             } else if(c == ttm->semic || c == ttm->closec) {
@@ -1084,19 +2269,26 @@ fprintf(stderr,"\n");
                 else arg = bb->passive;
             } else if(c == ttm->sharpc) {
                 /* check for call within call */
+                lookahead(ttm,bb,3);
                 if(bb->active[1] == ttm->openc
                    || (bb->active[1] == ttm->sharpc
                         && bb->active[2] == ttm->openc)) {
                     /* Recurse to compute inner call */
                     exec(ttm,bb);
                     if(ttm->flags & FLAG_EXIT) goto exiting;
+                } else {/* not a call; just pass the # along */
+                    *bb->passive++ = c;
+                    bb->active++;
                 }
             } else if(c == ttm->openc) {/* <...> nested brackets */
                 bb->active++; /* skip leading lbracket */
                 depth = 1;
                 for(;;) {
                     c = *(bb->active);
-                    if(c == NUL) fail(ttm,EEOS); /* Unexpected EOF */
+                    if(c == NUL) {
+                        if(moreinput(ttm,bb,0)) continue;
+                        fail(ttm,EEOS); /* Unexpected EOF */
+                    }
                     if(isescape(c)) {
                         *bb->passive++ = (char)c;
                         *bb->passive++ = *bb->active++;         
@@ -1124,17 +2316,37 @@ exiting:
     return;
 }
 
+/**
+Finish the calls that were in progress when a checkpoint was
+taken, as if #<ttm;checkpoint> had just returned: each frame
+from level up, innermost first, goes on collecting its
+arguments where it left off and is then invoked, just as
+exec() would have done.  scan() then carries on at top level.
+*/
+static void
+resumeCalls(TTM* ttm, unsigned int level)
+{
+    Frame* frame = &ttm->stack[level];
+
+    if(level+1 < ttm->stacknext)
+        resumeCalls(ttm,level+1);
+    if(!(ttm->flags & FLAG_EXIT))
+        parsecall(ttm,frame);
+    invoke(ttm,ttm->buffer,frame);
+}
+
 /**************************************************/
 /**
 Execute a non-builtin function
 */
 
 static void
-call(TTM* ttm, Frame* frame, utf32* body)
+call(TTM* ttm, Frame* frame, Name* str)
 {
-    utf32* p;
+    size_t p;
+    size_t m;
     utf32 c;
-    unsigned int len;
+    size_t len;
     utf32* result;
     utf32* dst;
     char crformat[16];
@@ -1144,9 +2356,10 @@ call(TTM* ttm, Frame* frame, utf32* body)
     crformat[0] = NUL;
 
     /* Compute the size of the output */
-    for(len=0,p=body;(c=*p++);) {
+    for(len=0,p=0,m=0;p < str->length;p++) {
+        c = bodyNext(str,p,&m);
         if(issegmark(c)) {
-            unsigned int segindex = (unsigned int)(*p++);
+            unsigned int segindex = (unsigned int)(c & 0xFF);
             if(segindex < frame->argc)
                 len += strlen32(frame->argv[segindex]);
             /* else treat as empty string */
@@ -1161,7 +2374,8 @@ call(TTM* ttm, Frame* frame, utf32* body)
     result = ttm->result->content;
     dst = result;
     dst[0] = NUL32; /* so we can use strcat */
-    for(p=body;(c=*p++);) {
+    for(p=0,m=0;p < str->length;p++) {
+        c = bodyNext(str,p,&m);
         if(issegmark(c)) {
             unsigned int segindex = (unsigned int)(c & 0xFF);
             if(segindex < frame->argc) {
@@ -1180,42 +2394,566 @@ call(TTM* ttm, Frame* frame, utf32* body)
             crlen = toString32(dst,crval,TOEOS);
             dst += crlen;
         } else
-            *dst++ = (char)c;
+            *dst++ = c;
     }
     *dst = NUL32;
-    setBufferLength(ttm,ttm->result,(dst-result));
+    setBufferLength(ttm,ttm->result,(size_t)(dst-result));
 }
 
 /**************************************************/
 /* Built-in Support Procedures */
+/**
+Output a string, handling escapes and marks inline.
+Output to stderr is written at once, after any pending
+stdout output so that the two stay in order; all other
+output waits in its writer; see flushOutput.
+*/
 static void
 printstring(TTM* ttm, FILE* output, utf32* s32)
 {
-    int slen = strlen32(s32);
+    struct Writer* w = writerFor(ttm,output);
+
+    if(w == &ttm->writers[WSTDERR])
+        flushWriter(ttm,&ttm->writers[WSTDOUT]);
+    writestring(ttm,w,s32);
+    if(w == &ttm->writers[WSTDERR])
+        flushWriter(ttm,w);
+}
+
+/* Encode a string into a writer as printstring() does */
+static void
+writestring(TTM* ttm, struct Writer* w, utf32* s32)
+{
+    utf32* run;
     utf32 c32;
 
-    if(slen == 0) return;
-    while((c32=*s32++)) {
+    while(*s32) {
+        /* Runs of ordinary characters are encoded in bulk */
+        for(run=s32;(c32=*s32) != NUL32;s32++) {
+            if(isescape(c32) || ismark(c32)) break;
+        }
+        if(s32 > run) writeChars(ttm,w,run,(size_t)(s32-run));
+        if(c32 == NUL32) break;
+        s32++;
         if(isescape(c32)) {
-            c32 = *s32++;
+            c32 = *s32;
+            if(c32 == NUL32) break;
+            s32++;
             c32 = convertEscapeChar(c32);
         }
         if(c32 != 0) {
             if(ismark(c32)) {
-                char_t* p;
                 char info[16+1];
+                utf32 info32[16+1];
+                int count;
                 if(iscreate(c32))
                     strcpy(info,"^00");
                 else /* segmark */
                     snprintf(info,sizeof(info),"^%02d",(int)(c32 & 0xFF));
-                for(p=info;*p;p++) fputc32((utf32)*p,output);
+                count = toString32(info32,info,TOEOS);
+                writeChars(ttm,w,info32,(size_t)count);
             } else
-                fputc32(c32,output);
+                writeChars(ttm,w,&c32,1);
          }
     }
-    fflush(output);
 }
 
+/**************************************************/
+/* Output */
+
+/**
+All output of strings goes through a writer, which encodes
+it in bulk into a block buffer and writes the buffer only
+when it is full, at exit, on #<pf>, before reading from stdin
+and before anything is written to stderr.
+Writing to the -o file may bypass stdio (see -Xw), and
+the writing may be done by a thread of its own (see -Xp).
+*/
+
+static void
+initWriter(TTM* ttm, struct Writer* w, FILE* f, int fd, size_t size)
+{
+    if(w->bytes != NULL) free(w->bytes);
+    w->file = f;
+    w->fd = fd;
+    w->length = 0;
+    w->alloc = (size < WRITEBLOCKSIZE ? WRITEBLOCKSIZE : size);
+    w->bytes = (char_t*)malloc(w->alloc);
+    if(w->bytes == NULL) fail(ttm,EMEMORY);
+}
+
+/* Map a stream to its writer */
+static struct Writer*
+writerFor(TTM* ttm, FILE* f)
+{
+    if(f == stderr)
+        return &ttm->writers[WSTDERR];
+    if(f == ttm->output && ttm->writers[WOUTPUT].bytes != NULL)
+        return &ttm->writers[WOUTPUT];
+    return &ttm->writers[WSTDOUT];
+}
+
+static void
+writeChars(TTM* ttm, struct Writer* w, utf32* s, size_t len)
+{
+    size_t used;
+    int count;
+
+    while(len > 0) {
+        if(w->alloc - w->length < MAXCHARSIZE)
+            sendWriter(ttm,w);
+        count = encode8(s,len,w->bytes+w->length,w->alloc-w->length,&used);
+        if(count < 0) fail(ttm,EUTF32);
+        w->length += (size_t)count;
+        s += used;
+        len -= used;
+    }
+}
+
+/* Write bytes that are already utf-8 encoded */
+static void
+writeBytes(TTM* ttm, struct Writer* w, char_t* p, size_t len)
+{
+    size_t n;
+
+    if(len > w->alloc - w->length) {
+        sendWriter(ttm,w);
+        if(len >= w->alloc && w->pipe == NULL && w->keep == NULL) {
+            /* no point in copying it first */
+            writeOut(ttm,w,p,len);
+            return;
+        }
+    }
+    while(len > 0) {
+        n = w->alloc - w->length;
+        if(n > len) n = len;
+        memcpy(w->bytes+w->length,p,n);
+        w->length += n;
+        p += n;
+        len -= n;
+        if(len > 0) sendWriter(ttm,w);
+    }
+}
+
+/* Pass on a full block; unlike flushWriter(), this
+   does not wait for a writer thread to write it */
+static void
+sendWriter(TTM* ttm, struct Writer* w)
+{
+#ifdef HAVE_PTHREADS
+    if(w->pipe != NULL) {
+        if(w->length > 0) passBlock(ttm,w);
+        return;
+    }
+#endif
+    flushWriter(ttm,w);
+}
+
+static void
+flushWriter(TTM* ttm, struct Writer* w)
+{
+    size_t len = w->length;
+
+    if(w->keep != NULL) {
+        keepBlock(ttm,w);
+        return;
+    }
+#ifdef HAVE_PTHREADS
+    if(w->pipe != NULL) {
+        if(len > 0) passBlock(ttm,w);
+        drainPipe(ttm,w->pipe);
+        return;
+    }
+#endif
+    if(len == 0) return;
+    w->length = 0; /* so that a failure here does not try again */
+    writeOut(ttm,w,w->bytes,len);
+}
+
+static void
+writeOut(TTM* ttm, struct Writer* w, char_t* p, size_t len)
+{
+    if(w->sink != NULL) {
+        if(w->sink->write(w->sink->closure,p,len) < 0) fail(ttm,EIO);
+        return;
+    }
+    if(writeAll(w->file,w->fd,w->codec,p,len) < 0)
+        fail(ttm,(w->codec != NULL ? ECODEC : EIO));
+}
+
+/* Write len bytes to fd, or to f if fd < 0, compressing them with z
+   if it is set; return -1 on error.
+   This is also called from the writer thread, so it must not fail(). */
+static int
+writeAll(FILE* f, int fd, Codec* z, char_t* p, size_t len)
+{
+    if(z != NULL) return writeCodec(z,p,len);
+#ifndef MSWINDOWS
+    if(fd >= 0) {
+        while(len > 0) {
+            ssize_t count = write(fd,p,len);
+            if(count < 0) return -1;
+            p += count;
+            len -= (size_t)count;
+        }
+        return 0;
+    }
+#endif
+    if(fwrite(p,1,len,f) != len) return -1;
+    if(fflush(f) != 0) return -1;
+    return 0;
+}
+
+static void
+flushOutput(TTM* ttm)
+{
+    int i;
+    for(i=0;i<NWRITERS;i++) {
+        if(ttm->writers[i].bytes != NULL)
+            flushWriter(ttm,&ttm->writers[i]);
+    }
+    for(i=0;i<MAXHANDLES;i++) {
+        if(ttm->handles[i].writer.bytes != NULL)
+            flushWriter(ttm,&ttm->handles[i].writer);
+    }
+}
+
+/**************************************************/
+/* Diversions */
+
+/**
+Finished text (everything before bb->passive at top level)
+goes to the output unless #<divert> has named a diversion
+to hold it instead.  A diversion encodes its text into
+blocks the size of an output block, and keeps each block
+when it fills, so it grows without being reallocated or
+copied; #<undivert> writes the blocks out in order, or moves
+the whole list onto the end of the current diversion.
+Whatever is left in the diversions at exit is written out,
+in the order the diversions were created.
+Since a call's arguments are assembled just past
+bb->passive, finished text is handed on (see deliver())
+only up to where the outermost call in progress began, and
+TTM.diversions.sent marks how much of it has been handed on.
+*/
+
+/* The writer for finished text */
+static struct Writer*
+outputWriter(TTM* ttm)
+{
+    if(ttm->diversions.current != NULL)
+        return ttm->diversions.current->writer;
+    return writerFor(ttm,ttm->output);
+}
+
+/* Hand on the finished text of the buffer up to upto */
+static void
+deliver(TTM* ttm, utf32* upto)
+{
+    Buffer* bb = ttm->buffer;
+    utf32* start = bb->content + ttm->diversions.sent;
+    utf32 save;
+
+    if(upto <= start) return;
+    save = *upto;
+    *upto = NUL32;
+    if(ttm->diversions.current != NULL)
+        writestring(ttm,ttm->diversions.current->writer,start);
+    else
+        printstring(ttm,ttm->output,start);
+    *upto = save;
+    ttm->diversions.sent = (size_t)(upto - bb->content);
+}
+
+static Diversion*
+findDiversion(TTM* ttm, utf32* name, int create)
+{
+    Diversion* d;
+    Diversion** lastp;
+
+    for(lastp=&ttm->diversions.list;(d = *lastp) != NULL;lastp=&d->next) {
+        if(strcmp32(d->name,name) == 0) return d;
+    }
+    if(!create) return NULL;
+    d = (Diversion*)calloc(1,sizeof(Diversion));
+    if(d == NULL) fail(ttm,EMEMORY);
+    d->writer = (struct Writer*)calloc(1,sizeof(struct Writer));
+    if(d->writer == NULL) fail(ttm,EMEMORY);
+    initWriter(ttm,d->writer,NULL,-1,WRITEBLOCKSIZE);
+    d->writer->keep = d;
+    d->name = strdup32(name);
+    *lastp = d;
+    return d;
+}
+
+/* Add the writer's block to its diversion, and give the
+   writer a fresh one */
+static void
+keepBlock(TTM* ttm, struct Writer* w)
+{
+    Diversion* d = w->keep;
+    struct Block* b;
+
+    if(w->length == 0) return;
+    b = (struct Block*)calloc(1,sizeof(struct Block));
+    if(b == NULL) fail(ttm,EMEMORY);
+    b->bytes = w->bytes;
+    b->length = w->length;
+    if(d->last == NULL) d->first = b; else d->last->next = b;
+    d->last = b;
+    w->bytes = (char_t*)malloc(w->alloc);
+    if(w->bytes == NULL) fail(ttm,EMEMORY);
+    w->length = 0;
+}
+
+/* Move the contents of d to wherever finished text now goes */
+static void
+undivert(TTM* ttm, Diversion* d)
+{
+    Diversion* to = ttm->diversions.current;
+    struct Writer* w;
+    struct Block* b;
+
+    if(d == to) return;
+    keepBlock(ttm,d->writer);
+    if(d->first == NULL) return;
+    if(to != NULL) { /* splice the blocks on */
+        keepBlock(ttm,to->writer);
+        if(to->last == NULL) to->first = d->first; else to->last->next = d->first;
+        to->last = d->last;
+    } else {
+        w = writerFor(ttm,ttm->output);
+        while((b = d->first) != NULL) {
+            writeBytes(ttm,w,b->bytes,b->length);
+            d->first = b->next;
+            free(b->bytes);
+            free(b);
+        }
+    }
+    d->first = NULL;
+    d->last = NULL;
+}
+
+static void
+freeDiversions(TTM* ttm)
+{
+    Diversion* d;
+    struct Block* b;
+
+    while((d = ttm->diversions.list) != NULL) {
+        ttm->diversions.list = d->next;
+        while((b = d->first) != NULL) {
+            d->first = b->next;
+            free(b->bytes);
+            free(b);
+        }
+        free(d->writer->bytes);
+        free(d->writer);
+        free(d->name);
+        free(d);
+    }
+    ttm->diversions.current = NULL;
+}
+
+/**************************************************/
+/* Pipelines */
+
+/**
+With -Xp, the reading of the -p file and the writing of the
+output each run in a thread of their own, so that the I/O
+overlaps the scanning.  A thread is connected to the scanner
+by a ring of blocks with a single producer and a single
+consumer: the semaphores count the full and the empty slots,
+and each index is only ever changed by one side, so neither
+side takes a lock.  Decoding and encoding stay with the
+scanner, since the passthrough of refill() wants raw bytes.
+*/
+
+#ifdef HAVE_PTHREADS
+
+struct Pipe {
+    unsigned int nslots;
+    char_t** blocks;
+    long* lengths; /* bytes in each full slot; < 0 => error or stop */
+    unsigned int head; /* next slot for the producer */
+    unsigned int tail; /* next slot for the consumer */
+    sem_t full;
+    sem_t empty;
+    FILE* file;
+    int fd;
+    Codec* codec;
+    int stop; /* set by the scanner to end the reader thread early */
+    int failed; /* set by the writer thread on an I/O error */
+    pthread_t thread;
+};
+
+static Pipe*
+newPipe(TTM* ttm, unsigned int nslots, size_t blocksize, FILE* f, int fd)
+{
+    unsigned int i;
+    Pipe* pp = (Pipe*)calloc(1,sizeof(Pipe));
+    if(pp == NULL) fail(ttm,EMEMORY);
+    pp->nslots = nslots;
+    pp->blocks = (char_t**)calloc(nslots,sizeof(char_t*));
+    pp->lengths = (long*)calloc(nslots,sizeof(long));
+    if(pp->blocks == NULL || pp->lengths == NULL) fail(ttm,EMEMORY);
+    for(i=0;i<nslots;i++) {
+        pp->blocks[i] = (char_t*)malloc(blocksize);
+        if(pp->blocks[i] == NULL) fail(ttm,EMEMORY);
+    }
+    pp->file = f;
+    pp->fd = fd;
+    return pp;
+}
+
+static void
+freePipe(Pipe* pp)
+{
+    unsigned int i;
+    sem_destroy(&pp->full);
+    sem_destroy(&pp->empty);
+    for(i=0;i<pp->nslots;i++) free(pp->blocks[i]);
+    free(pp->blocks);
+    free(pp->lengths);
+    free(pp);
+}
+
+static void*
+readerThread(void* arg)
+{
+    Pipe* pp = (Pipe*)arg;
+    long count;
+
+    for(;;) {
+        sem_wait(&pp->empty);
+        if(pp->stop) break;
+        count = readBytes(pp->file,pp->codec,
+                          (unsigned char*)pp->blocks[pp->head],READBLOCKSIZE);
+        pp->lengths[pp->head] = count;
+        pp->head = (pp->head + 1) % pp->nslots;
+        sem_post(&pp->full);
+        if(count <= 0) break;
+    }
+    return NULL;
+}
+
+static void*
+writerThread(void* arg)
+{
+    Pipe* pp = (Pipe*)arg;
+    long count;
+
+    for(;;) {
+        sem_wait(&pp->full);
+        count = pp->lengths[pp->tail];
+        if(count < 0) break; /* told to stop */
+        if(!pp->failed
+           && writeAll(pp->file,pp->fd,pp->codec,
+                       pp->blocks[pp->tail],(size_t)count) < 0)
+            pp->failed = 1;
+        pp->tail = (pp->tail + 1) % pp->nslots;
+        sem_post(&pp->empty);
+    }
+    return NULL;
+}
+
+/* Take the next block read by the reader thread */
+static size_t
+pipeRead(TTM* ttm, Pipe* pp, unsigned char* dst)
+{
+    long count;
+    sem_wait(&pp->full);
+    count = pp->lengths[pp->tail];
+    if(count > 0) memcpy(dst,pp->blocks[pp->tail],(size_t)count);
+    pp->tail = (pp->tail + 1) % pp->nslots;
+    sem_post(&pp->empty);
+    if(count < 0) fail(ttm,(pp->codec != NULL ? ECODEC : EIO));
+    return (size_t)count;
+}
+
+/* Hand the writer's full block to the writer thread
+   and start filling the next empty one */
+static void
+passBlock(TTM* ttm, struct Writer* w)
+{
+    Pipe* pp = w->pipe;
+    pp->lengths[pp->head] = (long)w->length;
+    pp->head = (pp->head + 1) % pp->nslots;
+    sem_post(&pp->full);
+    sem_wait(&pp->empty);
+    w->bytes = pp->blocks[pp->head];
+    w->length = 0;
+    if(pp->failed) fail(ttm,EIO);
+}
+
+/* Wait until the writer thread has written every full block */
+static void
+drainPipe(TTM* ttm, Pipe* pp)
+{
+    unsigned int i;
+    /* the writer holds one slot; the rest are empty once drained */
+    for(i=1;i<pp->nslots;i++) sem_wait(&pp->empty);
+    for(i=1;i<pp->nslots;i++) sem_post(&pp->empty);
+    if(pp->failed) fail(ttm,EIO);
+}
+
+static void
+startReaderPipe(TTM* ttm, struct Source* src)
+{
+    Pipe* pp = newPipe(ttm,ttm->limits.pipeslots,READBLOCKSIZE,src->file,-1);
+    pp->codec = src->codec;
+    if(sem_init(&pp->full,0,0) != 0
+       || sem_init(&pp->empty,0,pp->nslots) != 0)
+        fail(ttm,ETHREAD);
+    if(pthread_create(&pp->thread,NULL,readerThread,pp) != 0)
+        fail(ttm,ETHREAD);
+    src->pipe = pp;
+}
+
+static void
+stopReaderPipe(TTM* ttm, struct Source* src)
+{
+    Pipe* pp = src->pipe;
+    pp->stop = 1;
+    sem_post(&pp->empty); /* in case it is waiting for a slot */
+    pthread_join(pp->thread,NULL);
+    freePipe(pp);
+    src->pipe = NULL;
+}
+
+static void
+startWriterPipe(TTM* ttm, struct Writer* w)
+{
+    Pipe* pp;
+    flushWriter(ttm,w);
+    pp = newPipe(ttm,ttm->limits.pipeslots,w->alloc,w->file,w->fd);
+    pp->codec = w->codec;
+    /* the writer fills slot 0 itself */
+    if(sem_init(&pp->full,0,0) != 0
+       || sem_init(&pp->empty,0,pp->nslots-1) != 0)
+        fail(ttm,ETHREAD);
+    if(pthread_create(&pp->thread,NULL,writerThread,pp) != 0)
+        fail(ttm,ETHREAD);
+    free(w->bytes);
+    w->bytes = pp->blocks[0];
+    w->pipe = pp;
+}
+
+static void
+stopWriterPipe(TTM* ttm, struct Writer* w)
+{
+    Pipe* pp = w->pipe;
+    flushWriter(ttm,w);
+    pp->lengths[pp->head] = -1; /* tell it to stop */
+    sem_post(&pp->full);
+    pthread_join(pp->thread,NULL);
+    freePipe(pp);
+    w->pipe = NULL;
+    w->bytes = NULL;
+}
+
+#endif /*HAVE_PTHREADS*/
+
 /**************************************************/
 /* Builtin functions */
 
@@ -1225,24 +2963,19 @@ printstring(TTM* ttm, FILE* output, utf32* s32)
 static void
 ttm_ap(TTM* ttm, Frame* frame) /* Append to a string */
 {
-    utf32* body;
     utf32* apstring;
     Name* str = dictionaryLookup(ttm,frame->argv[1]);
-    unsigned int aplen, bodylen;
 
     if(str == NULL) {/* Define the string */
         ttm_ds(ttm,frame);
         return;
     }
     if(str->builtin) fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
     apstring = frame->argv[2];
-    aplen = strlen32(apstring);
-    body = str->body;
-    bodylen = strlen32(body);
-    body = realloc(body,sizeof(utf32)*(bodylen+aplen+1));
-    if(body == NULL) fail(ttm,EMEMORY);
-    strcpy32(body+bodylen,apstring);
-    str->residual = bodylen+aplen;
+    /* Copies out of a snapshot image first, if need be */
+    appendBody(ttm,str,apstring,strlen32(apstring));
+    str->residual = str->length;
 }
 
 /**
@@ -1258,6 +2991,7 @@ ttm_cf(TTM* ttm, Frame* frame) /* Copy a function */
     Name* newstr = dictionaryLookup(ttm,newname);
     Name* oldstr = dictionaryLookup(ttm,oldname);
     struct HashEntry saveentry;
+    unsigned int savemapped;
 
     if(oldstr == NULL)
         fail(ttm,ENONAME);
@@ -1266,21 +3000,27 @@ ttm_cf(TTM* ttm, Frame* frame) /* Copy a function */
         newstr = newName(ttm);
         newstr->entry.name = strdup32(newname);
         dictionaryInsert(ttm,newstr);
-    }
+    } else
+        newstr = privateName(ttm,newstr);
+    if(newstr == oldstr) return; /* nothing to copy */
+    if(!newstr->builtin)
+        freeBody(ttm,newstr);
     saveentry = newstr->entry;
+    savemapped = (newstr->mapped & (MAPPEDNAME|MAPPEDREC));
     *newstr = *oldstr;
     newstr->entry = saveentry;
+    newstr->readonly = 0;
+    newstr->mapped = savemapped; /* the body is copied below */
     /* Do fixup */
-    if(newstr->body != NULL) {
-        newstr->body = strdup32(newstr->body);
-    }
+    if(!newstr->builtin)
+        dupBody(ttm,newstr,oldstr);
 }
 
 static void
 ttm_cr(TTM* ttm, Frame* frame) /* Mark for creation */
 {
     Name* str;
-    int bodylen,crlen;
+    size_t crlen;
     utf32* body;
     utf32* crstring;
 
@@ -1289,14 +3029,15 @@ ttm_cr(TTM* ttm, Frame* frame) /* Mark for creation */
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
 
-    body = str->body;
-    bodylen = strlen32(body);
     crstring = frame->argv[2];
     crlen = strlen32(crstring);
 
-    if(crlen > 0) { /* search only if possible success */
+    if(crlen > 0 && str->residual < str->length) { /* search only if possible success */
         utf32* p;
+        /* Do the marking on a utf32 copy of the body */
+        body = (utf32*)holdScratch(ttm,SCRATCHMEMORY,unpackBody(ttm,str),0);
         /* Search for occurrences of arg */
         p = body + str->residual;
         while(*p) {
@@ -1308,30 +3049,43 @@ ttm_cr(TTM* ttm, Frame* frame) /* Mark for creation */
             if(crlen > 1)
                 strcpy32(p+1,p+crlen);
         }
+        setBody(ttm,str,body,strlen32(body));
+        dropScratch(ttm,body);
     }
 }
 
 static void
 ttm_ds(TTM* ttm, Frame* frame)
 {
-    Name* str = dictionaryLookup(ttm,frame->argv[1]);
+    Name* str = defineName(ttm,frame->argv[1]);
+    setBody(ttm,str,frame->argv[2],strlen32(frame->argv[2]));
+}
+
+/**
+Return the user defined Name called name, with no body,
+creating it if needed; shared by #<ds> and #<load>.
+*/
+static Name*
+defineName(TTM* ttm, utf32* name)
+{
+    Name* str = dictionaryLookup(ttm,name);
     if(str == NULL) {
         /* create a new string object */
         str = newName(ttm);
-        str->entry.name = strdup32(frame->argv[1]);
+        str->entry.name = strdup32(name);
         dictionaryInsert(ttm,str);
     } else {
         /* reset as needed */
+        str = privateName(ttm,str);
         str->builtin = 0;
         str->minargs = 0;
         str->maxargs = 0;
         str->residual = 0;
         str->maxsegmark = 0;
         str->fcn = NULL;
-        if(str->body != NULL) free(str->body);
-        str->body = NULL;
+        freeBody(ttm,str);
     }
-    str->body = strdup32(frame->argv[2]);
+    return str;
 }
 
 static void
@@ -1341,10 +3095,8 @@ ttm_es(TTM* ttm, Frame* frame) /* Erase string */
     for(i=1;i<frame->argc;i++) {
         utf32* strname = frame->argv[i];
         Name* str = dictionaryLookup(ttm,strname);
-        if(str != NULL && !str->locked) {
-            dictionaryRemove(ttm,strname);
-            freeName(ttm,str); /* reclaim the string */
-        }
+        if(str != NULL && !str->locked)
+            eraseName(ttm,strname); /* reclaim the string */
     }
 }
 
@@ -1353,29 +3105,30 @@ static int
 ttm_ss0(TTM* ttm, Frame* frame)
 {
     Name* str;
-    unsigned int i,segcount,startseg,bodylen;
-    utf32* startp;
+    unsigned int i,segcount,startseg;
+    utf32* body;
 
     str = dictionaryLookup(ttm,frame->argv[1]);
     if(str == NULL)
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
 
-    bodylen = strlen32(str->body);
-    if(str->residual >= bodylen)
+    if(str->residual >= str->length)
         return 0; /* no substitution possible */
     segcount = 0;
     startseg = str->maxsegmark;
-    startp = str->body + str->residual;
+    /* Do the marking on a utf32 copy of the body */
+    body = (utf32*)holdScratch(ttm,SCRATCHMEMORY,unpackBody(ttm,str),0);
     for(i=2;i<frame->argc;i++) {
         utf32* arg = frame->argv[i];
-        unsigned int arglen = strlen32(arg);
+        size_t arglen = strlen32(arg);
         if(arglen > 0) { /* search only if possible success */
             int found;
             utf32* p;
             /* Search for occurrences of arg */
-            p = str->body + str->residual;
+            p = body + str->residual;
             found = 0;
             while(*p) {
                 if(strncmp32(p,arg,arglen) != 0)
@@ -1393,6 +3146,9 @@ ttm_ss0(TTM* ttm, Frame* frame)
             }
         }
     }
+    if(segcount > 0)
+        setBody(ttm,str,body,strlen32(body));
+    dropScratch(ttm,body);
     str->maxsegmark = startseg;
     return segcount;
 }
@@ -1427,9 +3183,10 @@ ttm_cc(TTM* ttm, Frame* frame) /* Call one character */
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
     /* Check for pointing at trailing NUL */
-    if(str->residual < strlen32(str->body)) {
-        utf32 c32 = *(str->body+str->residual);
+    if(str->residual < str->length) {
+        utf32 c32 = bodyAt(str,str->residual);
         *ttm->result->content = c32;
         setBufferLength(ttm,ttm->result,1);
         str->residual++;
@@ -1441,26 +3198,28 @@ ttm_cn(TTM* ttm, Frame* frame) /* Call n characters */
 {
     Name* str;
     long long ln;
-    unsigned n;
+    size_t n;
     ERR err;
-    unsigned int bodylen,startn;
-    unsigned int avail;
+    size_t bodylen,startn;
+    size_t avail;
 
     str = dictionaryLookup(ttm,frame->argv[2]);
     if(str == NULL)
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
 
     /* Get number of characters to extract */
     err = toInt64(frame->argv[1],&ln);
     if(err != ENOERR) fail(ttm,err);
     if(ln < 0) fail(ttm,ENOTNEGATIVE);   
 
-    n = (unsigned int)ln;
+    if((unsigned long long)ln > (size_t)-1) fail(ttm,ERANGE);
+    n = (size_t)ln;
 
     /* See if we have enough space */
-    bodylen = strlen32(str->body);
+    bodylen = str->length;
     if(str->residual >= bodylen)
 	avail = 0;
     else
@@ -1474,7 +3233,7 @@ ttm_cn(TTM* ttm, Frame* frame) /* Call n characters */
         
     /* ok, copy n characters from startn into the return buffer */
     setBufferLength(ttm,ttm->result,n);
-    strncpy32(ttm->result->content,str->body+startn,n);
+    bodyChars(str,startn,n,ttm->result->content);
     /* increment residual */
     str->residual += n;
     return;
@@ -1489,9 +3248,8 @@ static void
 ttm_cp(TTM* ttm, Frame* frame) /* Call parameter */
 {
     Name* str;
-    unsigned int delta;
-    utf32* rp;
-    utf32* rp0;
+    size_t delta;
+    size_t rp, m;
     utf32 c32;
     int depth;
 
@@ -1500,12 +3258,15 @@ ttm_cp(TTM* ttm, Frame* frame) /* Call parameter */
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
 
-    rp0 = (str->body + str->residual);
-    rp = rp0;
+    rp = str->residual;
+    m = findMark(str,rp);
     depth = 0;
+    c32 = NUL32;
     ttm->result->content[0] = NUL32; /* so we can strcat */
-    for(;(c32=*rp);rp++) {
+    for(;rp < str->length;rp++) {
+        c32 = bodyNext(str,rp,&m);
         if(c32 == ttm->semic) {
             if(depth == 0) break; /* reached unnested semicolon*/
         } else if(c32 == ttm->openc) {
@@ -1514,9 +3275,10 @@ ttm_cp(TTM* ttm, Frame* frame) /* Call parameter */
             depth--;
         }
     }
-    delta = (rp - rp0);
+    if(rp == str->length) c32 = NUL32;
+    delta = rp - str->residual;
     setBufferLength(ttm,ttm->result,delta);
-    strncpy32(ttm->result->content,rp0,delta);
+    bodyChars(str,str->residual,delta,ttm->result->content);
     str->residual += delta;
     if(c32 != NUL32) str->residual++;
 }
@@ -1526,28 +3288,31 @@ ttm_cs(TTM* ttm, Frame* frame) /* Call segment */
 {
     Name* str;
     utf32 c32;
-    utf32* p;
-    utf32* p0;
-    unsigned int delta;
+    size_t p, m;
+    size_t delta;
 
     str = dictionaryLookup(ttm,frame->argv[1]);
     if(str == NULL)
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
 
     /* Locate the next segment mark */
     /* Unclear if create marks also qualify; assume yes */
-    p0 = str->body + str->residual;
-    p = p0;
-    for(;(c32=*p);p++) {
-        if(c32 == NUL32 || testMark(c32,SEGMARK) || testMark(c32,CREATE))
+    p = str->residual;
+    m = findMark(str,p);
+    c32 = NUL32;
+    for(;p < str->length;p++) {
+        c32 = bodyNext(str,p,&m);
+        if(testMark(c32,SEGMARK) || testMark(c32,CREATE))
             break;
     }
-    delta = (p - p0);
+    if(p == str->length) c32 = NUL32;
+    delta = p - str->residual;
     if(delta > 0) {
         setBufferLength(ttm,ttm->result,delta);
-        strncpy32(ttm->result->content,p0,delta);
+        bodyChars(str,str->residual,delta,ttm->result->content);
     }
     /* set residual pointer correctly */
     str->residual += delta;
@@ -1562,14 +3327,14 @@ ttm_isc(TTM* ttm, Frame* frame) /* Initial character scan; moves residual pointe
     utf32* f;
     utf32* result;
     utf32* arg;
-    unsigned int arglen;
-    unsigned int slen;
+    size_t arglen;
 
     str = dictionaryLookup(ttm,frame->argv[2]);
     if(str == NULL)
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
 
     arg = frame->argv[1];
     arglen = strlen32(arg);
@@ -1577,11 +3342,9 @@ ttm_isc(TTM* ttm, Frame* frame) /* Initial character scan; moves residual pointe
     f = frame->argv[4];
 
     /* check for initial string match */
-    if(strncmp32(str->body+str->residual,arg,arglen)==0) {
+    if(bodyMatch(str,str->residual,arg,arglen)) {
         result = t;
         str->residual += arglen;
-        slen = strlen32(str->body);
-        if(str->residual > slen) str->residual = slen;
     } else
         result = f;
     setBufferLength(ttm,ttm->result,strlen32(result));
@@ -1596,6 +3359,7 @@ ttm_rrp(TTM* ttm, Frame* frame) /* Reset residual pointer */
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
     str->residual = 0;
 }
 
@@ -1603,43 +3367,37 @@ static void
 ttm_scn(TTM* ttm, Frame* frame) /* Character scan */
 {
     Name* str;
-    unsigned int arglen;
-    unsigned int bodylen;
+    size_t arglen;
+    int found;
     utf32* f;
-    utf32* result;
     utf32* arg;
-    utf32* p;
-    utf32* p0;
+    size_t p;
 
     str = dictionaryLookup(ttm,frame->argv[2]);
     if(str == NULL)
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
 
     arg = frame->argv[1];
     arglen = strlen32(arg);
     f = frame->argv[3];
 
     /* check for sub string match */
-    p0 = str->body+str->residual;
-    p = p0;
-    result = NULL;
-    for(;*p;p++) {
-        if(strncmp32(p,arg,arglen)==0) {result = p; break;}
+    found = 0;
+    for(p=str->residual;p < str->length;p++) {
+        if(bodyMatch(str,p,arg,arglen)) {found = 1; break;}
     }    
-    if(result == NULL) {/* no match; return argv[3] */
+    if(!found) {/* no match; return argv[3] */
         setBufferLength(ttm,ttm->result,strlen32(f));
         strcpy32(ttm->result->content,f);    
     } else {/* return from residual ptr to location of string */
-        unsigned int len = (p - p0);
+        size_t len = p - str->residual;
         setBufferLength(ttm,ttm->result,len);
-        strncpy32(ttm->result->content,p0,len);
-	if(len == 0) {/* if the match is at the residual ptr, mv ptr */
+        bodyChars(str,str->residual,len,ttm->result->content);
+	if(len == 0) /* if the match is at the residual ptr, mv ptr */
 	    str->residual += (arglen);
-            bodylen = strlen32(str->body);
-            if(str->residual > bodylen) str->residual = bodylen;
-	}
     }
 }
 
@@ -1649,29 +3407,32 @@ ttm_sn(TTM* ttm, Frame* frame) /* Skip n characters */
     ERR err;
     long long num;
     Name* str;
-    unsigned int bodylen;
+    size_t bodylen;
 
     str = dictionaryLookup(ttm,frame->argv[2]);
     if(str == NULL)
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
 
     err = toInt64(frame->argv[1],&num);
     if(err != ENOERR) fail(ttm,err);
     if(num < 0) fail(ttm,ENOTNEGATIVE);   
 
-    str->residual += (int)num;
-    bodylen = strlen32(str->body);
-    if(str->residual > bodylen)
+    bodylen = str->length;
+    if(str->residual >= bodylen
+       || (unsigned long long)num > bodylen - str->residual)
         str->residual = bodylen;
+    else
+        str->residual += (size_t)num;
 }
 
 static void
 ttm_eos(TTM* ttm, Frame* frame) /* Test for end of string */
 {
     Name* str;
-    unsigned int bodylen;
+    size_t bodylen;
     utf32* t;
     utf32* f;
     utf32* result;
@@ -1681,7 +3442,7 @@ ttm_eos(TTM* ttm, Frame* frame) /* Test for end of string */
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
-    bodylen = strlen32(str->body);
+    bodylen = str->length;
     t = frame->argv[2];
     f = frame->argv[3];
     result = (str->residual >= bodylen ? t : f);
@@ -1696,7 +3457,7 @@ ttm_gn(TTM* ttm, Frame* frame) /* Give n characters from argument string*/
 {
     utf32* snum = frame->argv[1];
     utf32* s = frame->argv[2];
-    unsigned int slen = strlen32(s);
+    size_t slen = strlen32(s);
     ERR err;
     long long num;
     utf32* startp;
@@ -1704,16 +3465,16 @@ ttm_gn(TTM* ttm, Frame* frame) /* Give n characters from argument string*/
     err = toInt64(snum,&num);
     if(err != ENOERR) fail(ttm,err);
     if(num > 0) {
-        if(slen < num) num = slen;
+        if((unsigned long long)num > slen) num = (long long)slen;
         startp = s;
     } else if(num < 0) {
         num = -num;
         startp = s + num;
-        num = (slen - num);
+        num = ((long long)slen - num);
     }
     if(num != 0) {
-        setBufferLength(ttm,ttm->result,(unsigned int)num);
-        strncpy32(ttm->result->content,startp,(unsigned int)num);
+        setBufferLength(ttm,ttm->result,(size_t)num);
+        strncpy32(ttm->result->content,startp,(size_t)num);
     }
 }
 
@@ -1722,7 +3483,8 @@ ttm_zlc(TTM* ttm, Frame* frame) /* Zero-level commas */
 {
     utf32* s;
     utf32* q;
-    int slen,c,depth;
+    size_t slen;
+    int c,depth;
 
     s = frame->argv[1];
     slen = strlen32(s);
@@ -1744,7 +3506,7 @@ ttm_zlc(TTM* ttm, Frame* frame) /* Zero-level commas */
         }
     }
     *q = NUL32; /* make sure it is terminated */
-    setBufferLength(ttm,ttm->result,(q - ttm->result->content));
+    setBufferLength(ttm,ttm->result,(size_t)(q - ttm->result->content));
 }
 
 static void
@@ -1756,7 +3518,8 @@ ttm_zlcp(TTM* ttm, Frame* frame) /* Zero-level commas and parentheses;
     utf32* p;
     utf32* q;
     utf32 c;
-    int slen,depth;
+    size_t slen;
+    int depth;
 
     s = frame->argv[1];
     slen = strlen32(s);
@@ -1788,7 +3551,7 @@ ttm_zlcp(TTM* ttm, Frame* frame) /* Zero-level commas and parentheses;
         }
     }
     *q = NUL32; /* make sure it is terminated */
-    setBufferLength(ttm,ttm->result,(q-ttm->result->content));
+    setBufferLength(ttm,ttm->result,(size_t)(q-ttm->result->content));
 }
 
 static void
@@ -1797,7 +3560,7 @@ ttm_flip(TTM* ttm, Frame* frame) /* Flip a string */
     utf32* s;
     utf32* q;
     utf32* p;
-    int slen,i;
+    size_t slen,i;
 
     s = frame->argv[1];
     slen = strlen32(s);
@@ -1814,25 +3577,27 @@ ttm_ccl(TTM* ttm, Frame* frame) /* Call class */
     Charclass* cl = charclassLookup(ttm,frame->argv[1]);
     Name* str = dictionaryLookup(ttm,frame->argv[2]);
     utf32 c;
-    utf32* p;
-    utf32* start;
-    int len;
+    size_t p;
+    size_t m;
+    size_t len;
 
     if(cl == NULL || str == NULL)
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
 
     /* Starting at str->residual, locate first char not in class */
-    start = str->body+str->residual;
-    for(p=start;(c=*p);p++) {
+    m = findMark(str,str->residual);
+    for(p=str->residual;p < str->length;p++) {
+        c = bodyNext(str,p,&m);
         if(cl->negative && charclassMatch(c,cl->characters)) break;
         if(!cl->negative && !charclassMatch(c,cl->characters)) break;
     }
-    len = (p - start);
+    len = p - str->residual;
     if(len > 0) {
         setBufferLength(ttm,ttm->result,len);
-        strncpy32(ttm->result->content,start,len);
+        bodyChars(str,str->residual,len,ttm->result->content);
         ttm->result->content[len] = NUL32;
         str->residual += len;
     }
@@ -1886,22 +3651,24 @@ ttm_scl(TTM* ttm, Frame* frame) /* Skip class */
     Charclass* cl = charclassLookup(ttm,frame->argv[1]);
     Name* str = dictionaryLookup(ttm,frame->argv[2]);
     utf32 c;
-    utf32* p;
-    utf32* start;
-    int len;
+    size_t p;
+    size_t m;
+    size_t len;
 
     if(cl == NULL || str == NULL)
         fail(ttm,ENONAME);
     if(str->builtin)
         fail(ttm,ENOPRIM);
+    str = privateName(ttm,str);
 
     /* Starting at str->residual, locate first char not in class */
-    start = str->body+str->residual;
-    for(p=start;(c=*p);p++) {
+    m = findMark(str,str->residual);
+    for(p=str->residual;p < str->length;p++) {
+        c = bodyNext(str,p,&m);
         if(cl->negative && charclassMatch(c,cl->characters)) break;
         if(!cl->negative && !charclassMatch(c,cl->characters)) break;
     }
-    len = (p - start);
+    len = p - str->residual;
     str->residual += len;
 }
 
@@ -1911,7 +3678,7 @@ ttm_tcl(TTM* ttm, Frame* frame) /* Test class */
     Charclass* cl = charclassLookup(ttm,frame->argv[1]);
     Name* str = dictionaryLookup(ttm,frame->argv[2]);
     utf32* retval;
-    int retlen;
+    size_t retlen;
     utf32* t;
     utf32* f;
 
@@ -1925,7 +3692,8 @@ ttm_tcl(TTM* ttm, Frame* frame) /* Test class */
         retval = f;
     else {
         /* see if char at str->residual is in class */
-        utf32 c32 = *(str->body + str->residual);
+        utf32 c32 = (str->residual < str->length
+                     ? bodyAt(str,str->residual) : NUL32);
         if(cl->negative && !charclassMatch(c32,cl->characters)) 
             retval = t;
         else if(!cl->negative && charclassMatch(c32,cl->characters))
@@ -2222,16 +3990,20 @@ ttm_ps(TTM* ttm, Frame* frame) /* Print a Name */
         target=stderr;
     else
         target = stdout;
+    /* Write out the finished text first, so that the string
+       follows it in the output as it does in the document */
+    if(ttm->flags & FLAG_EMIT)
+        deliver(ttm,ttm->stack[0].passive);
     printstring(ttm,target,s);
 }
 
 static void
 ttm_rs(TTM* ttm, Frame* frame) /* Read a Name */
 {
-    int len;
+    size_t len;
     utf32 c;
     for(len=0;;len++) {
-        c=fgetc32(ttm->input);
+        c=readc32(ttm);
         if(c == EOF) break;
         if(c == ttm->metac) break;
         setBufferLength(ttm,ttm->result,len+1);
@@ -2248,6 +4020,95 @@ ttm_psr(TTM* ttm, Frame* frame) /* Print Name and Read */
     frame->argc = argc;
 }
 
+/* Helper for #<cdsw>, #<pksw> and #<forsw>: check and return an integer */
+static unsigned int
+cardSwitch(TTM* ttm, utf32* arg, long long lo, long long hi)
+{
+    long long value;
+    ERR err = toInt64(arg,&value);
+    if(err != ENOERR) fail(ttm,err);
+    if(value < lo || value > hi) fail(ttm,ERANGE);
+    return (unsigned int)value;
+}
+
+static void
+ttm_cd(TTM* ttm, Frame* frame) /* Input one card */
+{
+    struct Cards* cards = &ttm->cards;
+
+    if(!readCard(ttm)) {ttm->flags |= FLAG_EXIT; return;} /* out of input */
+    cards->ahead = 0;
+    ttm->value.text = cards->text; /* the card is inserted without a copy */
+    ttm->value.length = cardLength(ttm,0,cards->cd.cols,cards->cd.sup);
+}
+
+static void
+ttm_cdsw(TTM* ttm, Frame* frame) /* Control cd input */
+{
+    ttm->cards.cd.sup = (int)cardSwitch(ttm,frame->argv[1],0,1);
+    ttm->cards.cd.cols = cardSwitch(ttm,frame->argv[2],1,UINT_MAX);
+}
+
+static void
+ttm_pk(TTM* ttm, Frame* frame) /* Look ahead one card */
+{
+    struct Cards* cards = &ttm->cards;
+
+    if(!readCard(ttm)) {ttm->flags |= FLAG_EXIT; return;} /* out of input */
+    ttm->value.text = cards->text;
+    ttm->value.length = cardLength(ttm,0,cards->pk.cols,cards->pk.sup);
+}
+
+static void
+ttm_pksw(TTM* ttm, Frame* frame) /* Control pk input */
+{
+    ttm->cards.pk.sup = (int)cardSwitch(ttm,frame->argv[1],0,1);
+    ttm->cards.pk.cols = cardSwitch(ttm,frame->argv[2],1,UINT_MAX);
+}
+
+/**
+Input the next complete Fortran statement: the next card
+followed by its continuation cards, which have something
+other than a blank or zero in column 6 (and are not comments).
+Columns 73 on of every card, and columns 1-6 of the
+continuation cards, are dropped.
+*/
+static void
+ttm_for(TTM* ttm, Frame* frame) /* Input next complete fortran statement */
+{
+    struct Cards* cards = &ttm->cards;
+    Buffer* bb = ttm->result;
+    size_t len = 0;
+    unsigned int from = 0;
+    unsigned int n;
+    utf32 c;
+
+    if(!readCard(ttm)) {ttm->flags |= FLAG_EXIT; return;} /* out of input */
+    do {
+        if(from > 0 && cards->foreol) {
+            setBufferLength(ttm,bb,len+1);
+            bb->content[len++] = '\n';
+        }
+        n = cardLength(ttm,from,FORTRANCOLUMNS,cards->forsup);
+        setBufferLength(ttm,bb,len+n);
+        memcpy32(bb->content+len,cards->text+from,n);
+        len += n;
+        cards->ahead = 0;
+        from = 6;
+        if(!readCard(ttm) || cards->length < 6) break;
+        c = cards->text[0];
+        if(c == 'C' || c == 'c' || c == '*') break; /* comment */
+        c = cards->text[5];
+    } while(c != ' ' && c != '0');
+}
+
+static void
+ttm_forsw(TTM* ttm, Frame* frame) /* Control for input */
+{
+    ttm->cards.forsup = (int)cardSwitch(ttm,frame->argv[1],0,1);
+    ttm->cards.foreol = (int)cardSwitch(ttm,frame->argv[2],0,1);
+}
+
 static void
 ttm_cm(TTM* ttm, Frame* frame) /* Change meta character */
 {
@@ -2262,54 +4123,165 @@ static void
 ttm_pf(TTM* ttm, Frame* frame) /* Flush stdout and/or stderr */
 {
     utf32* stdxx = (frame->argc == 1 ? NULL : frame->argv[1]);
-    if(stdxx == NULL || streq32ascii(stdxx,"stdout"))
-        fflush(stderr);
+    if(stdxx == NULL || streq32ascii(stdxx,"stdout")) {
+        flushWriter(ttm,&ttm->writers[WSTDOUT]);
+        if(ttm->writers[WOUTPUT].bytes != NULL)
+            flushWriter(ttm,&ttm->writers[WOUTPUT]);
+    }
     if(stdxx == NULL || streq32ascii(stdxx,"stderr"))
-        fflush(stderr);
+        flushWriter(ttm,&ttm->writers[WSTDERR]);
 }
 
-/* Library Operations */
+static void
+ttm_divert(TTM* ttm, Frame* frame) /* Divert finished text */
+{
+    utf32* name = (frame->argc == 1 ? NULL : frame->argv[1]);
+    deliver(ttm,ttm->stack[0].passive);
+    if(name == NULL || strlen32(name) == 0)
+        ttm->diversions.current = NULL;
+    else
+        ttm->diversions.current = findDiversion(ttm,name,1);
+}
+
+static void
+ttm_undivert(TTM* ttm, Frame* frame) /* Bring back diverted text */
+{
+    Diversion* d;
+    unsigned int i;
+
+    deliver(ttm,ttm->stack[0].passive);
+    if(frame->argc == 1) {
+        for(d=ttm->diversions.list;d != NULL;d=d->next)
+            undivert(ttm,d);
+    } else for(i=1;i<frame->argc;i++) {
+        d = findDiversion(ttm,frame->argv[i],0);
+        if(d != NULL) undivert(ttm,d);
+    }
+}
+
+/* Library Operations */
+
+/**
+The library functions operate on the program
+library file declared by #<libs>; see libraryOpen.
+*/
+
+static void
+ttm_store(TTM* ttm, Frame* frame) /* Store a Program */
+{
+    libraryStore(ttm,frame->argv[1],frame->argv[2]);
+}
+
+static void
+ttm_delete(TTM* ttm, Frame* frame) /* Delete a Program */
+{
+    libraryDelete(ttm,frame->argv[1]);
+}
+
+static void
+ttm_copy(TTM* ttm, Frame* frame) /* Copy a Program */
+{
+    libraryCopy(ttm,frame->argv[1]);
+}
+
+static void
+ttm_show(TTM* ttm, Frame* frame) /* Show Program Names */
+{
+    libraryShow(ttm,(frame->argc > 1 ? frame->argv[1] : NULL));
+}
+
+static void
+ttm_libs(TTM* ttm, Frame* frame) /* Declare standard qualifiers */
+{
+    utf32* initials = frame->argv[1];
+    utf32* path = frame->argv[2];
+    char filename[8192];
+    int count;
+    utf32* p;
+
+    for(p=initials;*p;p++) {
+        if(*p == (utf32)'.') fail(ttm,EINITIALS);
+    }
+    count = toString8(filename,path,TOEOS,sizeof(filename)-1);
+    if(count <= 0)
+        fail(ttm,EATTACH);
+    filename[count] = '\0';
+    libraryClose(ttm);
+    if(ttm->library.filename != NULL)
+        free(ttm->library.filename);
+    if(ttm->library.initials != NULL)
+        free(ttm->library.initials);
+    ttm->library.filename = strdup(filename);
+    ttm->library.initials = strdup32(initials);
+}
 
 static void
 ttm_names(TTM* ttm, Frame* frame) /* Obtain all Name instance names in sorted order */
 {
     int i,nnames,index,allnames;
     utf32** names;
-    unsigned int len;
+    size_t len;
     utf32* p;
+    Name* bin;
 
     allnames = (frame->argc > 1 ? 1 : 0);
 
     /* First, figure out the number of names and the total size */
     len = 0;
-    for(nnames=0,i=0;i<HASHSIZE;i++) {
+    nnames = 0;
+    if(allnames) {/* static builtins not superseded by the dictionary */
+        for(i=0;(bin=builtinName(i)) != NULL;i++) {
+            if(ttm->shadow[i]) continue;
+            len += strlen32(bin->entry.name);
+            nnames++;
+        }
+    }
+    for(i=0;i<HASHSIZE;i++) {
 	struct HashEntry* entry = ttm->dictionary.table[i].next;
         while(entry != NULL) {
 	    Name* name = (Name*)entry;
-	    if(allnames || !name->builtin) {
+	    if(!name->tombstone && (allnames || !name->builtin)) {
 		len += strlen32(name->entry.name);
                 nnames++;
             }
 	    entry = entry->next;
         }
+        if(ttm->base == NULL) continue;
+        for(entry=ttm->base->dictionary.table[i].next;entry != NULL;entry=entry->next) {
+	    Name* name = (Name*)entry;
+	    if((allnames || !name->builtin) && !hiddenName(ttm,name)) {
+		len += strlen32(name->entry.name);
+                nnames++;
+            }
+        }
     }
 
     if(nnames == 0)
         return;
 
     /* Now collect all the names */
-    names = (utf32**)malloc(sizeof(utf32*)*nnames);
-    if(names == NULL) fail(ttm,EMEMORY);
+    names = (utf32**)holdScratch(ttm,SCRATCHMEMORY,malloc(sizeof(utf32*)*nnames),0);
     index = 0;
+    if(allnames) {
+        for(i=0;(bin=builtinName(i)) != NULL;i++) {
+            if(!ttm->shadow[i]) names[index++] = bin->entry.name;
+        }
+    }
     for(i=0;i<HASHSIZE;i++) {
 	struct HashEntry* entry = ttm->dictionary.table[i].next;
         while(entry != NULL) {
 	    Name* name = (Name*)entry;
-            if(allnames || !name->builtin) {
+            if(!name->tombstone && (allnames || !name->builtin)) {
                 names[index++] = name->entry.name;                
             }
             entry = entry->next;
         }
+        if(ttm->base == NULL) continue;
+        for(entry=ttm->base->dictionary.table[i].next;entry != NULL;entry=entry->next) {
+	    Name* name = (Name*)entry;
+	    if((allnames || !name->builtin) && !hiddenName(ttm,name))
+                names[index++] = name->entry.name;
+        }
     }
 
     /* Now bubble sort the set of names */
@@ -2335,6 +4307,7 @@ ttm_names(TTM* ttm, Frame* frame) /* Obtain all Name instance names in sorted or
         strcpy32(p,names[i]);
         p += strlen32(names[i]);
     }
+    dropScratch(ttm,names);
 }
 
 static void
@@ -2376,7 +4349,7 @@ ttm_norm(TTM* ttm, Frame* frame) /* Obtain the Norm of a string */
     int count;
 
     s = frame->argv[1];
-    snprintf(result,sizeof(result),"%u",strlen32(s));
+    snprintf(result,sizeof(result),"%llu",(unsigned long long)strlen32(s));
     setBufferLength(ttm,ttm->result,strlen(result)); /*temp*/
     count = toString32(ttm->result->content,result,TOEOS);
     setBufferLength(ttm,ttm->result,count);
@@ -2431,9 +4404,13 @@ ttm_ctime(TTM* ttm, Frame* frame) /* Convert ##<time> to printable string */
     if(err != ENOERR) fail(ttm,err);
     tod = tod/100; /* need seconds */
     ttod = (time_t)tod;
-    snprintf(result,sizeof(result),"%s",ctime(&ttod));
+#ifdef MSWINDOWS
+    snprintf(result,sizeof(result),"%s",ctime(&ttod)); /* per thread */
+#else
+    if(ctime_r(&ttod,result) == NULL) result[0] = NUL;
+#endif
     /* ctime adds a trailing new line; remove it */
-    i = strlen(result);
+    i = (int)strlen(result);
     for(i--;i >= 0;i--) {
 	if(result[i] != '\n' && result[i] != '\r') break;
     }
@@ -2450,7 +4427,7 @@ ttm_tf(TTM* ttm, Frame* frame) /* Turn Trace Off */
         for(i=1;i<frame->argc;i++) {
             Name* fcn = dictionaryLookup(ttm,frame->argv[i]);
             if(fcn == NULL) fail(ttm,ENONAME);      
-            fcn->trace = 0;
+            if(fcn->trace) privateName(ttm,fcn)->trace = 0; /* static => never traced */
         }
     } else { /* turn off all tracing */
         int i;
@@ -2461,6 +4438,12 @@ ttm_tf(TTM* ttm, Frame* frame) /* Turn Trace Off */
                 name->trace = 0;
                 entry = entry->next;
             }
+            if(ttm->base == NULL) continue;
+            for(entry=ttm->base->dictionary.table[i].next;entry != NULL;entry=entry->next) {
+                Name* name = (Name*)entry;
+                if(name->trace && !hiddenName(ttm,name))
+                    privateName(ttm,name)->trace = 0;
+            }
         }
         ttm->flags &= ~(FLAG_TRACE);
     }
@@ -2474,6 +4457,7 @@ ttm_tn(TTM* ttm, Frame* frame) /* Turn Trace On */
         for(i=1;i<frame->argc;i++) {
             Name* fcn = dictionaryLookup(ttm,frame->argv[i]);
             if(fcn == NULL) fail(ttm,ENONAME);      
+            fcn = privateName(ttm,fcn);
             fcn->trace = 1;
         }
     } else 
@@ -2493,23 +4477,23 @@ ttm_argv(TTM* ttm, Frame* frame)
 
     err = toInt64(frame->argv[1],&index);
     if(err != ENOERR) fail(ttm,err);
-    if(index < 0 || index >= getOptionNameLength(argoptions))
+    if(index < 0 || index >= getOptionNameLength(ttm->options.args))
         fail(ttm,ERANGE);
-    arg = argoptions[index];
-    arglen = strlen(arg);
+    arg = ttm->options.args[index];
+    arglen = (int)strlen(arg);
     setBufferLength(ttm,ttm->result,arglen);/*temp*/
     count = toString32(ttm->result->content,arg,arglen);
     setBufferLength(ttm,ttm->result,count);
 }
 
-/* Get the length of argoptions */
+/* Get the number of #<argv> arguments */
 static void
 ttm_argc(TTM* ttm, Frame* frame)
 {
     char result[MAXINTCHARS+1];
     int argc,count;
 
-    argc = getOptionNameLength(argoptions);
+    argc = getOptionNameLength(ttm->options.args);
     snprintf(result,sizeof(result),"%d",argc);
     setBufferLength(ttm,ttm->result,strlen(result));/*temp*/
     count = toString32(ttm->result->content,result,TOEOS);
@@ -2521,7 +4505,7 @@ ttm_classes(TTM* ttm, Frame* frame) /* Obtain all character class names */
 {
     int i,nclasses,index;
     utf32** classes;
-    unsigned int len;
+    size_t len;
     utf32* p;
 
     /* First, figure out the number of classes */
@@ -2537,8 +4521,7 @@ ttm_classes(TTM* ttm, Frame* frame) /* Obtain all character class names */
         return;
 
     /* Now collect all the class and their total size */
-    classes = (utf32**)malloc(sizeof(utf32*)*nclasses);
-    if(classes == NULL) fail(ttm,EMEMORY);
+    classes = (utf32**)holdScratch(ttm,SCRATCHMEMORY,malloc(sizeof(utf32*)*nclasses),0);
     for(len=0,index=0,i=0;i<HASHSIZE;i++) {
 	struct HashEntry* entry = ttm->charclasses.table[i].next;
 	while(entry != NULL) {
@@ -2573,6 +4556,7 @@ ttm_classes(TTM* ttm, Frame* frame) /* Obtain all character class names */
         strcpy32(p,classes[i]);
         p += strlen32(classes[i]);
     }
+    dropScratch(ttm,classes);
 }
 
 static void
@@ -2582,7 +4566,7 @@ ttm_lf(TTM* ttm, Frame* frame) /* Lock a function from being deleted */
     for(i=1;i<frame->argc;i++) {
         Name* fcn = dictionaryLookup(ttm,frame->argv[i]);
         if(fcn == NULL) fail(ttm,ENONAME);          
-        fcn->locked = 1;
+        if(!fcn->locked) privateName(ttm,fcn)->locked = 1; /* static => always locked */
     }
 }
 
@@ -2593,16 +4577,109 @@ ttm_uf(TTM* ttm, Frame* frame) /* Un-Lock a function from being deleted */
     for(i=1;i<frame->argc;i++) {
         Name* fcn = dictionaryLookup(ttm,frame->argv[i]);
         if(fcn == NULL) fail(ttm,ENONAME);          
+        fcn = privateName(ttm,fcn);
         fcn->locked = 0;
     }
 }
 
+/**
+#<try;body;handler> scans body in place of the call, in a
+scan() of its own that stops at a NUL put just past it, so
+that an error while it runs comes back here: fail() longjmp's
+to TTM.recover.jump instead of exiting.  The calls that the
+body had in progress and the text it had produced are then
+abandoned by restoring stacknext and bb->passive to what they
+were when #<try> began, and bb->active is moved past the NUL.
+The value is that of calling the string named by handler with
+the error number and its description as its arguments, or
+empty if there is no handler.  On success the value is the
+text the body produced; for ##<try> it is left in place.
+What the failing builtin held as scratch (see holdScratch())
+is freed before the handler is called.
+*/
+static void
+ttm_try(TTM* ttm, Frame* frame)
+{
+    Buffer* bb = ttm->buffer;
+    jmp_buf jump;
+    jmp_buf* outer = ttm->recover.jump;
+    unsigned int stacknext = ttm->stacknext;
+    unsigned int scratch = ttm->recover.nscratch;
+    size_t bodylen = strlen32(frame->argv[1]);
+    utf32* volatile handler = NULL; /* used after a longjmp */
+    utf32* p;
+    ERR err;
+
+    /* The body is scanned over its own argument text */
+    if(frame->argc > 2 && (handler = strdup32(frame->argv[2])) == NULL)
+        fail(ttm,EMEMORY);
+    p = bb->active - (bodylen + 1);
+    memmove((void*)p,(void*)frame->argv[1],bodylen*sizeof(utf32));
+    p[bodylen] = NUL32;
+    bb->active = p;
+    /* That may overwrite the argument text; keep a name for trace() */
+    frame->argv[0] = (utf32*)U"try";
+    frame->argc = 1;
+    ttm->recover.jump = &jump;
+    ttm->recover.tries++;
+    if(setjmp(jump) == 0) {
+        scan(ttm);
+        ttm->recover.jump = outer;
+        ttm->recover.tries--;
+        if(handler != NULL) free(handler);
+        if(ttm->flags & FLAG_EXIT) return;
+        bb->active++; /* past the NUL */
+        resetBuffer(ttm,ttm->result); /* the body's calls used it */
+        if(frame->active) {
+            size_t len = (size_t)(bb->passive - frame->passive);
+            setBufferLength(ttm,ttm->result,len);
+            memcpy32(ttm->result->content,frame->passive,len);
+            bb->passive = frame->passive;
+        }
+        return;
+    }
+    ttm->recover.jump = outer;
+    ttm->recover.tries--;
+    err = ttm->recover.err;
+    ttm->recover.err = ENOERR;
+    ttm->recover.msg[0] = NUL;
+    releaseScratch(ttm,scratch);
+    ttm->stacknext = stacknext;
+    ttm->value.text = NULL;
+    for(p=bb->active;*p != NUL32;p++);
+    bb->active = p+1;
+    bb->passive = frame->passive;
+    resetBuffer(ttm,ttm->result);
+    if(handler != NULL) {
+        utf32 code[MAXINTCHARS+1];
+        utf32 msg[256];
+        Frame hf;
+        Name* fcn = dictionaryLookup(ttm,handler);
+        int count;
+
+        if(fcn == NULL || fcn->builtin) {
+            free(handler);
+            fail(ttm,(fcn == NULL ? ENONAME : ENOPRIM));
+        }
+        count = int2string(code,(long long)err);
+        code[count] = NUL32;
+        count = toString32(msg,(char_t*)errstring(err),(int)(sizeof(msg)/sizeof(utf32))-1);
+        msg[count] = NUL32;
+        hf.argv[0] = handler;
+        hf.argv[1] = code;
+        hf.argv[2] = msg;
+        hf.argc = 3;
+        hf.active = frame->active;
+        hf.passive = frame->passive;
+        call(ttm,&hf,fcn);
+        free(handler);
+    }
+}
+
 static void
 ttm_include(TTM* ttm, Frame* frame)  /* Include text of a file */
 {
     utf32* path;
-    FILE* finclude;
-    Buffer* bb = ttm->result;
     char filename[8192];
     int count;
 
@@ -2612,10 +4689,129 @@ ttm_include(TTM* ttm, Frame* frame)  /* Include text of a file */
     count = toString8(filename,path,TOEOS,sizeof(filename));
     if(count < 0)
 	fail(ttm,EINCLUDE);
-    finclude = fopen(filename,"r");
-    if(finclude == NULL)
+    includeFile(ttm,filename);
+}
+
+static void
+ttm_load(TTM* ttm, Frame* frame)  /* Load a file into a name */
+{
+    utf32* path;
+    char filename[8192];
+    utf32* text;
+    int count;
+
+    path = frame->argv[2];
+    if(strlen32(path) == 0)
         fail(ttm,EINCLUDE);
-    readfile(ttm,finclude,bb);
+    count = toString8(filename,path,TOEOS,sizeof(filename));
+    if(count < 0)
+	fail(ttm,EINCLUDE);
+    text = (utf32*)holdScratch(ttm,SCRATCHMEMORY,loadFile(ttm,filename),0);
+    setBody(ttm,defineName(ttm,frame->argv[1]),text,strlen32(text));
+    dropScratch(ttm,text);
+}
+
+static void
+ttm_fopen(TTM* ttm, Frame* frame)  /* Open a file under a handle */
+{
+    utf32* mode = frame->argv[3];
+    char filename[8192];
+    char path[8192];
+    struct Handle* h = NULL;
+    FILE* file;
+    unsigned char* bytes = NULL;
+    int i, count;
+
+    for(i=0;i<MAXHANDLES;i++) {
+        if(ttm->handles[i].name == NULL) {
+            if(h == NULL) h = &ttm->handles[i];
+        } else if(strcmp32(ttm->handles[i].name,frame->argv[1]) == 0)
+            fail(ttm,EHANDLE); /* already open */
+    }
+    if(h == NULL) fail(ttm,EHANDLE); /* too many open */
+    if(strlen32(frame->argv[2]) == 0)
+        fail(ttm,EOPEN);
+    count = toString8(filename,frame->argv[2],TOEOS,sizeof(filename));
+    if(count < 0)
+	fail(ttm,EOPEN);
+    if(streq32ascii(mode,"r")) {
+        file = (FILE*)holdScratch(ttm,SCRATCHFILE,openInclude(ttm,filename,path,sizeof(path)),0);
+        bytes = (unsigned char*)holdScratch(ttm,SCRATCHMEMORY,
+                                            malloc(READBLOCKSIZE+MAXCHARSIZE),0);
+        h->codec = readerCodec(ttm,file);
+        h->bytes = bytes;
+        h->writing = 0;
+    } else if(streq32ascii(mode,"w") || streq32ascii(mode,"a")) {
+        if(outsidePath(filename))
+            fail(ttm,EOPEN); /* must be relative */
+        if(compressedName(filename) && !haveCodec(compressedName(filename)))
+            fail(ttm,ECODEC); /* before the file is created */
+        file = fopen(filename,(mode[0] == 'w' ? "w" : "a"));
+        if(file == NULL) fail(ttm,EOPEN);
+        holdScratch(ttm,SCRATCHFILE,file,0);
+        initWriter(ttm,&h->writer,file,-1,WRITEBLOCKSIZE);
+        if(compressedName(filename))
+            h->writer.codec = openCodec(ttm,file,compressedName(filename),1);
+        h->writing = 1;
+    } else
+        fail(ttm,EOPEN);
+    if(bytes != NULL) keepScratch(ttm,bytes);
+    keepScratch(ttm,file);
+    h->file = file;
+    h->next = 0;
+    h->count = 0;
+    h->name = strdup32(frame->argv[1]);
+}
+
+static void
+ttm_readln(TTM* ttm, Frame* frame)  /* Read a line from a handle */
+{
+    struct Handle* h = findHandle(ttm,frame->argv[1]);
+    Buffer* bb = ttm->result;
+    size_t len = 0;
+    size_t n, used;
+    unsigned char* p;
+    unsigned char* nl;
+
+    if(h->writing) fail(ttm,EHANDLE);
+    for(;;) {
+        if(h->next == h->count && fillHandle(ttm,h) == 0) {
+            /* end of file; the last line may lack its newline */
+            if(len == 0 && frame->argc > 2) {
+                setBufferLength(ttm,bb,strlen32(frame->argv[2]));
+                strcpy32(bb->content,frame->argv[2]);
+                return;
+            }
+            break;
+        }
+        p = h->bytes + h->next;
+        n = h->count - h->next;
+        nl = (unsigned char*)memchr(p,'\n',n);
+        if(nl != NULL) n = (size_t)(nl - p);
+        len += decode8(ttm,p,n,bb->content+len,bb->alloc-1-len,&used);
+        h->next += used;
+        if(nl != NULL) {
+            if(used < n) fail(ttm,ECHAR8); /* cut off by the newline */
+            h->next++;
+            break;
+        }
+        if(h->next < h->count) fillHandle(ttm,h); /* partial character */
+    }
+    setBufferLength(ttm,bb,(unsigned int)len);
+}
+
+static void
+ttm_fwrite(TTM* ttm, Frame* frame)  /* Write to a handle */
+{
+    struct Handle* h = findHandle(ttm,frame->argv[1]);
+    if(!h->writing) fail(ttm,EHANDLE);
+    writestring(ttm,&h->writer,frame->argv[2]);
+}
+
+static void
+ttm_fclose(TTM* ttm, Frame* frame)  /* Close a handle */
+{
+    closeHandle(ttm,findHandle(ttm,frame->argv[1]));
 }
 
 /**
@@ -2648,9 +4844,10 @@ ttm_ttm_info_name(TTM* ttm, Frame* frame)
     Buffer* result = ttm->result;
     char info[8192];
     utf32* q;
-    utf32* p;
+    size_t p, m;
     utf32 c32;
-    unsigned int namelen,count,i;
+    unsigned int count,i;
+    size_t namelen;
 
     setBufferLength(ttm,result,result->alloc-1);
     q = result->content;
@@ -2686,12 +4883,13 @@ ttm_ttm_info_name(TTM* ttm, Frame* frame)
             q += count;
         }
         if(!str->builtin) {
-            snprintf(info,sizeof(info)," residual=%u body=|",str->residual);
+            snprintf(info,sizeof(info)," residual=%llu body=|",
+                     (unsigned long long)str->residual);
             count = toString32(q,info,TOEOS);
             q += count;
             /* Walk the body checking for segment and creation marks */
-            p=str->body;
-            while((c32=*p++)) {
+            for(p=0,m=0;p < str->length;p++) {
+                c32 = bodyNext(str,p,&m);
                 if(ismark(c32)) {
                     if(iscreate(c32))
                         strcpy(info,"^00");
@@ -2725,7 +4923,8 @@ ttm_ttm_info_class(TTM* ttm, Frame* frame) /* Misc. combined actions */
     utf32* q;
     utf32* p;
     utf32 c32;
-    unsigned int i,len;
+    unsigned int i;
+    size_t len;
     Buffer* result = ttm->result;
 
     q = result->content;
@@ -2757,8 +4956,24 @@ ttm_ttm_info_class(TTM* ttm, Frame* frame) /* Misc. combined actions */
 }
 
 /**
-#<ttm;info;class;...>
+#<ttm;info;include>
 */
+static void
+ttm_ttm_info_include(TTM* ttm, Frame* frame)
+{
+    struct Includes* inc = &ttm->includes;
+    struct Included* f;
+    unsigned int nfiles = 0;
+    char info[256];
+    int count;
+
+    for(f=inc->files;f != NULL;f=f->next) nfiles++;
+    snprintf(info,sizeof(info),"hits=%lu misses=%lu files=%u chars=%lu\n",
+             inc->hits,inc->misses,nfiles,inc->chars);
+    setBufferLength(ttm,ttm->result,strlen(info));
+    count = toString32(ttm->result->content,info,TOEOS);
+    setBufferLength(ttm,ttm->result,count);
+}
 
 static void
 ttm_ttm(TTM* ttm, Frame* frame) /* Misc. combined actions */
@@ -2772,15 +4987,22 @@ ttm_ttm(TTM* ttm, Frame* frame) /* Misc. combined actions */
 
     if(frame->argc >= 3 && strcmp("meta",discrim)==0) {
         ttm_ttm_meta(ttm,frame);
-    } else if(frame->argc >= 4 && strcmp("info",discrim)==0) {
+    } else if(frame->argc >= 3 && strcmp("info",discrim)==0) {
         count = toString8(discrim,frame->argv[2],TOEOS,sizeof(discrim));
         discrim[count] = NUL;
-        if(strcmp("name",discrim)==0) {
+        if(frame->argc >= 4 && strcmp("name",discrim)==0) {
             ttm_ttm_info_name(ttm,frame);
-        } else if(strcmp("class",discrim)==0) {
+        } else if(frame->argc >= 4 && strcmp("class",discrim)==0) {
             ttm_ttm_info_class(ttm,frame);
+        } else if(strcmp("include",discrim)==0) {
+            ttm_ttm_info_include(ttm,frame);
         } else
             fail(ttm,ETTMCMD);
+    } else if(frame->argc >= 3 && strcmp("checkpoint",discrim)==0) {
+        char filename[8192];
+        count = toString8(filename,frame->argv[2],TOEOS,sizeof(filename));
+        if(count <= 0) fail(ttm,ECHECKPOINT);
+        saveCheckpoint(ttm,filename);
     } else {
         fail(ttm,ETTMCMD);
     }
@@ -2793,177 +5015,327 @@ ttm_ttm(TTM* ttm, Frame* frame) /* Misc. combined actions */
  Builtin function table
 */
 
-struct Builtin {
-    char* name;
-    unsigned int minargs;
-    unsigned int maxargs;
-    char* sv;
-    TTMFCN fcn;
-};
-
 /* TODO: fix the minargs values */
 
 /* Define a subset of the original TTM functions */
 
 /* Define some temporary macros */
 #define ARB MAXARGS
+#define S 1  /* novalue */
+#define SV 0
+#define V 0
+
+/* Builtin names are ASCII, so their utf32 spelling is the
+   same as that of a C11 U"..." literal.
+*/
+#define BUILTIN(name,minargs,maxargs,sv,fcn) \
+    {{(utf32*)U##name,0,NULL},0,1,1,1,minargs,maxargs,sv,0,0,fcn,NULL}
 
-static struct Builtin builtin_orig[] = {
+static Name builtin_orig[] = {
     /* Dictionary Operations */
-    {"ap",2,2,"S",ttm_ap}, /* Append to a string */
-    {"cf",2,2,"S",ttm_cf}, /* Copy a function */
-    {"cr",2,2,"S",ttm_cr}, /* Mark for creation */
-    {"ds",2,2,"S",ttm_ds}, /* Define string */
-    {"es",1,ARB,"S",ttm_es}, /* Erase string */
-    {"sc",2,63,"SV",ttm_sc}, /* Segment and count */
-    {"ss",2,2,"S",ttm_ss}, /* Segment a string */
+    BUILTIN("ap",2,2,S,ttm_ap), /* Append to a string */
+    BUILTIN("cf",2,2,S,ttm_cf), /* Copy a function */
+    BUILTIN("cr",2,2,S,ttm_cr), /* Mark for creation */
+    BUILTIN("ds",2,2,S,ttm_ds), /* Define string */
+    BUILTIN("es",1,ARB,S,ttm_es), /* Erase string */
+    BUILTIN("sc",2,63,SV,ttm_sc), /* Segment and count */
+    BUILTIN("ss",2,2,S,ttm_ss), /* Segment a string */
     /* Name Selection */
-    {"cc",1,1,"SV",ttm_cc}, /* Call one character */
-    {"cn",2,2,"SV",ttm_cn}, /* Call n characters */
-    {"sn",2,2,"S",ttm_sn}, /* Skip n characters */ /*Batch*/
-    {"cp",1,1,"SV",ttm_cp}, /* Call parameter */
-    {"cs",1,1,"SV",ttm_cs}, /* Call segment */
-    {"isc",4,4,"SV",ttm_isc}, /* Initial character scan */
-    {"rrp",1,1,"S",ttm_rrp}, /* Reset residual pointer */
-    {"scn",3,3,"SV",ttm_scn}, /* Character scan */
+    BUILTIN("cc",1,1,SV,ttm_cc), /* Call one character */
+    BUILTIN("cn",2,2,SV,ttm_cn), /* Call n characters */
+    BUILTIN("sn",2,2,S,ttm_sn), /* Skip n characters */ /*Batch*/
+    BUILTIN("cp",1,1,SV,ttm_cp), /* Call parameter */
+    BUILTIN("cs",1,1,SV,ttm_cs), /* Call segment */
+    BUILTIN("isc",4,4,SV,ttm_isc), /* Initial character scan */
+    BUILTIN("rrp",1,1,S,ttm_rrp), /* Reset residual pointer */
+    BUILTIN("scn",3,3,SV,ttm_scn), /* Character scan */
     /* Name Scanning Operations */
-    {"gn",2,2,"V",ttm_gn}, /* Give n characters */
-    {"zlc",1,1,"V",ttm_zlc}, /* Zero-level commas */
-    {"zlcp",1,1,"V",ttm_zlcp}, /* Zero-level commas and parentheses */
-    {"flip",1,1,"V",ttm_flip}, /* Flip a string */ /*Batch*/
+    BUILTIN("gn",2,2,V,ttm_gn), /* Give n characters */
+    BUILTIN("zlc",1,1,V,ttm_zlc), /* Zero-level commas */
+    BUILTIN("zlcp",1,1,V,ttm_zlcp), /* Zero-level commas and parentheses */
+    BUILTIN("flip",1,1,V,ttm_flip), /* Flip a string */ /*Batch*/
     /* Character Class Operations */
-    {"ccl",2,2,"SV",ttm_ccl}, /* Call class */
-    {"dcl",2,2,"S",ttm_dcl}, /* Define a class */
-    {"dncl",2,2,"S",ttm_dncl}, /* Define a negative class */
-    {"ecl",1,ARB,"S",ttm_ecl}, /* Erase a class */
-    {"scl",2,2,"S",ttm_scl}, /* Skip class */
-    {"tcl",4,4,"V",ttm_tcl}, /* Test class */
+    BUILTIN("ccl",2,2,SV,ttm_ccl), /* Call class */
+    BUILTIN("dcl",2,2,S,ttm_dcl), /* Define a class */
+    BUILTIN("dncl",2,2,S,ttm_dncl), /* Define a negative class */
+    BUILTIN("ecl",1,ARB,S,ttm_ecl), /* Erase a class */
+    BUILTIN("scl",2,2,S,ttm_scl), /* Skip class */
+    BUILTIN("tcl",4,4,V,ttm_tcl), /* Test class */
     /* Arithmetic Operations */
-    {"abs",1,1,"V",ttm_abs}, /* Obtain absolute value */
-    {"ad",2,ARB,"V",ttm_ad}, /* Add */
-    {"dv",2,2,"V",ttm_dv}, /* Divide and give quotient */
-    {"dvr",2,2,"V",ttm_dvr}, /* Divide and give remainder */
-    {"mu",2,ARB,"V",ttm_mu}, /* Multiply */
-    {"su",2,2,"V",ttm_su}, /* Substract */
+    BUILTIN("abs",1,1,V,ttm_abs), /* Obtain absolute value */
+    BUILTIN("ad",2,ARB,V,ttm_ad), /* Add */
+    BUILTIN("dv",2,2,V,ttm_dv), /* Divide and give quotient */
+    BUILTIN("dvr",2,2,V,ttm_dvr), /* Divide and give remainder */
+    BUILTIN("mu",2,ARB,V,ttm_mu), /* Multiply */
+    BUILTIN("su",2,2,V,ttm_su), /* Substract */
     /* Numeric Comparisons */
-    {"eq",4,4,"V",ttm_eq}, /* Compare numeric equal */
-    {"gt",4,4,"V",ttm_gt}, /* Compare numeric greater-than */
-    {"lt",4,4,"V",ttm_lt}, /* Compare numeric less-than */
+    BUILTIN("eq",4,4,V,ttm_eq), /* Compare numeric equal */
+    BUILTIN("gt",4,4,V,ttm_gt), /* Compare numeric greater-than */
+    BUILTIN("lt",4,4,V,ttm_lt), /* Compare numeric less-than */
     /* Logical Comparisons */
-    {"eq?",4,4,"V",ttm_eql}, /* ? Compare logical equal */
-    {"gt?",4,4,"V",ttm_gtl}, /* ? Compare logical greater-than */
-    {"lt?",4,4,"V",ttm_ltl}, /* ? Compare logical less-than */
+    BUILTIN("eq?",4,4,V,ttm_eql), /* ? Compare logical equal */
+    BUILTIN("gt?",4,4,V,ttm_gtl), /* ? Compare logical greater-than */
+    BUILTIN("lt?",4,4,V,ttm_ltl), /* ? Compare logical less-than */
     /* Peripheral Input/Output Operations */
-    {"cm",1,1,"S",ttm_cm}, /*Change Meta Character*/
-    {"ps",1,2,"S",ttm_ps}, /* Print a Name */
-    {"psr",1,1,"SV",ttm_psr}, /* Print Name and Read */
+    BUILTIN("cm",1,1,S,ttm_cm), /*Change Meta Character*/
+    BUILTIN("ps",1,2,S,ttm_ps), /* Print a Name */
+    BUILTIN("psr",1,1,SV,ttm_psr), /* Print Name and Read */
 #ifdef IMPLEMENTED
-    {"rcd",2,2,"S",ttm_rcd}, /* Set to Read Prom Cards */
+    BUILTIN("rcd",2,2,S,ttm_rcd), /* Set to Read Prom Cards */
 #endif
-    {"rs",0,0,"V",ttm_rs}, /* Read a Name */
+    BUILTIN("rs",0,0,V,ttm_rs), /* Read a Name */
     /*Formated Output Operations*/
 #ifdef IMPLEMENTED
-    {"fm",1,ARB,"S",ttm_fm}, /* Format a Line or Card */
-    {"tabs",1,8,"S",ttm_tabs}, /* Declare Tab Positions */
-    {"scc",2,2,"S",ttm_scc}, /* Set Continuation Convention */
-    {"icc",1,1,"S",ttm_icc}, /* Insert a Control Character */
-    {"outb",0,3,"S",ttm_outb}, /* Output the Buffer */
+    BUILTIN("fm",1,ARB,S,ttm_fm), /* Format a Line or Card */
+    BUILTIN("tabs",1,8,S,ttm_tabs), /* Declare Tab Positions */
+    BUILTIN("scc",2,2,S,ttm_scc), /* Set Continuation Convention */
+    BUILTIN("icc",1,1,S,ttm_icc), /* Insert a Control Character */
+    BUILTIN("outb",0,3,S,ttm_outb), /* Output the Buffer */
 #endif
     /* Library Operations */
-#ifdef IMPLEMENTED
-    {"store",2,2,"S",ttm_store}, /* Store a Program */
-    {"delete",1,1,"S",ttm_delete}, /* Delete a Program */
-    {"copy",1,1,"S",ttm_copy}, /* Copy a Program */
-    {"show",0,1,"S",ttm_show}, /* Show Program Names */
-    {"libs",2,2,"S",ttm_libs}, /* Declare standard qualifiers */ /*Batch*/
-#endif
-    {"names",0,1,"V",ttm_names}, /* Obtain Name Names */
+    BUILTIN("store",2,2,S,ttm_store), /* Store a Program */
+    BUILTIN("delete",1,1,S,ttm_delete), /* Delete a Program */
+    BUILTIN("copy",1,1,S,ttm_copy), /* Copy a Program */
+    BUILTIN("show",0,1,S,ttm_show), /* Show Program Names */
+    BUILTIN("libs",2,2,S,ttm_libs), /* Declare standard qualifiers */ /*Batch*/
+    BUILTIN("names",0,1,V,ttm_names), /* Obtain Name Names */
     /* Utility Operations */
 #ifdef IMPLEMENTED
-    {"break",0,1,"S",ttm_break}, /* Program Break */
+    BUILTIN("break",0,1,S,ttm_break), /* Program Break */
 #endif
-    {"exit",0,0,"S",ttm_exit}, /* Return from TTM */
-    {"ndf",3,3,"V",ttm_ndf}, /* Determine if a Name is Defined */
-    {"norm",1,1,"V",ttm_norm}, /* Obtain the Norm of a Name */
-    {"time",0,0,"V",ttm_time}, /* Obtain time of day (modified) */
-    {"xtime",0,0,"V",ttm_xtime}, /* Obtain execution time */ /*Batch*/
-    {"tf",0,0,"S",ttm_tf}, /* Turn Trace Off */
-    {"tn",0,0,"S",ttm_tn}, /* Turn Trace On */
-    {"eos",3,3,"V",ttm_eos}, /* Test for end of string */ /*Batch*/
+    BUILTIN("exit",0,0,S,ttm_exit), /* Return from TTM */
+    BUILTIN("ndf",3,3,V,ttm_ndf), /* Determine if a Name is Defined */
+    BUILTIN("norm",1,1,V,ttm_norm), /* Obtain the Norm of a Name */
+    BUILTIN("time",0,0,V,ttm_time), /* Obtain time of day (modified) */
+    BUILTIN("xtime",0,0,V,ttm_xtime), /* Obtain execution time */ /*Batch*/
+    BUILTIN("tf",0,0,S,ttm_tf), /* Turn Trace Off */
+    BUILTIN("tn",0,0,S,ttm_tn), /* Turn Trace On */
+    BUILTIN("eos",3,3,V,ttm_eos), /* Test for end of string */ /*Batch*/
+/* Batch Functions */
+    BUILTIN("cd",0,0,V,ttm_cd), /* Input one card */ /*Batch*/
+    BUILTIN("cdsw",2,2,S,ttm_cdsw), /* Control cd input */ /*Batch*/
+    BUILTIN("for",0,0,V,ttm_for), /* Input next complete fortran statement */ /*Batch*/
+    BUILTIN("forsw",2,2,S,ttm_forsw), /* Control for input */ /*Batch*/
+    BUILTIN("pk",0,0,V,ttm_pk), /* Look ahead one card */ /*Batch*/
+    BUILTIN("pksw",2,2,S,ttm_pksw), /* Control pk input */ /*Batch*/
 
 #ifdef IMPLEMENTED
-/* Batch Functions */
-    {"insw",2,2,"S",ttm_insw}, /* Control output of input monitor */ /*Batch*/
-    {"ttmsw",2,2,"S",ttm_ttmsw}, /* Control handling of ttm programs */ /*Batch*/
-    {"cd",0,0,"V",ttm_cd}, /* Input one card */ /*Batch*/
-    {"cdsw",2,2,"S",ttm_cdsw}, /* Control cd input */ /*Batch*/
-    {"for",0,0,"V",ttm_for}, /* Input next complete fortran statement */ /*Batch*/
-    {"forsw",2,2,"S",ttm_forsw}, /* Control for input */ /*Batch*/
-    {"pk",0,0,"V",ttm_pk}, /* Look ahead one card */ /*Batch*/
-    {"pksw",2,2,"S",ttm_pksw}, /* Control pk input */ /*Batch*/
-    {"ps",1,1,"S",ttm_ps}, /* Print a string */ /*Batch*/ /*Modified*/
-    {"page",1,1,"S",ttm_page}, /* Specify page length */ /*Batch*/
-    {"sp",1,1,"S",ttm_sp}, /* Space before printing */ /*Batch*/
-    {"fm",0,ARB,"S",ttm_fm}, /* Format a line or card */ /*Batch*/
-    {"tabs",1,10,"S",ttm_tabs}, /* Declare tab positions */ /*Batch*/ /*Modified*/
-    {"scc",3,3,"S",ttm_scc}, /* Set continuation convention */ /*Batch*/
-    {"fmsw",2,2,"S",ttm_fmsw}, /* Control fm output */ /*Batch*/
-    {"time",0,0,"V",ttm_time}, /* Obtain time of day */ /*Batch*/ /*Modified*/
-    {"des",1,1,"S",ttm_des}, /* Define error string */ /*Batch*/
+    BUILTIN("insw",2,2,S,ttm_insw), /* Control output of input monitor */ /*Batch*/
+    BUILTIN("ttmsw",2,2,S,ttm_ttmsw), /* Control handling of ttm programs */ /*Batch*/
+    BUILTIN("ps",1,1,S,ttm_ps), /* Print a string */ /*Batch*/ /*Modified*/
+    BUILTIN("page",1,1,S,ttm_page), /* Specify page length */ /*Batch*/
+    BUILTIN("sp",1,1,S,ttm_sp), /* Space before printing */ /*Batch*/
+    BUILTIN("fm",0,ARB,S,ttm_fm), /* Format a line or card */ /*Batch*/
+    BUILTIN("tabs",1,10,S,ttm_tabs), /* Declare tab positions */ /*Batch*/ /*Modified*/
+    BUILTIN("scc",3,3,S,ttm_scc), /* Set continuation convention */ /*Batch*/
+    BUILTIN("fmsw",2,2,S,ttm_fmsw), /* Control fm output */ /*Batch*/
+    BUILTIN("time",0,0,V,ttm_time), /* Obtain time of day */ /*Batch*/ /*Modified*/
+    BUILTIN("des",1,1,S,ttm_des), /* Define error string */ /*Batch*/
 #endif
 
-    {NULL,0,0,NULL} /* terminator */
+    {{NULL,0,NULL}} /* terminator */
     };
     
 /* Functions new to this implementation */
-static struct Builtin builtin_new[] = {
-    {"argv",1,1,"V",ttm_argv}, /* Get ith command line argument; 0<=i<argc */
-    {"argc",0,0,"V",ttm_argc}, /* no. of command line arguments */
-    {"classes",0,0,"V",ttm_classes}, /* Obtain character class Names */
-    {"ctime",1,1,"V",ttm_ctime}, /* Convert time to printable string */
-    {"include",1,1,"S",ttm_include}, /* Include text of a file */
-    {"lf",0,ARB,"S",ttm_lf}, /* Lock functions */
-    {"pf",0,1,"S",ttm_pf}, /* flush stderr and/or stdout */
-    {"uf",0,ARB,"S",ttm_uf}, /* Unlock functions */
-    {"ttm",1,ARB,"SV",ttm_ttm}, /* Misc. combined actions */
-    {NULL,0,0,NULL} /* terminator */
+static Name builtin_new[] = {
+    BUILTIN("argv",1,1,V,ttm_argv), /* Get ith command line argument; 0<=i<argc */
+    BUILTIN("argc",0,0,V,ttm_argc), /* no. of command line arguments */
+    BUILTIN("classes",0,0,V,ttm_classes), /* Obtain character class Names */
+    BUILTIN("ctime",1,1,V,ttm_ctime), /* Convert time to printable string */
+    BUILTIN("divert",0,1,S,ttm_divert), /* Send finished text to a diversion */
+    BUILTIN("include",1,1,V,ttm_include), /* Include text of a file */
+    BUILTIN("fclose",1,1,S,ttm_fclose), /* Close a file handle */
+    BUILTIN("fopen",3,3,S,ttm_fopen), /* Open a file handle */
+    BUILTIN("fwrite",2,2,S,ttm_fwrite), /* Write to a file handle */
+    BUILTIN("lf",0,ARB,S,ttm_lf), /* Lock functions */
+    BUILTIN("load",2,2,S,ttm_load), /* Load a file into a name */
+    BUILTIN("pf",0,1,S,ttm_pf), /* flush stderr and/or stdout */
+    BUILTIN("readln",1,2,V,ttm_readln), /* Read a line from a file handle */
+    BUILTIN("undivert",0,ARB,S,ttm_undivert), /* Output diverted text */
+    BUILTIN("uf",0,ARB,S,ttm_uf), /* Unlock functions */
+    BUILTIN("try",1,2,V,ttm_try), /* Catch an error in a body */
+    BUILTIN("ttm",1,ARB,SV,ttm_ttm), /* Misc. combined actions */
+    {{NULL,0,NULL}} /* terminator */
 };
 
-static void
-defineBuiltinFunction1(TTM* ttm, struct Builtin* bin)
+#undef S
+#undef SV
+#undef V
+#undef BUILTIN
+
+/**************************************************/
+/**
+Builtin Dispatch.
+The builtins are the static, read-only Name records above;
+nothing is registered at startup. They are located through a
+perfect hash over their (utf32) spelling: the name is hashed
+once (FNV-1a using BUILTINSEED as the offset basis); the low
+order bits select a displacement and the displaced high order
+bits select the slot. builtin_slots[slot] is 1+ the index of
+the builtin (see builtinName) or 0 if the slot is empty.
+
+The following tables are generated; whenever a builtin is
+added or removed, regenerate them with "make builtins"
+and paste the output here.
+*/
+
+/* Begin generated builtin hash tables */
+#define BUILTINSEED 0x811c9dc5U
+static unsigned char builtin_disp[BUILTINDISPSIZE] = {
+  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  0,  0,  0,  1,  0,  1,  0,  0,  0,  0,  0,  0,  0,  0,  1,  2,
+  0,  0,  0,  2,  0,  0,  2,  0,  0,  0,  0,  0,  0,  2,  0,  0,
+  0,  0,  0,  0,  2,  0,  0,  0,  0,  0,  0,  1,  0,  0,  0,  0
+};
+static unsigned char builtin_slots[BUILTINHASHSIZE] = {
+  0,  6, 59, 26,  0,  0,  0,  0,  0, 69,  0,  0, 46,  0,  0,  0,
+  0, 30, 10,  0,  0,  0,  0,  0,  0,  0, 48,  1,  7, 17, 19,  0,
+  0, 50,  0, 61, 31, 15,  0,  0, 24,  0,  0,  0,  0, 76,  0,  0,
+  0,  0,  0,  0,  0,  0,  0, 74,  0,  0,  0,  0,  0, 22, 18, 53,
+ 78,  0,  0,  0, 43,  0,  0,  0, 60, 54,  0,  0, 57,  0,  0,  0,
+ 73,  0,  0,  0,  0,  0,  0,  0,  0, 72,  0,  0,  0,  0,  0,  0,
+  0,  0,  0,  0,  0, 41,  0,  0,  0,  0, 32,  0, 70,  5, 39,  0,
+  0, 47,  0,  0,  0, 16,  3, 12,  0, 11, 67,  0,  0,  0,  0,  0,
+  0,  0,  0, 58,  0, 33,  0,  0,  0,  0,  0,  0,  0,  0, 63,  0,
+  0,  0,  0,  8, 40,  2,  0,  0,  0, 56,  0, 51,  0,  0,  0,  0,
+  0,  0, 62, 35,  9, 75, 64,  0, 37, 38, 14,  0,  4,  0,  0, 21,
+ 77,  0,  0,  0, 25, 28,  0,  0,  0,  0, 68,  0, 42, 49,  0, 20,
+  0, 23,  0,  0,  0,  0,  0, 66,  0,  0, 52,  0,  0,  0, 71,  0,
+  0, 36, 55,  0,  0,  0, 13,  0,  0, 29,  0,  0,  0,  0,  0,  0,
+  0,  0, 45,  0,  0,  0,  0,  0,  0,  0, 44,  0, 34, 65,  0,  0,
+  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 27,  0,  0,  0
+};
+/* End generated builtin hash tables */
+
+#define NBUILTIN_ORIG ((int)(sizeof(builtin_orig)/sizeof(Name))-1)
+#define NBUILTIN_NEW ((int)(sizeof(builtin_new)/sizeof(Name))-1)
+
+static unsigned int
+builtinhash(utf32* name, unsigned int seed)
 {
-    Name* function;
-    utf32 binname[8192];
-    int count;
+    unsigned int hash = seed;
+    for(;*name != NUL32;name++) {
+        hash ^= (unsigned int)*name;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+#define builtinslot(hash,disp) \
+    ((((hash) >> 8) + (disp)[(hash) & (BUILTINDISPSIZE-1)]) & (BUILTINHASHSIZE-1))
+
+/* Map a builtin index to its static record; NULL if out of range */
+static Name*
+builtinName(int index)
+{
+    if(index < 0) return NULL;
+    if(index < NBUILTIN_ORIG) return &builtin_orig[index];
+    index -= NBUILTIN_ORIG;
+    if(index < NBUILTIN_NEW) return &builtin_new[index];
+    return NULL;
+}
+
+/* Return the index of the builtin with this name, or -1 */
+static int
+builtinIndex(utf32* name)
+{
+    unsigned int hash = builtinhash(name,BUILTINSEED);
+    int index = (int)builtin_slots[builtinslot(hash,builtin_disp)] - 1;
+    if(index < 0 || strcmp32(name,builtinName(index)->entry.name) != 0)
+        return -1;
+    return index;
+}
 
-    count = toString32(binname,bin->name,strlen(bin->name));
-    binname[count] = NUL32;
-    /* Make sure we did not define builtin twice */
-    function = dictionaryLookup(ttm,binname);
-    assert(function == NULL);
-    /* create a new function object */
-    function = newName(ttm);
-    function->builtin = 1;
-    function->minargs = bin->minargs;
-    function->maxargs = bin->maxargs;
-    if(strcmp(bin->sv,"S")==0)
-        function->novalue = 1;
-    function->fcn = bin->fcn;
-    /* Convert name to utf32 */
-    function->entry.name = strdup32(binname);
-    if(!dictionaryInsert(ttm,function))
-	fatal(ttm,"Dictionary insertion failed");
+/* Return the static builtin with this name unless the
+   user has since redefined or erased that name. */
+static Name*
+builtinLookup(TTM* ttm, utf32* name)
+{
+    int index = builtinIndex(name);
+    if(index < 0 || ttm->shadow[index]) return NULL;
+    return builtinName(index);
 }
 
+#ifdef DEBUG
+/* Verify that the generated tables match the builtin tables */
 static void
-defineBuiltinFunctions(TTM* ttm)
+checkBuiltins(void)
 {
-    struct Builtin* bin;
-    for(bin=builtin_orig;bin->name != NULL;bin++)
-        defineBuiltinFunction1(ttm,bin);
-    for(bin=builtin_new;bin->name != NULL;bin++)
-        defineBuiltinFunction1(ttm,bin);
+    int i;
+    Name* bin;
+    for(i=0;(bin=builtinName(i)) != NULL;i++)
+        assert(builtinIndex(bin->entry.name) == i);
+    assert(i < BUILTINHASHSIZE);
 }
+#endif
+
+#ifdef GENBUILTINS
+/**
+Compute a seed and displacement table such that the
+builtins map to distinct slots and print them as C source.
+*/
+static void
+genbuiltins(void)
+{
+    unsigned int seed;
+    unsigned int hashes[BUILTINHASHSIZE];
+    unsigned char disp[BUILTINDISPSIZE];
+    unsigned char slots[BUILTINHASHSIZE];
+    int sizes[BUILTINDISPSIZE];
+    int nbuiltins,i,j,b,d;
+    Name* bin;
+
+    for(nbuiltins=0;(bin=builtinName(nbuiltins)) != NULL;nbuiltins++);
+    assert(nbuiltins < BUILTINHASHSIZE);
+    for(seed=2166136261U;;seed++) {
+        memset(disp,0,sizeof(disp));
+        memset(slots,0,sizeof(slots));
+        memset(sizes,0,sizeof(sizes));
+        for(i=0;i<nbuiltins;i++) {
+            hashes[i] = builtinhash(builtinName(i)->entry.name,seed);
+            sizes[hashes[i] & (BUILTINDISPSIZE-1)]++;
+        }
+        /* Place the buckets largest first */
+        for(;;) {
+            int largest = -1;
+            for(b=0;b<BUILTINDISPSIZE;b++) {
+                if(sizes[b] > 0 && (largest < 0 || sizes[b] > sizes[largest]))
+                    largest = b;
+            }
+            if(largest < 0) goto done; /* all placed */
+            sizes[largest] = -1;
+            for(d=0;d<256;d++) {
+                disp[largest] = (unsigned char)d;
+                for(i=0;i<nbuiltins;i++) {
+                    if((hashes[i] & (BUILTINDISPSIZE-1)) != (unsigned int)largest)
+                        continue;
+                    j = builtinslot(hashes[i],disp);
+                    if(slots[j] != 0) break;
+                    slots[j] = (unsigned char)(i+1);
+                }
+                if(i == nbuiltins) break; /* bucket placed */
+                /* undo the partial placement and try next displacement */
+                for(j=0;j<BUILTINHASHSIZE;j++) {
+                    if(slots[j] != 0
+                       && (hashes[slots[j]-1] & (BUILTINDISPSIZE-1)) == (unsigned int)largest)
+                        slots[j] = 0;
+                }
+            }
+            if(d == 256) break; /* try another seed */
+        }
+    }
+done:
+    printf("#define BUILTINSEED 0x%08xU\n",seed);
+    printf("static unsigned char builtin_disp[BUILTINDISPSIZE] = {");
+    for(i=0;i<BUILTINDISPSIZE;i++)
+        printf("%s%3u%s",(i%16==0?"\n":""),disp[i],(i<BUILTINDISPSIZE-1?",":""));
+    printf("\n};\n");
+    printf("static unsigned char builtin_slots[BUILTINHASHSIZE] = {");
+    for(i=0;i<BUILTINHASHSIZE;i++)
+        printf("%s%3u%s",(i%16==0?"\n":""),slots[i],(i<BUILTINHASHSIZE-1?",":""));
+    printf("\n};\n");
+}
+#endif /*GENBUILTINS*/
 
 /**************************************************/
 /**
@@ -2990,7 +5362,7 @@ startupcommands(TTM* ttm)
 
     for(cmdp=startup_commands;*cmdp != NULL;cmdp++) {
 	cmd = *cmdp;
-        cmdlen = strlen(cmd);
+        cmdlen = (int)strlen(cmd);
         resetBuffer(ttm,ttm->buffer);
         setBufferLength(ttm,ttm->buffer,cmdlen); /* temp */
         count = toString32(ttm->buffer->content,cmd,cmdlen);     
@@ -3019,46 +5391,1810 @@ lockup(TTM* ttm)
 
 
 /**************************************************/
-/* Error reporting */
+/* Dictionary Snapshots */
+
+/**
+A snapshot (-S) is a dump of the dictionary, the character
+classes and the meta characters as they stand after the -e
+and -p files have been processed. Loading it with -L replaces
+the startup commands and the re-reading of those files.
+
+The file is a sequence of 32-bit words in native byte order:
+    header: magic version sharpc openc semic closec escapec metac
+            crcounter nnames nclasses
+    per name: flags minargs maxargs residual:2 maxsegmark
+              namelen:2 bodylen:2 name[namelen+1] body[bodylen+1]
+    per class: negative namelen:2 charslen:2
+               name[namelen+1] characters[charslen+1]
+Strings are stored NUL terminated so that loadSnapshot
+can use them in place; every field is a word, or for
+the :2 fields a pair of words (low, then high) holding
+a 64-bit length, so the file needs no padding to keep
+them aligned.
+For a builtin, the body holds the name of the static
+builtin whose function it runs, since function
+pointers do not survive from one process to the next.
+A redefined static builtin that has since been erased
+is recorded as a name with the SNAPERASED flag.
+*/
+
+#ifdef MAP_NORESERVE
+#define MAPNORESERVE MAP_NORESERVE
+#else
+#define MAPNORESERVE 0
+#endif
+
+#define SNAPSHOTMAGIC 0x434d5454 /* "TTMC" in little endian order */
+#define SNAPSHOTVERSION 2
+#define SNAPSHOTHEADER 11 /* words */
+
+/* Flags for snapshot name records */
+#define SNAPLOCKED  1
+#define SNAPTRACE   2
+#define SNAPBUILTIN 4
+#define SNAPNOVALUE 8
+#define SNAPERASED  16
 
 static void
-fail(TTM* ttm, ERR eno)
+putword(TTM* ttm, FILE* f, unsigned int w)
 {
-    char msg[4096];
-    snprintf(msg,sizeof(msg),"(%d) %s",eno,errstring(eno));
-    fatal(ttm,msg);
+    if(fwrite(&w,sizeof(w),1,f) != 1) fail(ttm,EIO);
 }
 
+/* Write a length as two words, low then high */
 static void
-fatal(TTM* ttm, const char* msg)
+putsize(TTM* ttm, FILE* f, size_t n)
 {
-    fprintf(stderr,"Fatal error: %s\n",msg);
-    if(ttm != NULL) {
-        /* Dump the frame stack */
-        dumpstack(ttm);
-        /* Dump passive and active strings*/
-        fprintf(stderr,"context: ");
-        /* Since passive is not normally null terminated, we need to fake it */
-        {
-            utf32 save = *ttm->buffer->passive;
-            *ttm->buffer->passive = NUL32;
-            dbgprint32(ttm->buffer->content,'|');
-            *ttm->buffer->passive = save;
+    putword(ttm,f,(unsigned int)(n & 0xFFFFFFFFUL));
+    putword(ttm,f,(unsigned int)((unsigned long long)n >> 32));
+}
+
+static void
+putstring(TTM* ttm, FILE* f, utf32* s, size_t len)
+{
+    utf32 nul = 0;
+    if(len > 0 && fwrite(s,sizeof(utf32),len,f) != len) fail(ttm,EIO);
+    if(fwrite(&nul,sizeof(utf32),1,f) != 1) fail(ttm,EIO);
+}
+
+/* Return the name of the static builtin implemented by fcn */
+static utf32*
+builtinFcnName(TTM* ttm, TTMFCN fcn)
+{
+    int i;
+    Name* bin;
+    for(i=0;(bin=builtinName(i)) != NULL;i++) {
+        if(bin->fcn == fcn) return bin->entry.name;
+    }
+    fatal(ttm,"Snapshot: unknown builtin function");
+    return NULL;
+}
+
+/* Write one name record; also used by the program library */
+static void
+putNameRecord(TTM* ttm, FILE* f, Name* str)
+{
+    utf32* body;
+    size_t bodylen;
+    unsigned int flags = 0;
+    if(str->locked) flags |= SNAPLOCKED;
+    if(str->trace) flags |= SNAPTRACE;
+    if(str->builtin) flags |= SNAPBUILTIN;
+    if(str->novalue) flags |= SNAPNOVALUE;
+    if(str->builtin) {
+        body = builtinFcnName(ttm,str->fcn);
+        bodylen = strlen32(body);
+    } else if(str->kind < 4) {
+        body = (utf32*)holdScratch(ttm,SCRATCHMEMORY,unpackBody(ttm,str),0);
+        bodylen = str->length;
+    } else {
+        body = (utf32*)str->body;
+        bodylen = str->length;
+    }
+    putword(ttm,f,flags);
+    putword(ttm,f,str->minargs);
+    putword(ttm,f,str->maxargs);
+    putsize(ttm,f,str->residual);
+    putword(ttm,f,str->maxsegmark);
+    putsize(ttm,f,strlen32(str->entry.name));
+    putsize(ttm,f,bodylen);
+    putstring(ttm,f,str->entry.name,strlen32(str->entry.name));
+    putstring(ttm,f,body,bodylen);
+    if(!str->builtin && str->kind < 4) dropScratch(ttm,body);
+}
+
+static void
+saveSnapshot(TTM* ttm, const char* filename)
+{
+    FILE* f;
+
+    f = fopen(filename,"wb");
+    if(f == NULL) {
+        fprintf(stderr,"Cannot write snapshot file: %s\n",filename);
+        fail(ttm,EIO);
+    }
+    writeSnapshot(ttm,f);
+    if(fclose(f) != 0) fail(ttm,EIO);
+}
+
+/* Write the snapshot records; also used for checkpoints */
+static void
+writeSnapshot(TTM* ttm, FILE* f)
+{
+    int i;
+    unsigned int nnames, nclasses, nerased;
+    struct HashEntry* entry;
+    Name* bin;
+
+    /* Count the records */
+    nnames = 0; nclasses = 0; nerased = 0;
+    for(i=0;i<HASHSIZE;i++) {
+        for(entry=ttm->dictionary.table[i].next;entry!=NULL;entry=entry->next) {
+            if(!((Name*)entry)->tombstone) nnames++;
+        }
+        for(entry=ttm->charclasses.table[i].next;entry!=NULL;entry=entry->next)
+            nclasses++;
+        if(ttm->base == NULL) continue;
+        for(entry=ttm->base->dictionary.table[i].next;entry!=NULL;entry=entry->next) {
+            if(!hiddenName(ttm,(Name*)entry)) nnames++;
+        }
+    }
+    for(i=0;(bin=builtinName(i)) != NULL;i++) {
+        if(ttm->shadow[i] && dictionaryLookup(ttm,bin->entry.name) == NULL)
+            nerased++;
+    }
+    putword(ttm,f,SNAPSHOTMAGIC);
+    putword(ttm,f,SNAPSHOTVERSION);
+    putword(ttm,f,(unsigned int)ttm->sharpc);
+    putword(ttm,f,(unsigned int)ttm->openc);
+    putword(ttm,f,(unsigned int)ttm->semic);
+    putword(ttm,f,(unsigned int)ttm->closec);
+    putword(ttm,f,(unsigned int)ttm->escapec);
+    putword(ttm,f,(unsigned int)ttm->metac);
+    putword(ttm,f,ttm->crcounter);
+    putword(ttm,f,nnames+nerased);
+    putword(ttm,f,nclasses);
+    for(i=0;i<HASHSIZE;i++) {
+        for(entry=ttm->dictionary.table[i].next;entry!=NULL;entry=entry->next) {
+            if(!((Name*)entry)->tombstone) putNameRecord(ttm,f,(Name*)entry);
+        }
+        if(ttm->base == NULL) continue;
+        for(entry=ttm->base->dictionary.table[i].next;entry!=NULL;entry=entry->next) {
+            if(!hiddenName(ttm,(Name*)entry)) putNameRecord(ttm,f,(Name*)entry);
+        }
+    }
+    for(i=0;(bin=builtinName(i)) != NULL;i++) {
+        size_t len;
+        if(!ttm->shadow[i] || dictionaryLookup(ttm,bin->entry.name) != NULL)
+            continue;
+        len = strlen32(bin->entry.name);
+        putword(ttm,f,SNAPERASED);
+        putword(ttm,f,0); putword(ttm,f,0);
+        putsize(ttm,f,0); putword(ttm,f,0);
+        putsize(ttm,f,len);
+        putsize(ttm,f,0);
+        putstring(ttm,f,bin->entry.name,len);
+        putstring(ttm,f,NULL,0);
+    }
+    for(i=0;i<HASHSIZE;i++) {
+        for(entry=ttm->charclasses.table[i].next;entry!=NULL;entry=entry->next) {
+            Charclass* cl = (Charclass*)entry;
+            putword(ttm,f,(unsigned int)cl->negative);
+            putsize(ttm,f,strlen32(cl->entry.name));
+            putsize(ttm,f,strlen32(cl->characters));
+            putstring(ttm,f,cl->entry.name,strlen32(cl->entry.name));
+            putstring(ttm,f,cl->characters,strlen32(cl->characters));
         }
-        fprintf(stderr," ... ");
-        dbgprint32(ttm->buffer->active,'|');
-        fprintf(stderr,"\n");
     }
-    fflush(stderr);
-    exit(1);
 }
 
-static const char*
-errstring(ERR err)
+/* Take a NUL terminated string of len characters
+   from the image, checking that it really is there.
+*/
+/* Take a length written by putsize */
+static size_t
+getsize(TTM* ttm, utf32* w)
 {
-    const char* msg = NULL;
-    switch(err) {
-    case ENOERR: msg="No error"; break;
+    unsigned long long n = ((unsigned long long)(unsigned int)w[1] << 32)
+                           | (unsigned int)w[0];
+    if(n > (size_t)-1) fail(ttm,ESTORAGE); /* too big for this machine */
+    return (size_t)n;
+}
+
+static utf32*
+getstring(TTM* ttm, utf32** wp, utf32* end, size_t len)
+{
+    utf32* s = *wp;
+    if(len >= (size_t)(end - s) || s[len] != NUL32)
+        fail(ttm,ESTORAGE);
+    *wp = s + (len + 1);
+    return s;
+}
+
+/* Fill in str from the name record at *wp, leaving its
+   name and body in place; return the record's flags.
+   For a builtin, the function is bound and body is NULL.
+*/
+static unsigned int
+getNameRecord(TTM* ttm, utf32** wp, utf32* end, Name* str)
+{
+    utf32* w = *wp;
+    unsigned int flags;
+    size_t namelen, bodylen;
+    utf32* body;
+
+    if((end - w) < 10) fail(ttm,ESTORAGE);
+    flags = (unsigned int)w[0];
+    str->minargs = (unsigned int)w[1];
+    str->maxargs = (unsigned int)w[2];
+    str->residual = getsize(ttm,w+3);
+    str->maxsegmark = (unsigned int)w[5];
+    namelen = getsize(ttm,w+6);
+    bodylen = getsize(ttm,w+8);
+    w += 10;
+    str->entry.name = getstring(ttm,&w,end,namelen);
+    body = getstring(ttm,&w,end,bodylen);
+    *wp = w;
+    str->locked = ((flags & SNAPLOCKED) ? 1 : 0);
+    str->trace = ((flags & SNAPTRACE) ? 1 : 0);
+    str->novalue = ((flags & SNAPNOVALUE) ? 1 : 0);
+    if(flags & SNAPBUILTIN) {
+        int index = builtinIndex(body);
+        if(index < 0) fail(ttm,ESTORAGE);
+        str->builtin = 1;
+        str->fcn = builtinName(index)->fcn;
+        str->body = NULL;
+    } else {
+        str->builtin = 0;
+        str->fcn = NULL;
+        str->body = body;
+        str->kind = 4;
+        str->length = bodylen;
+        str->marks = NULL;
+        str->nmarks = 0;
+    }
+    return flags;
+}
+
+/* Map the snapshot file and enter its contents into the
+   dictionary. Names and bodies are used in place; Name.mapped
+   makes any later change to them copy on write.
+   Return the position just past the snapshot records.
+*/
+static utf32*
+loadSnapshot(TTM* ttm, const char* filename)
+{
+    struct Snapshot* snap = &ttm->snapshot;
+    utf32* w;
+    utf32* end;
+    unsigned int i, nnames, nclasses;
+#ifdef MSWINDOWS
+    FILE* f;
+    long size;
+#else
+    int fd;
+    struct stat st;
+#endif
+
+#ifdef MSWINDOWS
+    /* No mmap; read the whole image instead */
+    f = fopen(filename,"rb");
+    if(f == NULL
+       || fseek(f,0,SEEK_END) != 0
+       || (size = ftell(f)) < 0
+       || fseek(f,0,SEEK_SET) != 0) {
+        fprintf(stderr,"Cannot read snapshot file: %s\n",filename);
+        fail(ttm,EIO);
+    }
+    snap->size = (size_t)size;
+    snap->image = malloc(snap->size+1);
+    if(snap->image == NULL) fail(ttm,EMEMORY);
+    if(fread(snap->image,1,snap->size,f) != snap->size) fail(ttm,EIO);
+    fclose(f);
+    snap->mmapped = 0;
+#else
+    fd = open(filename,O_RDONLY);
+    if(fd < 0 || fstat(fd,&st) < 0) {
+        fprintf(stderr,"Cannot read snapshot file: %s\n",filename);
+        fail(ttm,EIO);
+    }
+    snap->size = (size_t)st.st_size;
+    if(snap->size < SNAPSHOTHEADER*sizeof(utf32)) fail(ttm,ESTORAGE);
+    /* Private and writable, so that e.g. #<cr> and #<ss>
+       can modify a body in place; the kernel copies the page.
+       Only such pages need swap, so do not reserve it for
+       the whole image, which may be larger than memory. */
+    snap->image = mmap(NULL,snap->size,PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAPNORESERVE,fd,0);
+    close(fd);
+    if(snap->image == MAP_FAILED) {snap->image = NULL; fail(ttm,EIO);}
+    snap->mmapped = 1;
+#endif
+    w = (utf32*)snap->image;
+    end = w + (snap->size / sizeof(utf32));
+    if(snap->size < SNAPSHOTHEADER*sizeof(utf32)
+       || (unsigned int)w[0] != SNAPSHOTMAGIC
+       || (unsigned int)w[1] != SNAPSHOTVERSION)
+        fail(ttm,ESTORAGE);
+    ttm->sharpc = w[2];
+    ttm->openc = w[3];
+    ttm->semic = w[4];
+    ttm->closec = w[5];
+    ttm->escapec = w[6];
+    ttm->metac = w[7];
+    ttm->crcounter = (unsigned int)w[8];
+    nnames = (unsigned int)w[9];
+    nclasses = (unsigned int)w[10];
+    w += SNAPSHOTHEADER;
+    if(nnames > (size_t)(end - w)) fail(ttm,ESTORAGE);
+    snap->names = (Name*)calloc(nnames+1,sizeof(Name));
+    if(snap->names == NULL) fail(ttm,EMEMORY);
+    for(i=0;i<nnames;i++) {
+        Name* str = &snap->names[i];
+        unsigned int flags = getNameRecord(ttm,&w,end,str);
+        if(flags & SNAPERASED) {
+            int index = builtinIndex(str->entry.name);
+            if(index < 0) fail(ttm,ESTORAGE);
+            ttm->shadow[index] = 1;
+            continue;
+        }
+        str->mapped = MAPPEDNAME|MAPPEDREC;
+        if(!str->builtin)
+            str->mapped |= MAPPEDBODY;
+        if(!dictionaryInsert(ttm,str)) fail(ttm,ESTORAGE);
+    }
+    for(i=0;i<nclasses;i++) {
+        Charclass* cl;
+        unsigned int negative;
+        size_t namelen, charslen;
+        if((end - w) < 5) fail(ttm,ESTORAGE);
+        negative = (unsigned int)w[0];
+        namelen = getsize(ttm,w+1);
+        charslen = getsize(ttm,w+3);
+        w += 5;
+        /* Classes are few and small; just copy them */
+        cl = newCharclass(ttm);
+        cl->negative = (negative ? 1 : 0);
+        cl->entry.name = strdup32(getstring(ttm,&w,end,namelen));
+        cl->characters = strdup32(getstring(ttm,&w,end,charslen));
+        if(!charclassInsert(ttm,cl)) fail(ttm,ESTORAGE);
+    }
+    return w;
+}
+
+static void
+freeSnapshot(TTM* ttm)
+{
+    struct Snapshot* snap = &ttm->snapshot;
+    /* Only called as the ttm itself goes away, so the
+       dictionary no longer needs the arena or the image */
+    if(snap->names != NULL) free(snap->names);
+    snap->names = NULL;
+    if(snap->image == NULL) return;
+#ifndef MSWINDOWS
+    if(snap->mmapped)
+        munmap(snap->image,snap->size);
+    else
+#endif
+        free(snap->image);
+    snap->image = NULL;
+}
+
+/**************************************************/
+/* Checkpoints */
+
+/**
+#<ttm;checkpoint;file> writes the state of the run to a file,
+and ttm -R file carries on from there as if the checkpoint
+call had just returned.  The file is a snapshot, so -L can
+load its dictionary too, followed by these words:
+    CHECKPOINTMAGIC flags exitcode execcount stacksize buffersize:2
+    phase neoptions eoption... pfile ffile nargs arg...
+    source:2 (bytes of the -p file consumed)
+    reader:2 carry nchars:2 chars[nchars+1] (the -f file)
+    cardsahead cardslen:2 card[cardslen+1]
+        cd.sup cd.cols pk.sup pk.cols forsup foreol
+    libfile hasinitials initialslen:2 initials[initialslen+1]
+    ndiversions, per diversion: namelen:2 name[namelen+1] text
+    current sent:2
+    passivelen:2 passive[passivelen+1] activelen:2 active[activelen+1]
+    nframes, per frame: argc active passive:2 argv:2 [argc+1]
+File names, the -e strings still to run, the #<arg> arguments,
+the carry and the diverted text are bytes, written as a
+count:2 followed by the bytes NUL padded to a whole number of
+words.  The frame offsets are from the start of the buffer;
+argv[argc] is where the argument being collected begins.  The
+frame of the checkpoint call itself is left out, and
+resumeCalls() finishes the others.
+The file is written in large blocks under a temporary name and
+then renamed, so a crash while it is being written leaves any
+earlier checkpoint as it was.
+Not saved: #<fopen> handles and the #<include> cache.
+A checkpoint cannot be taken inside a #<try> body.  The
+output written before the checkpoint is flushed to its file;
+the resumed run writes the output from there on.
+*/
+
+#define CHECKPOINTMAGIC 0x4b435454 /* "TTCK" in little endian order */
+#define CHECKPOINTBLOCK (1<<20) /* stdio buffer size */
+
+/* Pad n bytes out to a whole number of words, with at least one NUL */
+static void
+putpad(TTM* ttm, FILE* f, size_t n)
+{
+    static const char pad[sizeof(utf32)] = {0};
+    n = sizeof(utf32) - (n % sizeof(utf32));
+    if(fwrite(pad,1,n,f) != n) fail(ttm,EIO);
+}
+
+static void
+putbytes(TTM* ttm, FILE* f, const void* p, size_t n)
+{
+    putsize(ttm,f,n);
+    if(n > 0 && fwrite(p,1,n,f) != n) fail(ttm,EIO);
+    putpad(ttm,f,n);
+}
+
+/* A NULL string is written as an empty one */
+static void
+putcstring(TTM* ttm, FILE* f, const char* s)
+{
+    putbytes(ttm,f,s,(s == NULL ? 0 : strlen(s)));
+}
+
+static unsigned int
+takeword(TTM* ttm, utf32** wp, utf32* end)
+{
+    if(*wp >= end) fail(ttm,ESTORAGE);
+    return (unsigned int)*(*wp)++;
+}
+
+static size_t
+takesize(TTM* ttm, utf32** wp, utf32* end)
+{
+    size_t n;
+    if(end - *wp < 2) fail(ttm,ESTORAGE);
+    n = getsize(ttm,*wp);
+    *wp += 2;
+    return n;
+}
+
+/* Take bytes written by putbytes, in place */
+static char*
+takebytes(TTM* ttm, utf32** wp, utf32* end, size_t* np)
+{
+    size_t n = takesize(ttm,wp,end);
+    size_t words = n/sizeof(utf32) + 1;
+    char* p = (char*)*wp;
+    if(words > (size_t)(end - *wp)) fail(ttm,ESTORAGE);
+    *wp += words;
+    *np = n;
+    return p;
+}
+
+/* Take a string written by putcstring; an empty one is NULL */
+static char*
+takecstring(TTM* ttm, utf32** wp, utf32* end)
+{
+    size_t n;
+    char* s = takebytes(ttm,wp,end,&n);
+    if(n == 0) return NULL;
+    s = strdup(s);
+    if(s == NULL) fail(ttm,EMEMORY);
+    return s;
+}
+
+static void
+saveCheckpoint(TTM* ttm, const char* filename)
+{
+    Buffer* bb = ttm->buffer;
+    struct Source* src = &ttm->source;
+    struct Reader* rd = &ttm->reader;
+    struct Cards* cards = &ttm->cards;
+    char* tmpname;
+    FILE* f;
+    Diversion* d;
+    struct Block* b;
+    unsigned int i, j, n, current;
+    size_t len;
+
+    /* A #<try> body is being scanned by a C call that cannot
+       be rebuilt from the frames */
+    if(ttm->run.phase == RUN_NONE || ttm->stacknext == 0
+       || ttm->recover.tries > 0)
+        fail(ttm,ECHECKPOINT);
+    /* Hand on the finished text and write out all that is
+       pending, so that the output so far is in its files */
+    deliver(ttm,ttm->stack[0].passive);
+    flushOutput(ttm);
+    fflush(NULL);
+
+    tmpname = (char*)malloc(strlen(filename)+sizeof(".tmp"));
+    if(tmpname == NULL) fail(ttm,EMEMORY);
+    strcpy(tmpname,filename);
+    strcat(tmpname,".tmp");
+    f = fopen(tmpname,"wb");
+    if(f == NULL) {
+        fprintf(stderr,"Cannot write checkpoint file: %s\n",tmpname);
+        free(tmpname);
+        fail(ttm,EIO);
+    }
+    setvbuf(f,NULL,_IOFBF,CHECKPOINTBLOCK);
+    writeSnapshot(ttm,f);
+
+    putword(ttm,f,CHECKPOINTMAGIC);
+    putword(ttm,f,ttm->flags);
+    putword(ttm,f,ttm->exitcode);
+    putword(ttm,f,ttm->limits.execcount);
+    putword(ttm,f,ttm->limits.stacksize);
+    putsize(ttm,f,bb->alloc);
+    /* Where main() is, and what it has still to do */
+    putword(ttm,f,(unsigned int)ttm->run.phase);
+    n = 0;
+    if(ttm->run.phase == RUN_E) {
+        while(ttm->run.rest[n] != NULL) n++;
+    }
+    putword(ttm,f,n);
+    for(i=0;i<n;i++)
+        putcstring(ttm,f,ttm->run.rest[i]);
+    putcstring(ttm,f,ttm->run.pfile);
+    putcstring(ttm,f,ttm->run.ffile);
+    for(n=0;ttm->options.args[n+1] != NULL;n++);
+    putword(ttm,f,n);
+    for(i=0;i<n;i++)
+        putcstring(ttm,f,ttm->options.args[i+1]);
+    /* The input files */
+    putsize(ttm,f,(size_t)(src->offset - (src->count - src->next)));
+    putsize(ttm,f,(size_t)rd->offset);
+    putbytes(ttm,f,rd->carry,rd->ncarry);
+    putsize(ttm,f,rd->count - rd->next);
+    putstring(ttm,f,rd->chars+rd->next,rd->count - rd->next);
+    putword(ttm,f,(unsigned int)cards->ahead);
+    putsize(ttm,f,cards->length);
+    putstring(ttm,f,cards->text,cards->length);
+    putword(ttm,f,(unsigned int)cards->cd.sup);
+    putword(ttm,f,cards->cd.cols);
+    putword(ttm,f,(unsigned int)cards->pk.sup);
+    putword(ttm,f,cards->pk.cols);
+    putword(ttm,f,(unsigned int)cards->forsup);
+    putword(ttm,f,(unsigned int)cards->foreol);
+    putcstring(ttm,f,ttm->library.filename);
+    len = (ttm->library.initials == NULL ? 0 : strlen32(ttm->library.initials));
+    putword(ttm,f,(ttm->library.initials != NULL ? 1 : 0));
+    putsize(ttm,f,len);
+    putstring(ttm,f,ttm->library.initials,len);
+    /* The diversions */
+    for(n=0,current=0,d=ttm->diversions.list;d != NULL;d=d->next) {
+        n++;
+        if(d == ttm->diversions.current) current = n;
+    }
+    putword(ttm,f,n);
+    for(d=ttm->diversions.list;d != NULL;d=d->next) {
+        keepBlock(ttm,d->writer);
+        len = strlen32(d->name);
+        putsize(ttm,f,len);
+        putstring(ttm,f,d->name,len);
+        for(len=0,b=d->first;b != NULL;b=b->next) len += b->length;
+        putsize(ttm,f,len);
+        for(b=d->first;b != NULL;b=b->next) {
+            if(fwrite(b->bytes,1,b->length,f) != b->length) fail(ttm,EIO);
+        }
+        putpad(ttm,f,len);
+    }
+    putword(ttm,f,current);
+    putsize(ttm,f,ttm->diversions.sent);
+    /* The buffer, less the gap, and the calls in progress */
+    len = (size_t)(bb->passive - bb->content);
+    putsize(ttm,f,len);
+    putstring(ttm,f,bb->content,len);
+    len = (size_t)(bb->end - bb->active);
+    putsize(ttm,f,len);
+    putstring(ttm,f,bb->active,len);
+    putword(ttm,f,ttm->stacknext-1);
+    for(i=0;i+1<ttm->stacknext;i++) {
+        Frame* frame = &ttm->stack[i];
+        utf32* arg = frame->passive;
+        putword(ttm,f,frame->argc);
+        putword(ttm,f,(unsigned int)frame->active);
+        putsize(ttm,f,(size_t)(frame->passive - bb->content));
+        for(j=0;j<frame->argc;j++)
+            putsize(ttm,f,(size_t)(frame->argv[j] - bb->content));
+        if(frame->argc > 0) {
+            arg = frame->argv[frame->argc-1];
+            arg += strlen32(arg) + 1;
+        }
+        putsize(ttm,f,(size_t)(arg - bb->content));
+    }
+
+    if(fflush(f) != 0) fail(ttm,EIO);
+#ifndef MSWINDOWS
+    if(fsync(fileno(f)) < 0) fail(ttm,EIO);
+#endif
+    if(fclose(f) != 0) fail(ttm,EIO);
+#ifdef MSWINDOWS
+    remove(filename); /* rename will not replace it */
+#endif
+    if(rename(tmpname,filename) != 0) {
+        fprintf(stderr,"Cannot write checkpoint file: %s\n",filename);
+        free(tmpname);
+        fail(ttm,EIO);
+    }
+    free(tmpname);
+}
+
+/* Restore the state saved by saveCheckpoint; main() then
+   reopens the input files and resumes the scan */
+static void
+restoreCheckpoint(TTM* ttm, const char* filename)
+{
+    struct Reader* rd = &ttm->reader;
+    struct Cards* cards = &ttm->cards;
+    Buffer* bb;
+    utf32* w;
+    utf32* end;
+    utf32* s;
+    char* bytes;
+    size_t len, alen, alloc;
+    unsigned int i, j, n;
+    int given;
+    char** eopts;
+
+    w = loadSnapshot(ttm,filename);
+    end = (utf32*)ttm->snapshot.image + ttm->snapshot.size/sizeof(utf32);
+    if(takeword(ttm,&w,end) != CHECKPOINTMAGIC) fail(ttm,ECHECKPOINT);
+    ttm->flags |= (takeword(ttm,&w,end) & ~FLAG_EMIT);
+    ttm->exitcode = takeword(ttm,&w,end);
+    ttm->limits.execcount = takeword(ttm,&w,end);
+    n = takeword(ttm,&w,end);
+    if(n > ttm->limits.stacksize) {
+        Frame* stack = (Frame*)realloc(ttm->stack,sizeof(Frame)*n);
+        if(stack == NULL) fail(ttm,EMEMORY);
+        ttm->stack = stack;
+        ttm->limits.stacksize = n;
+    }
+    alloc = takesize(ttm,&w,end);
+    if(alloc > ttm->buffer->alloc) {
+        freeBuffer(ttm,ttm->buffer);
+        ttm->buffer = newBuffer(ttm,alloc);
+        freeBuffer(ttm,ttm->result);
+        ttm->result = newBuffer(ttm,alloc);
+        ttm->limits.buffersize = alloc;
+    }
+    ttm->run.phase = (int)takeword(ttm,&w,end);
+    if(ttm->run.phase != RUN_E && ttm->run.phase != RUN_P)
+        fail(ttm,ECHECKPOINT);
+    /* The -e strings still to run replace any given */
+    eopts = ttm->options.e;
+    for(i=0;eopts[i] != NULL;i++) {free(eopts[i]); eopts[i] = NULL;}
+    n = takeword(ttm,&w,end);
+    if(n > MAXEOPTIONS) fail(ttm,ESTORAGE);
+    for(i=0;i<n;i++) {
+        eopts[i] = takecstring(ttm,&w,end);
+        if(eopts[i] == NULL) eopts[i] = strdup("");
+    }
+    ttm->run.rest = eopts;
+    ttm->run.pfile = takecstring(ttm,&w,end);
+    ttm->run.ffile = takecstring(ttm,&w,end);
+    /* The #<arg> arguments, unless others are given */
+    given = (ttm->options.args[1] != NULL);
+    n = takeword(ttm,&w,end);
+    if(n >= MAXARGS) fail(ttm,ESTORAGE);
+    for(i=0;i<n;i++) {
+        char* arg = takecstring(ttm,&w,end);
+        if(given)
+            free(arg);
+        else
+            ttm->options.args[i+1] = (arg == NULL ? strdup("") : arg);
+    }
+    /* Where to pick up the input files */
+    ttm->source.offset = takesize(ttm,&w,end);
+    rd->offset = takesize(ttm,&w,end);
+    bytes = takebytes(ttm,&w,end,&len);
+    if(len > MAXCHARSIZE) fail(ttm,ESTORAGE);
+    memcpy(rd->carry,bytes,len);
+    rd->ncarry = (unsigned int)len;
+    len = takesize(ttm,&w,end);
+    if(len > READBLOCKSIZE) fail(ttm,ESTORAGE);
+    memcpy32(rd->chars,getstring(ttm,&w,end,len),len);
+    rd->next = 0;
+    rd->count = (unsigned int)len;
+    cards->ahead = (int)takeword(ttm,&w,end);
+    len = takesize(ttm,&w,end);
+    s = getstring(ttm,&w,end,len);
+    if(len > 0) {
+        cards->text = (utf32*)malloc((len+1)*sizeof(utf32));
+        if(cards->text == NULL) fail(ttm,EMEMORY);
+        cards->alloc = len+1;
+        memcpy32(cards->text,s,len+1);
+    }
+    cards->length = len;
+    cards->cd.sup = (int)takeword(ttm,&w,end);
+    cards->cd.cols = takeword(ttm,&w,end);
+    cards->pk.sup = (int)takeword(ttm,&w,end);
+    cards->pk.cols = takeword(ttm,&w,end);
+    cards->forsup = (int)takeword(ttm,&w,end);
+    cards->foreol = (int)takeword(ttm,&w,end);
+    ttm->library.filename = takecstring(ttm,&w,end);
+    n = takeword(ttm,&w,end);
+    len = takesize(ttm,&w,end);
+    s = getstring(ttm,&w,end,len);
+    ttm->library.initials = (n ? strdup32(s) : NULL);
+    /* The diversions */
+    n = takeword(ttm,&w,end);
+    for(i=0;i<n;i++) {
+        Diversion* d;
+        len = takesize(ttm,&w,end);
+        d = findDiversion(ttm,getstring(ttm,&w,end,len),1);
+        bytes = takebytes(ttm,&w,end,&len);
+        writeBytes(ttm,d->writer,(char_t*)bytes,len);
+    }
+    n = takeword(ttm,&w,end);
+    if(n > 0) {
+        Diversion* d = ttm->diversions.list;
+        for(i=1;i<n && d != NULL;i++) d = d->next;
+        if(d == NULL) fail(ttm,ESTORAGE);
+        ttm->diversions.current = d;
+    }
+    ttm->diversions.sent = takesize(ttm,&w,end);
+    /* The buffer; the gap between passive and active is dropped */
+    bb = ttm->buffer;
+    len = takesize(ttm,&w,end);
+    if(len >= bb->alloc) fail(ttm,ESTORAGE);
+    memcpy32(bb->content,getstring(ttm,&w,end,len),len);
+    alen = takesize(ttm,&w,end);
+    if(alen >= bb->alloc - len) fail(ttm,ESTORAGE);
+    memcpy32(bb->content+len,getstring(ttm,&w,end,alen),alen);
+    setBufferLength(ttm,bb,len+alen);
+    bb->passive = bb->content + len;
+    bb->active = bb->passive;
+    if(ttm->diversions.sent > len) fail(ttm,ESTORAGE);
+    /* The calls in progress */
+    n = takeword(ttm,&w,end);
+    if(n > ttm->limits.stacksize) fail(ttm,ESTORAGE);
+    for(i=0;i<n;i++) {
+        Frame* frame = &ttm->stack[i];
+        frame->argc = takeword(ttm,&w,end);
+        if(frame->argc > MAXARGS) fail(ttm,ESTORAGE);
+        frame->active = (int)takeword(ttm,&w,end);
+        for(j=0;j<=frame->argc+1;j++) {
+            size_t offset = takesize(ttm,&w,end);
+            if(offset > len) fail(ttm,ESTORAGE);
+            if(j == 0)
+                frame->passive = bb->content + offset;
+            else
+                frame->argv[j-1] = bb->content + offset;
+        }
+    }
+    ttm->stacknext = n;
+}
+
+/* Carry on with the scan that the checkpoint interrupted */
+static void
+resumeScan(TTM* ttm)
+{
+    if(ttm->stacknext > 0) resumeCalls(ttm,0);
+    if(!(ttm->flags & FLAG_EXIT)) scan(ttm);
+}
+
+/**************************************************/
+/* Program Library */
+
+/**
+The library declared by #<libs> is a single file holding
+stored programs, found through a hash index at the front of
+the file so that #<copy> need only read the index slot, the
+records on that slot's chain, and the program itself.
+
+The file is a sequence of 32-bit words in native byte order:
+    header: magic version nbuckets seed
+    index:  nbuckets record offsets (0 => empty)
+    record: next keylen datalen key[keylen+1] data[datalen]
+The data of a record is a count of names followed by that
+many name records, in the same format as a snapshot.
+New records are appended and pushed on the front of their
+chain; #<delete> unlinks a record but does not reclaim its space.
+Keys are hashed to their slot with LIBRARYSEED rather than
+BUILTINSEED, which "make builtins" may change; the seed is kept
+in the header so that a file hashed some other way is refused.
+
+Program names are qualified by the initials given to #<libs>,
+so the key for program "prog" is "initials.prog";
+a program name that already contains a '.' is used as is.
+*/
+
+#define LIBRARYMAGIC 0x4c4d5454 /* "TTML" in little endian order */
+#define LIBRARYVERSION 3 /* name records as in snapshot version 2 */
+#define LIBRARYBUCKETS 1024
+#define LIBRARYSEED 0x811c9dc5U /* the FNV-1a offset basis */
+#define LIBRARYHEADER 4 /* words */
+#define LIBRARYRECORD 3 /* words before the key */
+#define LIBRARYMAXSIZE 0xFFFFFFFFUL /* offsets are 32 bits */
+
+static unsigned int
+libget(TTM* ttm, FILE* f, unsigned long offset)
+{
+    unsigned int w;
+    if(fseek(f,(long)offset,SEEK_SET) != 0
+       || fread(&w,sizeof(w),1,f) != 1)
+        fail(ttm,ESTORAGE);
+    return w;
+}
+
+static void
+libput(TTM* ttm, FILE* f, unsigned long offset, unsigned int w)
+{
+    if(fseek(f,(long)offset,SEEK_SET) != 0) fail(ttm,EIO);
+    putword(ttm,f,w);
+}
+
+/* Return the attached library file, opening
+   (and if need be creating) it on first use */
+static FILE*
+libraryOpen(TTM* ttm)
+{
+    struct Library* lib = &ttm->library;
+    FILE* f;
+    unsigned int i;
+
+    if(lib->file != NULL) return lib->file;
+    if(lib->filename == NULL) fail(ttm,EATTACH);
+    f = fopen(lib->filename,"r+b");
+    if(f == NULL) {
+        /* Create an empty library */
+        f = fopen(lib->filename,"w+b");
+        if(f == NULL) fail(ttm,EATTACH);
+        putword(ttm,f,LIBRARYMAGIC);
+        putword(ttm,f,LIBRARYVERSION);
+        putword(ttm,f,LIBRARYBUCKETS);
+        putword(ttm,f,LIBRARYSEED);
+        for(i=0;i<LIBRARYBUCKETS;i++)
+            putword(ttm,f,0);
+        if(fflush(f) != 0) fail(ttm,EIO);
+    }
+    lib->file = f;
+    if(libget(ttm,f,0) != LIBRARYMAGIC
+       || libget(ttm,f,4) != LIBRARYVERSION
+       || libget(ttm,f,8) != LIBRARYBUCKETS
+       || libget(ttm,f,12) != LIBRARYSEED)
+        fail(ttm,ESTORAGE);
+    return f;
+}
+
+static void
+libraryClose(TTM* ttm)
+{
+    struct Library* lib = &ttm->library;
+    if(lib->file != NULL) fclose(lib->file);
+    lib->file = NULL;
+}
+
+/* Return the library key for a program name; caller frees */
+static utf32*
+libraryKey(TTM* ttm, utf32* prog)
+{
+    utf32* initials = ttm->library.initials;
+    utf32* key;
+    utf32* p;
+    size_t ilen;
+
+    if(strlen32(prog) == 0) fail(ttm,ELIBNAME);
+    for(p=prog;*p;p++) {
+        if(*p == (utf32)'.') return strdup32(prog);
+    }
+    ilen = (initials == NULL ? 0 : strlen32(initials));
+    if(ilen == 0) return strdup32(prog);
+    key = (utf32*)malloc(sizeof(utf32)*(ilen+1+strlen32(prog)+1));
+    if(key == NULL) fail(ttm,EMEMORY);
+    strcpy32(key,initials);
+    key[ilen] = (utf32)'.';
+    strcpy32(key+ilen+1,prog);
+    return key;
+}
+
+/* Read the NUL terminated key of the record at offset; caller frees */
+static utf32*
+libraryRecordKey(TTM* ttm, FILE* f, unsigned long offset)
+{
+    unsigned int keylen = libget(ttm,f,offset+4);
+    utf32* key;
+
+    if(keylen >= LIBRARYMAXSIZE/sizeof(utf32)) fail(ttm,ESTORAGE);
+    key = (utf32*)malloc(sizeof(utf32)*(keylen+1));
+    if(key == NULL) fail(ttm,EMEMORY);
+    if(fseek(f,(long)(offset+LIBRARYRECORD*sizeof(utf32)),SEEK_SET) != 0
+       || fread(key,sizeof(utf32),keylen+1,f) != keylen+1
+       || key[keylen] != NUL32) {
+        free(key);
+        fail(ttm,ESTORAGE);
+    }
+    return key;
+}
+
+/* Search the chain for key. Return the offset of the record, or 0
+   if absent; *linkp is set to the offset of the word that points
+   (or would point) at the record. */
+static unsigned long
+libraryFind(TTM* ttm, FILE* f, utf32* key, unsigned long* linkp)
+{
+    unsigned int bucket = builtinhash(key,LIBRARYSEED) % LIBRARYBUCKETS;
+    unsigned long link = (LIBRARYHEADER+bucket)*sizeof(utf32);
+    unsigned long offset;
+
+    *linkp = link;
+    while((offset = libget(ttm,f,link)) != 0) {
+        utf32* reckey = libraryRecordKey(ttm,f,offset);
+        int match = (strcmp32(key,reckey) == 0);
+        free(reckey);
+        if(match) {*linkp = link; return offset;}
+        link = offset; /* the record's next field */
+    }
+    return 0;
+}
+
+/* Append a program holding the names in the
+   comma separated list to the library */
+static void
+libraryStore(TTM* ttm, utf32* prog, utf32* namelist)
+{
+    FILE* f = libraryOpen(ttm);
+    utf32* key = (utf32*)holdScratch(ttm,SCRATCHMEMORY,libraryKey(ttm,prog),0);
+    utf32* names = (utf32*)holdScratch(ttm,SCRATCHMEMORY,strdup32(namelist),0);
+    unsigned int nnames, next;
+    size_t keylen;
+    unsigned long link, offset, dataoffset;
+    long end;
+    utf32* p;
+    utf32* q;
+
+    if(libraryFind(ttm,f,key,&link) != 0)
+        fail(ttm,EDUPLIBNAME);
+    /* Split the list in place and check that every name exists */
+    nnames = 0;
+    for(p=names;;p=q+1) {
+        for(q=p;*q != NUL32 && *q != (utf32)',';q++);
+        if(q > p) {
+            utf32 c = *q;
+            *q = NUL32;
+            if(dictionaryLookup(ttm,p) == NULL)
+                fail(ttm,ENONAME);
+            *q = c;
+            nnames++;
+        }
+        if(*q == NUL32) break;
+    }
+    next = libget(ttm,f,link);
+    if(fseek(f,0,SEEK_END) != 0 || (end = ftell(f)) < 0) fail(ttm,EIO);
+    offset = (unsigned long)end;
+    keylen = strlen32(key);
+    if(keylen >= LIBRARYMAXSIZE/sizeof(utf32)) fail(ttm,ELIBSPACE);
+    putword(ttm,f,next);
+    putword(ttm,f,(unsigned int)keylen);
+    putword(ttm,f,0); /* datalen; filled in below */
+    putstring(ttm,f,key,keylen);
+    dataoffset = offset + (LIBRARYRECORD+keylen+1)*sizeof(utf32);
+    putword(ttm,f,nnames);
+    for(p=names;;p=q+1) {
+        for(q=p;*q != NUL32 && *q != (utf32)',';q++);
+        if(q > p) {
+            utf32 c = *q;
+            *q = NUL32;
+            putNameRecord(ttm,f,dictionaryLookup(ttm,p));
+            *q = c;
+        }
+        if(*q == NUL32) break;
+    }
+    dropScratch(ttm,names);
+    dropScratch(ttm,key);
+    if((end = ftell(f)) < 0) fail(ttm,EIO);
+    if((unsigned long)end > LIBRARYMAXSIZE)
+        fail(ttm,ELIBSPACE); /* the record was never linked in */
+    libput(ttm,f,offset+2*sizeof(utf32),
+           (unsigned int)(((unsigned long)end - dataoffset)/sizeof(utf32)));
+    /* Only now make the record visible */
+    libput(ttm,f,link,(unsigned int)offset);
+    if(fflush(f) != 0) fail(ttm,EIO);
+}
+
+static void
+libraryDelete(TTM* ttm, utf32* prog)
+{
+    FILE* f = libraryOpen(ttm);
+    utf32* key = (utf32*)holdScratch(ttm,SCRATCHMEMORY,libraryKey(ttm,prog),0);
+    unsigned long link, offset;
+
+    offset = libraryFind(ttm,f,key,&link);
+    dropScratch(ttm,key);
+    if(offset == 0) fail(ttm,ELIBNAME);
+    libput(ttm,f,link,libget(ttm,f,offset));
+    if(fflush(f) != 0) fail(ttm,EIO);
+}
+
+/* Define every name stored in a program, as if by #<ds> */
+static void
+libraryCopy(TTM* ttm, utf32* prog)
+{
+    FILE* f = libraryOpen(ttm);
+    utf32* key = (utf32*)holdScratch(ttm,SCRATCHMEMORY,libraryKey(ttm,prog),0);
+    unsigned long link, offset;
+    unsigned int i, keylen, datalen, nnames;
+    utf32* data;
+    utf32* w;
+    utf32* end;
+
+    offset = libraryFind(ttm,f,key,&link);
+    dropScratch(ttm,key);
+    if(offset == 0) fail(ttm,ELIBNAME);
+    keylen = libget(ttm,f,offset+4);
+    datalen = libget(ttm,f,offset+8);
+    if(datalen == 0 || datalen >= LIBRARYMAXSIZE/sizeof(utf32))
+        fail(ttm,ESTORAGE);
+    data = (utf32*)holdScratch(ttm,SCRATCHMEMORY,malloc(sizeof(utf32)*datalen),0);
+    if(fseek(f,(long)(offset+(LIBRARYRECORD+keylen+1)*sizeof(utf32)),SEEK_SET) != 0
+       || fread(data,sizeof(utf32),datalen,f) != datalen)
+        fail(ttm,ESTORAGE);
+    w = data;
+    end = data + datalen;
+    nnames = (unsigned int)*w++;
+    for(i=0;i<nnames;i++) {
+        Name rec;
+        Name* str;
+        memset((void*)&rec,0,sizeof(rec));
+        getNameRecord(ttm,&w,end,&rec);
+        str = dictionaryLookup(ttm,rec.entry.name);
+        if(str == NULL) {
+            str = newName(ttm);
+            str->entry.name = strdup32(rec.entry.name);
+            dictionaryInsert(ttm,str);
+        } else {
+            str = privateName(ttm,str);
+            freeBody(ttm,str);
+        }
+        str->locked = rec.locked;
+        str->trace = rec.trace;
+        str->builtin = rec.builtin;
+        str->novalue = rec.novalue;
+        str->minargs = rec.minargs;
+        str->maxargs = rec.maxargs;
+        str->residual = rec.residual;
+        str->maxsegmark = rec.maxsegmark;
+        str->fcn = rec.fcn;
+        if(!rec.builtin && rec.body != NULL)
+            setBody(ttm,str,(utf32*)rec.body,rec.length);
+    }
+    dropScratch(ttm,data);
+}
+
+/* Print the names of the programs stored under the given
+   initials (the declared initials if NULL), separated by commas */
+static void
+libraryShow(TTM* ttm, utf32* initials)
+{
+    FILE* f = libraryOpen(ttm);
+    struct Writer* w = writerFor(ttm,stdout);
+    utf32 comma = (utf32)',';
+    utf32 newline = (utf32)'\n';
+    unsigned int bucket, count;
+    size_t ilen;
+    unsigned long offset;
+
+    if(initials == NULL) initials = ttm->library.initials;
+    ilen = (initials == NULL ? 0 : strlen32(initials));
+    count = 0;
+    for(bucket=0;bucket<LIBRARYBUCKETS;bucket++) {
+        offset = libget(ttm,f,(LIBRARYHEADER+bucket)*sizeof(utf32));
+        for(;offset != 0;offset = libget(ttm,f,offset)) {
+            utf32* key = (utf32*)holdScratch(ttm,SCRATCHMEMORY,
+                                             libraryRecordKey(ttm,f,offset),0);
+            utf32* prog = key;
+            utf32* p;
+            /* Match the qualifier against the initials */
+            for(p=key;*p && *p != (utf32)'.';p++);
+            if(*p == NUL32 ? ilen == 0
+                : ((size_t)(p - key) == ilen
+                   && strncmp32(key,initials,ilen) == 0)) {
+                if(*p != NUL32) prog = p+1;
+                if(count++ > 0) writeChars(ttm,w,&comma,1);
+                writeChars(ttm,w,prog,strlen32(prog));
+            }
+            dropScratch(ttm,key);
+        }
+    }
+    if(count > 0) writeChars(ttm,w,&newline,1);
+}
+
+/**************************************************/
+/* Include Files */
+
+/**
+#<include> looks a relative file name up in each -I directory
+in turn (just the current directory if there were none).
+Files are decoded once and cached, keyed by their canonical
+path; an entry is used for as long as the file's modification
+time and size are unchanged, and the least recently used
+files are dropped to keep the cache within INCLUDECACHESIZE
+characters.  exec() copies a cached file
+straight into the buffer (see TTM.value), so a hit costs two
+system calls and one copy.  #<ttm;info;include> reports the
+hit and miss counts.
+*/
+
+#define INCLUDECACHESIZE (1<<24) /* characters */
+
+static void
+freeIncluded(TTM* ttm, struct Included* f)
+{
+    ttm->includes.chars -= f->length;
+    free(f->path);
+    free(f->text);
+    free(f);
+}
+
+static void
+freeIncludes(TTM* ttm)
+{
+    struct Included* f;
+    while((f = ttm->includes.files) != NULL) {
+        ttm->includes.files = f->next;
+        freeIncluded(ttm,f);
+    }
+}
+
+/* Drop the least recently used file from the cache */
+static void
+evictIncluded(TTM* ttm)
+{
+    struct Included** prev = &ttm->includes.files;
+    while((*prev)->next != NULL) prev = &(*prev)->next;
+    freeIncluded(ttm,*prev);
+    *prev = NULL;
+}
+
+/* Whether name could reach outside the directory it is looked
+   up in: it is absolute, has a drive letter, or goes up through
+   a ".." component (separated by either '/' or '\\') */
+static int
+outsidePath(const char* name)
+{
+    const char* p;
+    const char* end;
+
+    if(name[0] == '/' || name[0] == '\\'
+       || (name[0] != NUL && name[1] == ':'))
+        return 1;
+    for(p=name;;p=end+1) {
+        for(end=p;*end != NUL && *end != '/' && *end != '\\';end++);
+        if(end - p == 2 && p[0] == '.' && p[1] == '.') return 1;
+        if(*end == NUL) break;
+    }
+    return 0;
+}
+
+/**
+Open name in the first -I directory that has it,
+leaving its full name in path.
+*/
+static FILE*
+openInclude(TTM* ttm, const char* name, char* path, size_t pathsize)
+{
+    static char* dot[2] = {".",NULL};
+    char** dirs = (ttm->options.include[0] == NULL ? dot : ttm->options.include);
+    FILE* file = NULL;
+    int i;
+
+    if(outsidePath(name))
+        fail(ttm,EINCLUDE); /* must be relative, and stay inside */
+    for(i=0;dirs[i] != NULL;i++) {
+        if(strlen(dirs[i]) + strlen(name) + 2 > pathsize) continue;
+        strcpy(path,dirs[i]);
+        strcat(path,"/");
+        strcat(path,name);
+        if((file = fopen(path,"r")) != NULL) break;
+    }
+    if(file == NULL) fail(ttm,EINCLUDE);
+    return file;
+}
+
+static void
+includeFile(TTM* ttm, const char* name)
+{
+    struct Includes* inc = &ttm->includes;
+    char path[8192];
+    FILE* file;
+#ifndef MSWINDOWS
+    struct Included* f;
+    struct Included** prev;
+    struct stat st;
+    char* canon;
+    Buffer* bb;
+    utf32* text;
+#endif
+
+    file = (FILE*)holdScratch(ttm,SCRATCHFILE,openInclude(ttm,name,path,sizeof(path)),0);
+#ifndef MSWINDOWS
+    if(fstat(fileno(file),&st) == 0 && S_ISREG(st.st_mode)
+       && (canon = realpath(path,NULL)) != NULL) {
+        holdScratch(ttm,SCRATCHMEMORY,canon,0);
+        for(prev=&inc->files;(f = *prev) != NULL;prev=&f->next) {
+            if(strcmp(f->path,canon) == 0) break;
+        }
+        if(f != NULL) {
+            *prev = f->next; /* unlink; relinked at the front below */
+            if(f->mtime != st.st_mtime || f->size != (long)st.st_size) {
+                freeIncluded(ttm,f); /* stale */
+                f = NULL;
+            }
+        }
+        if(f != NULL) {
+            inc->hits++;
+            dropScratch(ttm,canon);
+            dropScratch(ttm,file);
+        } else if(compressedFile(file) || st.st_size <= INCLUDECACHESIZE) {
+            inc->misses++;
+            /* Each byte yields at most one character, unless the
+               file is compressed; then its text must fit the buffer */
+            if(compressedFile(file))
+                bb = newBuffer(ttm,ttm->limits.buffersize);
+            else
+                bb = newBuffer(ttm,(size_t)st.st_size+1);
+            holdScratch(ttm,SCRATCHBUFFER,bb,0);
+            readfile(ttm,file,bb);
+            dropScratch(ttm,file);
+            if(bb->length > INCLUDECACHESIZE) {
+                /* Too big to cache; hand the text on as is */
+                dropScratch(ttm,canon);
+                setBufferLength(ttm,ttm->result,bb->length);
+                memcpy(ttm->result->content,bb->content,bb->length*sizeof(utf32));
+                dropScratch(ttm,bb);
+                return;
+            }
+            /* Make room by dropping the least recently used files */
+            while(inc->chars + bb->length > INCLUDECACHESIZE)
+                evictIncluded(ttm);
+            text = (utf32*)realloc(bb->content,(bb->length+1)*sizeof(utf32));
+            if(text == NULL) fail(ttm,EMEMORY);
+            bb->content = text;
+            f = (struct Included*)calloc(1,sizeof(struct Included));
+            if(f == NULL) fail(ttm,EMEMORY);
+            keepScratch(ttm,canon);
+            keepScratch(ttm,bb);
+            f->path = canon;
+            f->mtime = st.st_mtime;
+            f->size = (long)st.st_size;
+            f->text = text;
+            f->length = bb->length;
+            free(bb);
+            inc->chars += f->length;
+        } else
+            dropScratch(ttm,canon);
+        if(f != NULL) {
+            f->next = inc->files;
+            inc->files = f;
+            ttm->value.text = f->text;
+            ttm->value.length = f->length;
+            return;
+        }
+    }
+#endif
+    /* Not cachable; read it into the result as is */
+    inc->misses++;
+    readfile(ttm,file,ttm->result);
+    dropScratch(ttm,file);
+}
+
+/**
+Read a whole file, found as for #<include>, into a new
+string for #<load>.  A regular file is sized up front and
+decoded straight into the string (see readfile); anything
+else, including a compressed file, may be no longer than
+the buffer.
+*/
+static utf32*
+loadFile(TTM* ttm, const char* name)
+{
+    char path[8192];
+    FILE* file;
+    size_t size = ttm->limits.buffersize;
+    Buffer* bb;
+    utf32* text;
+#ifndef MSWINDOWS
+    struct stat st;
+#endif
+
+    file = (FILE*)holdScratch(ttm,SCRATCHFILE,openInclude(ttm,name,path,sizeof(path)),0);
+#ifndef MSWINDOWS
+    if(fstat(fileno(file),&st) == 0 && S_ISREG(st.st_mode)
+       && !compressedFile(file)) {
+        if((unsigned long long)st.st_size >= ((size_t)-1) / sizeof(utf32))
+            fail(ttm,EBUFFERSIZE);
+        size = (size_t)st.st_size;
+    }
+#endif
+    /* Each byte yields at most one character */
+    bb = (Buffer*)holdScratch(ttm,SCRATCHBUFFER,newBuffer(ttm,size+1),0);
+    readfile(ttm,file,bb);
+    dropScratch(ttm,file);
+    text = (utf32*)realloc(bb->content,(bb->length+1)*sizeof(utf32));
+    if(text == NULL) fail(ttm,EMEMORY);
+    keepScratch(ttm,bb);
+    free(bb);
+    return text;
+}
+
+/**************************************************/
+/* Compressed Files */
+
+/**
+Files read through -p, -f, #<include>, #<load> and #<fopen>
+are decompressed on the fly when they start with the gzip or
+zstd magic number, and the -o file, and files written through
+#<fopen>, are compressed when their names end in .gz or .zst.
+A Codec sits where fread() or fwrite() would otherwise be, so
+the decompressed bytes go straight to the utf-8 decoder (or
+to the passthrough of refill()) with no extra copy, and -Xp
+does the (de)compression in the I/O thread.  A pipe cannot
+be checked for a magic number, so only files that can seek
+are looked at.  Support for each format is compiled in by
+HAVE_ZLIB and HAVE_ZSTD; without it, such a file is an error.
+*/
+
+struct Codec {
+    int kind; /* CODEC_GZIP or CODEC_ZSTD */
+    int writing;
+    FILE* file;
+#ifdef HAVE_ZLIB
+    gzFile gz;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream* dstream;
+    ZSTD_CStream* cstream;
+    unsigned char* buf; /* compressed bytes */
+    size_t bufsize;
+    ZSTD_inBuffer in; /* reading: the undecompressed part of buf */
+    size_t pending; /* reading: != 0 => in the middle of a frame */
+#endif
+};
+
+/* Return the kind of compression from the magic number of f, if
+   it can be looked at without losing anything; 0 => none */
+static int
+compressedFile(FILE* f)
+{
+    unsigned char magic[4];
+    size_t n;
+    long pos = ftell(f);
+
+    if(pos < 0) return 0; /* cannot seek back */
+    n = fread(magic,1,sizeof(magic),f);
+    if(fseek(f,pos,SEEK_SET) != 0) return 0;
+    if(n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return CODEC_GZIP;
+    if(n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5
+       && magic[2] == 0x2f && magic[3] == 0xfd)
+        return CODEC_ZSTD;
+    return 0;
+}
+
+/* Return the kind of compression wanted for a file by its name */
+static int
+compressedName(const char* name)
+{
+    size_t len = strlen(name);
+    if(len > 3 && strcmp(name+len-3,".gz") == 0)
+        return CODEC_GZIP;
+    if(len > 4 && strcmp(name+len-4,".zst") == 0)
+        return CODEC_ZSTD;
+    return 0;
+}
+
+/* Whether this build can read and write the kind of compression */
+static int
+haveCodec(int kind)
+{
+    switch (kind) {
+#ifdef HAVE_ZLIB
+    case CODEC_GZIP: return 1;
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: return 1;
+#endif
+    default: break;
+    }
+    return 0;
+}
+
+static Codec*
+openCodec(TTM* ttm, FILE* f, int kind, int writing)
+{
+    Codec* z = (Codec*)holdScratch(ttm,SCRATCHMEMORY,calloc(1,sizeof(Codec)),0);
+    z->kind = kind;
+    z->writing = writing;
+    z->file = f;
+    switch (kind) {
+#ifdef HAVE_ZLIB
+    case CODEC_GZIP: {
+        /* zlib does its own I/O on a duplicate of the descriptor,
+           which must first be moved to where the stream stands;
+           stdio may have read ahead of that (see compressedFile) */
+        long pos;
+        int fd;
+        fflush(f);
+        pos = ftell(f);
+        fd = dup(fileno(f));
+        if(fd < 0) fail(ttm,ECODEC);
+        if(pos > 0 && lseek(fd,(off_t)pos,SEEK_SET) < 0) {close(fd); fail(ttm,ECODEC);}
+        z->gz = gzdopen(fd,(writing ? "wb" : "rb"));
+        if(z->gz == NULL) {close(fd); fail(ttm,ECODEC);}
+        gzbuffer(z->gz,READBLOCKSIZE);
+        } break;
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        if(writing) {
+            z->bufsize = ZSTD_CStreamOutSize();
+            z->cstream = ZSTD_createCStream();
+            if(z->cstream == NULL) fail(ttm,EMEMORY);
+        } else {
+            z->bufsize = ZSTD_DStreamInSize();
+            z->dstream = ZSTD_createDStream();
+            if(z->dstream == NULL) fail(ttm,EMEMORY);
+            ZSTD_initDStream(z->dstream);
+        }
+        z->buf = (unsigned char*)malloc(z->bufsize);
+        if(z->buf == NULL) fail(ttm,EMEMORY);
+        z->in.src = z->buf;
+        break;
+#endif
+    default:
+        fail(ttm,ECODEC); /* not supported by this build */
+    }
+    keepScratch(ttm,z);
+    return z;
+}
+
+/* Read up to n decompressed bytes; return 0 at the end, -1 on
+   error.  This is also called from the reader thread, so it
+   must not fail(). */
+static long
+readCodec(Codec* z, unsigned char* dst, size_t n)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_outBuffer out;
+    size_t got;
+#endif
+    switch (z->kind) {
+#ifdef HAVE_ZLIB
+    case CODEC_GZIP: {
+        int errnum;
+        int got = gzread(z->gz,dst,(unsigned int)n);
+        /* zlib reports a truncated file only through gzerror */
+        if(got == 0) {
+            gzerror(z->gz,&errnum);
+            if(errnum != Z_OK) return -1;
+        }
+        return (long)got;
+        }
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        out.dst = dst;
+        out.size = n;
+        out.pos = 0;
+        while(out.pos == 0) {
+            if(z->in.pos == z->in.size) {
+                got = fread(z->buf,1,z->bufsize,z->file);
+                if(ferror(z->file)) return -1;
+                if(got == 0)
+                    return (z->pending != 0 ? -1 : 0); /* truncated? */
+                z->in.size = got;
+                z->in.pos = 0;
+            }
+            z->pending = ZSTD_decompressStream(z->dstream,&out,&z->in);
+            if(ZSTD_isError(z->pending)) return -1;
+        }
+        return (long)out.pos;
+#endif
+    default: break;
+    }
+    return -1;
+}
+
+/* Compress and write len bytes; return -1 on error.
+   This is also called from the writer thread. */
+static int
+writeCodec(Codec* z, char_t* p, size_t len)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t r;
+#endif
+    switch (z->kind) {
+#ifdef HAVE_ZLIB
+    case CODEC_GZIP:
+        if(len == 0) return 0;
+        return (gzwrite(z->gz,p,(unsigned int)len) == (int)len ? 0 : -1);
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        in.src = p;
+        in.size = len;
+        in.pos = 0;
+        do {
+            out.dst = z->buf;
+            out.size = z->bufsize;
+            out.pos = 0;
+            r = ZSTD_compressStream2(z->cstream,&out,&in,
+                                     (p == NULL ? ZSTD_e_end : ZSTD_e_continue));
+            if(ZSTD_isError(r)) return -1;
+            if(fwrite(z->buf,1,out.pos,z->file) != out.pos) return -1;
+        } while(in.pos < in.size || (p == NULL && r != 0));
+        return 0;
+#endif
+    default: break;
+    }
+    return -1;
+}
+
+/* Finish any compressed output and free z; return -1 on error */
+static int
+closeCodec(Codec* z)
+{
+    int err = 0;
+    switch (z->kind) {
+#ifdef HAVE_ZLIB
+    case CODEC_GZIP:
+        if(gzclose(z->gz) != Z_OK) err = -1;
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        if(z->writing) {
+            err = writeCodec(z,NULL,0); /* NULL => end the frame */
+            if(fflush(z->file) != 0) err = -1;
+            ZSTD_freeCStream(z->cstream);
+        } else
+            ZSTD_freeDStream(z->dstream);
+        free(z->buf);
+        break;
+#endif
+    default: break;
+    }
+    free(z);
+    return err;
+}
+
+/* Read up to n bytes of f, through z if it is compressed;
+   return 0 at the end, -1 on error.  This must not fail(). */
+static long
+readBytes(FILE* f, Codec* z, unsigned char* dst, size_t n)
+{
+    size_t count;
+    if(z != NULL) return readCodec(z,dst,n);
+    count = fread(dst,1,n,f);
+    if(ferror(f)) return -1;
+    return (long)count;
+}
+
+/* As readBytes(), but fail on an error */
+static size_t
+readBlock(TTM* ttm, FILE* f, Codec* z, unsigned char* dst, size_t n)
+{
+    long count = readBytes(f,z,dst,n);
+    if(count < 0) fail(ttm,(z != NULL ? ECODEC : EIO));
+    return (size_t)count;
+}
+
+/* Open a codec for f if it is compressed; for reading */
+static Codec*
+readerCodec(TTM* ttm, FILE* f)
+{
+    int kind = compressedFile(f);
+    return (kind == 0 ? NULL : openCodec(ttm,f,kind,0));
+}
+
+/**************************************************/
+/* File Handles */
+
+/**
+#<fopen> names an open file by a string of the user's
+choosing.  Files are read in blocks of READBLOCKSIZE
+bytes; #<readln> finds the end of a line with memchr()
+and decodes the line straight into the result.  Writing
+goes through a writer of its own (see the Output section),
+so each handle is written a block at a time.
+Files read are found as for #<include>; files written
+must have relative names.
+*/
+
+static struct Handle*
+findHandle(TTM* ttm, utf32* name)
+{
+    int i;
+    for(i=0;i<MAXHANDLES;i++) {
+        if(ttm->handles[i].name != NULL
+           && strcmp32(ttm->handles[i].name,name) == 0)
+            return &ttm->handles[i];
+    }
+    fail(ttm,EHANDLE);
+    return NULL;
+}
+
+/* Read the next block, keeping any partial character;
+   return the # of bytes read */
+static size_t
+fillHandle(TTM* ttm, struct Handle* h)
+{
+    size_t carry = h->count - h->next;
+    size_t nbytes;
+
+    memmove(h->bytes,h->bytes+h->next,carry);
+    h->next = 0;
+    h->count = carry;
+    nbytes = readBlock(ttm,h->file,h->codec,h->bytes+carry,READBLOCKSIZE);
+    if(nbytes == 0 && carry > 0) fail(ttm,EEOS);
+    h->count += nbytes;
+    return nbytes;
+}
+
+static void
+closeHandle(TTM* ttm, struct Handle* h)
+{
+    FILE* file = h->file;
+    int err = 0;
+
+    if(h->writing) {
+        flushWriter(ttm,&h->writer);
+        free(h->writer.bytes);
+    }
+    if(h->writer.codec != NULL && closeCodec(h->writer.codec) < 0) err = -1;
+    if(h->codec != NULL) closeCodec(h->codec);
+    if(h->bytes != NULL) free(h->bytes);
+    free(h->name);
+    memset((void*)h,0,sizeof(struct Handle));
+    if(file != NULL && fclose(file) != 0) err = -1;
+    if(err != 0) fail(ttm,EIO);
+}
+
+static void
+closeHandles(TTM* ttm)
+{
+    int i;
+    for(i=0;i<MAXHANDLES;i++) {
+        if(ttm->handles[i].name != NULL)
+            closeHandle(ttm,&ttm->handles[i]);
+    }
+}
+
+/**************************************************/
+/* Error reporting */
+
+static void
+fail(TTM* ttm, ERR eno)
+{
+    char msg[4096];
+    if(ttm != NULL) ttm->recover.err = eno;
+    snprintf(msg,sizeof(msg),"(%d) %s",eno,errstring(eno));
+    fatal(ttm,msg);
+}
+
+static void
+fatal(TTM* ttm, const char* msg)
+{
+    if(ttm != NULL && ttm->recover.jump != NULL) {
+        /* Hand the error back to the library caller */
+        if(ttm->recover.err == ENOERR) ttm->recover.err = EOTHER;
+        snprintf(ttm->recover.msg,sizeof(ttm->recover.msg),"%s",msg);
+        longjmp(*ttm->recover.jump,1);
+    }
+    if(ttm != NULL) flushOutput(ttm);
+    fprintf(stderr,"Fatal error: %s\n",msg);
+    if(ttm != NULL && ttm->buffer != NULL) { /* else still in newTTM */
+        /* Dump the frame stack */
+        dumpstack(ttm);
+        /* Dump passive and active strings*/
+        fprintf(stderr,"context: ");
+        /* Since passive is not normally null terminated, we need to fake it */
+        {
+            utf32 save = *ttm->buffer->passive;
+            *ttm->buffer->passive = NUL32;
+            dbgprint32(ttm->buffer->content,'|');
+            *ttm->buffer->passive = save;
+        }
+        fprintf(stderr," ... ");
+        dbgprint32(ttm->buffer->active,'|');
+        fprintf(stderr,"\n");
+    }
+    fflush(stderr);
+    exit(1);
+}
+
+/**
+A builtin that takes storage, or opens a file, for its own use
+and may fail before it is done with it holds it as scratch:
+holdScratch() records it in TTM.recover.scratch, dropScratch()
+frees it once the builtin has finished with it, and keepScratch()
+lets go of it when it has been handed on to something that
+outlives the builtin.  When #<try> or ttm_eval() catches an
+error, releaseScratch() frees whatever was held since it began,
+so that the failed builtin leaks nothing.  A NULL ptr is taken
+to be an allocation that failed.
+*/
+static void*
+holdScratch(TTM* ttm, int kind, void* ptr, size_t size)
+{
+    struct Scratch s;
+
+    if(ptr == NULL) fail(ttm,EMEMORY);
+    s.kind = kind;
+    s.ptr = ptr;
+    s.size = size;
+    if(ttm->recover.nscratch == MAXSCRATCH) {
+        freeScratch(ttm,&s);
+        fail(ttm,EMEMORY);
+    }
+    ttm->recover.scratch[ttm->recover.nscratch++] = s;
+    return ptr;
+}
+
+static void
+freeScratch(TTM* ttm, struct Scratch* s)
+{
+    switch (s->kind) {
+    case SCRATCHFILE: fclose((FILE*)s->ptr); break;
+    case SCRATCHCODEC: (void)closeCodec((Codec*)s->ptr); break;
+    case SCRATCHBUFFER: freeBuffer(ttm,(Buffer*)s->ptr); break;
+#ifndef MSWINDOWS
+    case SCRATCHMAP: munmap(s->ptr,s->size); break;
+#endif
+    default: free(s->ptr); break;
+    }
+}
+
+/* Stop holding ptr; the most recent holding is looked for first */
+static int
+unholdScratch(TTM* ttm, void* ptr, struct Scratch* s)
+{
+    unsigned int i = ttm->recover.nscratch;
+
+    while(i-- > 0) {
+        if(ttm->recover.scratch[i].ptr != ptr) continue;
+        *s = ttm->recover.scratch[i];
+        ttm->recover.nscratch--;
+        memmove((void*)&ttm->recover.scratch[i],(void*)&ttm->recover.scratch[i+1],
+                (ttm->recover.nscratch-i)*sizeof(struct Scratch));
+        return 1;
+    }
+    return 0;
+}
+
+static void
+dropScratch(TTM* ttm, void* ptr)
+{
+    struct Scratch s;
+    if(unholdScratch(ttm,ptr,&s)) freeScratch(ttm,&s);
+}
+
+static void
+keepScratch(TTM* ttm, void* ptr)
+{
+    struct Scratch s;
+    (void)unholdScratch(ttm,ptr,&s);
+}
+
+/* Free all that was held after the first mark entries */
+static void
+releaseScratch(TTM* ttm, unsigned int mark)
+{
+    while(ttm->recover.nscratch > mark)
+        freeScratch(ttm,&ttm->recover.scratch[--ttm->recover.nscratch]);
+}
+
+static const char*
+errstring(ERR err)
+{
+    const char* msg = NULL;
+    switch(err) {
+    case ENOERR: msg="No error"; break;
     case ENONAME: msg="Dictionary Name or Character Class Name Not Found"; break;
     case ENOPRIM: msg="Primitives Not Allowed"; break;
     case EFEWPARMS: msg="Too Few Parameters Given"; break;
@@ -3070,18 +7206,16 @@ errstring(ERR err)
     case EMEMORY: msg="Dynamic Storage Overflow"; break;
     case EPARMROLL: msg="Parm Roll Overflow"; break;
     case EINPUTROLL: msg="Input Roll Overflow"; break;
-#ifdef IMPLEMENTED
     case EDUPLIBNAME: msg="Name Already On Library"; break;
     case ELIBNAME: msg="Name Not On Library"; break;
     case ELIBSPACE: msg="No Space On Library"; break;
     case EINITIALS: msg="Initials Not Allowed"; break;
     case EATTACH: msg="Could Not Attach"; break;
-#endif
     case EIO: msg="An I/O Error Occurred"; break;
 #ifdef IMPLEMENTED
     case ETTM: msg="A TTM Processing Error Occurred"; break;
-    case ESTORAGE: msg="Error In Storage Format"; break;
 #endif
+    case ESTORAGE: msg="Error In Storage Format"; break;
     case ENOTNEGATIVE: msg="Only unsigned decimal integers"; break;
     /* messages new to this implementation */
     case ESTACKOVERFLOW: msg="Stack overflow"; break;
@@ -3098,483 +7232,1466 @@ errstring(ERR err)
     case ETTMCMD: msg="Illegal #<ttm> command"; break;
     case ETIME: msg="Gettimeofday() failed"; break;
     case EEXECCOUNT: msg="too many executions"; break;
+    case ETHREAD: msg="Cannot start an I/O thread"; break;
+    case EHANDLE: msg="Unknown, busy or misused file handle"; break;
+    case EOPEN: msg="Cannot open file"; break;
+    case ECODEC: msg="Cannot read or write a compressed file"; break;
+    case ECHECKPOINT: msg="Cannot take or resume a checkpoint"; break;
     case EOTHER: msg="Unknown Error"; break;
     }
-    return msg;
+    return msg;
+}
+
+/**************************************************/
+/* Debug utility functions */
+
+#ifdef DEBUG
+
+static void
+dumpnames(TTM* ttm)
+{
+    int i;
+    for(i=0;i<HASHSIZE;i++) {
+	struct HashEntry* entry = ttm->dictionary.table[i].next;
+	fprintf(stderr,"[%3d]",i);
+        while(entry != NULL) {
+	    fprintf(stderr," ");	
+	    dbgprint32(entry->name,'|');
+            entry = entry->next;
+        }
+	fprintf(stderr,"\n");	
+    }
+}
+
+static void
+dumpframe(TTM* ttm, Frame* frame)
+{
+    traceframe(ttm,frame,1);
+    fprintf(stderr,"\n");
+}
+
+#endif
+
+/**************************************************/
+/* Utility functions */
+
+
+/**
+Convert a long long to a utf32 string
+*/
+
+static int
+int2string(utf32* dst, long long n)
+{
+    char result[MAXINTCHARS+1];
+    int count;
+
+    snprintf(result,sizeof(result),"%lld",n);
+    count = toString32(dst,result,TOEOS);
+    return count;
+}
+
+/**
+Convert a string to a signed Long
+Use this regular expression:
+      [ \t]*[+-]?[0-9]+[MmKk]?[ \t]*
+    | [ \t]*0[Xx][0-9a-fA-F]+[ \t]*
+In the first case, the value must be in the inclusive range:
+    -9223372036854775807..9223372036854775807
+Note that this excludes the smallest possible value:
+    -9223372036854775808
+so that we do can detect overflow.
+In the second case, the value must be in the range:
+    0..18446744073709551615
+but the value will be treated as unsigned when returned; this
+allows one to create any arbitrary 8 byte bit pattern.
+
+Return ENOERR if conversion succeeded, err if failed.
+
+*/
+
+static ERR
+toInt64(utf32* s, long long* lp)
+{
+    utf32* p = s;
+    utf32 c;
+    int negative = 1;
+    /* skip white space */
+    while((c=*p++)) {if(c != ' ' && c != '\t') break;}
+    if(c == NUL) return EDECIMAL; /* nothing but white space or just a sign*/
+    if(c == '-') {negative = -1; c=*p++;} else if(c == '+') {c=*p++;}
+    if(c == NUL) return EDECIMAL; /* just a +|- */
+    if(c == '0' && (*p == 'x' || *p == 'X')) { /* hex case */
+        unsigned long ul = 0;
+        int i;
+        for(i=0;i<16;i++) {/* allow no more than 16 hex digits */
+            c=*p++;
+            if(!ishex(c)) break;
+            ul = (ul<<8) | fromhex(c);
+        }
+        if(i==0)
+            return EDECIMAL; /* it was just "0x" */
+        if(i == 16) /* too big */
+            return EMANYDIGITS;
+        if(lp) {*lp = *(long long*)&ul;} /* return as signed value */
+        return ENOERR;
+    } else if(c >= '0' && c <= '9') { /* decimal */
+        unsigned long long ul;
+        ul = (c - '0');
+        while((c=*p++)) {
+            int digit;
+            if(c < '0' || c > '9') break;
+            digit = (c-'0');
+            ul = (ul * 10) + digit;
+            if((ul & 0x8000000000000000ULL) != 0) {
+                /* Sign bit was set => overflow */
+                return EMANYDIGITS;
+            }
+        }      
+        if(lp) {
+            /* convert back to signed */
+            long long l;
+            l = *(long long*)&ul;
+            l *= negative;
+            *lp = l;
+        }
+        return ENOERR;
+    } /* else illegal */
+    return EDECIMAL;
+}
+
+/* Given a char, return its escaped value.
+Zero indicates it should be elided
+*/
+static utf32
+convertEscapeChar(utf32 c)
+{
+    /* de-escape and store */
+    switch (c) {
+    case 'r': c = '\r'; break;
+    case 'n': c = '\n'; break;
+    case 't': c = '\t'; break;
+    case 'b': c = '\b'; break;
+    case 'f': c = '\f'; break;
+    case '\n': c = 0; break; /* escaped eol is elided */
+    default: break; /* no change */
+    }
+    return c;
+}
+
+static void
+traceframe(TTM* ttm, Frame* frame, int traceargs)
+{
+    char tag[4];
+    unsigned int i = 0;
+
+    if(frame->argc == 0) {
+	fprintf(stderr,"#<empty frame>");
+	return;
+    }
+    tag[i++] = (char)ttm->sharpc;
+    if(!frame->active)
+        tag[i++] = (char)ttm->sharpc;
+    tag[i++] = (char)ttm->openc;
+    tag[i] = NUL;
+    fprintf(stderr,"%s",tag);
+    dbgprint32(frame->argv[0],NUL);
+    if(traceargs) {
+        for(i=1;i<frame->argc;i++) {
+            fputc32(ttm->semic,stderr);
+            dbgprint32(frame->argv[i],NUL);
+        }
+    }
+    fputc32(ttm->closec,stderr);
+    fflush(stderr);
+}
+
+static void
+trace1(TTM* ttm, int depth, int entering, int tracing)
+{
+    Frame* frame;
+
+    /* keep the trace in order with pending stdout output */
+    flushWriter(ttm,&ttm->writers[WSTDOUT]);
+    if(tracing && ttm->stacknext == 0) {
+        fprintf(stderr,"trace: no frame to trace\n");
+        return;
+    }   
+    frame = &ttm->stack[depth];
+    fprintf(stderr,"[%02d] ",depth);
+    if(tracing)
+        fprintf(stderr,"%s: ",(entering?"begin":"end"));
+    traceframe(ttm,frame,entering);
+    /* Dump the contents of result if !entering */
+    if(!entering) {
+        fprintf(stderr," => ");
+        dbgprint32(ttm->result->content,'"');
+    } 
+    fprintf(stderr,"\n");
+}
+
+/**
+Trace a top frame in the frame stack.
+*/
+static void
+trace(TTM* ttm, int entering, int tracing)
+{
+    trace1(ttm, ttm->stacknext-1, entering, tracing);
+}
+
+
+/**************************************************/
+/* Debug Support */
+/**
+ump the stack
+*/
+static void
+dumpstack(TTM* ttm)
+{
+    unsigned int i;
+    /* innermost frame first */
+    for(i=ttm->stacknext;i-- > 0;)
+        trace1(ttm,i,1,!TRACING);
+    fflush(stderr);
+}
+
+static void
+dbgprint32c(utf32 c, char quote)
+{
+    if(ismark(c)) {
+        char_t* p;
+        char info[16+1];
+        if(iscreate(c))
+            strcpy(info,"^00");
+        else /* segmark */
+            snprintf(info,sizeof(info),"^%02d",(int)(c & 0xFF));
+        for(p=info;*p;p++) fputc(*p,stderr);
+    } else if(iscontrol(c)) {
+        fputc32('\\',stderr);
+        switch (c) {
+        case '\r': fputc('r',stderr); break;
+        case '\n': fputc('n',stderr); break;
+        case '\t': fputc('t',stderr); break;
+        case '\b': fputc('b',stderr); break;
+        case '\f': fputc('f',stderr); break;
+        default: {
+            /* dump as a decimal character */
+            char digits[4];
+            snprintf(digits,sizeof(digits),"%d",(int)c);
+            fprintf(stderr,"%s",digits);
+            } break;
+        }
+    } else {
+        if(c == quote) fputc('\\',stderr);
+        fputc32(c,stderr);
+    }
+}
+
+static void
+dbgprint32(utf32* s, char quote)
+{
+    utf32 c;
+    if(quote != NUL)
+        fputc(quote,stderr);
+    while((c=*s++)) {
+	dbgprint32c(c,quote);
+    }
+    if(quote != NUL)
+        fputc(quote,stderr);
+    fflush(stderr);
 }
 
 /**************************************************/
-/* Debug utility functions */
+/* Main() Support functions */
 
-#ifdef DEBUG
+static int
+getOptionNameLength(char** list)
+{
+    unsigned int i;
+    char** p;
+    for(i=0,p=list;*p;i++,p++);
+    return i;
+}
 
-static void
-dumpnames(TTM* ttm)
+static int
+pushOptionName(char* option, unsigned int max, char** list)
 {
-    int i;
-    for(i=0;i<HASHSIZE;i++) {
-	struct HashEntry* entry = ttm->dictionary.table[i].next;
-	fprintf(stderr,"[%3d]",i);
-        while(entry != NULL) {
-	    fprintf(stderr," ");	
-	    dbgprint32(entry->name,'|');
-            entry = entry->next;
+    unsigned int i;
+    for(i=0;i<max;i++) {
+        if(list[i] == NULL) {
+            list[i] = (char*)malloc(strlen(option)+1);
+            strcpy(list[i],option);
+            return 1;
         }
-	fprintf(stderr,"\n");	
     }
+    return 0;
 }
 
 static void
-dumpframe(TTM* ttm, Frame* frame)
+usage(const char* msg)
 {
-    traceframe(ttm,frame,1);
-    fprintf(stderr,"\n");
+    if(msg != NULL)
+        fprintf(stderr,"%s\n",msg);
+	fprintf(stderr,"%s\n",
+"usage: ttm "
+"[-d string]"
+"[-e string]"
+"[-p programfile]"
+"[-f inputfile]"
+"[-I directory]"
+"[-o file]"
+"[-S snapshotfile]"
+"[-L snapshotfile]"
+"[-R checkpointfile]"
+"[-i]"
+"[-j threads]"
+"[-V]"
+"[-q]"
+"[-X tag=value]"
+"[--serve socketpath]"
+"[--]"
+"[arg...]"
+"[--batch file...]");
+    fprintf(stderr,"\tOptions may be repeated\n");
+    if(msg != NULL) exit(1); else exit(0);
+}
+
+/**
+Open the -p file as the streaming source of ttm->buffer;
+scan() pulls it in with refill() as it goes, so the whole
+program never needs to be in memory at once.
+*/
+static void
+readinput(TTM* ttm, const char* filename,Buffer* bb)
+{
+    openinput(ttm,filename,0);
+    /* Escapes need no preprocessing here: an escape and
+       the character it escapes are both kept as is, and
+       scan() interprets them. */
+    /* Keep any output the -e strings left in the buffer */
+    bb->active = bb->passive;
+    setBufferLength(ttm,bb,(bb->passive - bb->content));
 }
 
+/* Open the -p file for refill(), skipping its first skip bytes,
+   which a resumed checkpoint has already scanned */
+static void
+openinput(TTM* ttm, const char* filename, unsigned long long skip)
+{
+    struct Source* src = &ttm->source;
+
+    if(strcmp(filename,"-") == 0) {
+        /* Read from stdinput */
+        src->file = stdin;      
+    } else {
+        src->file = fopen(filename,"r");
+        if(src->file == NULL) {
+            fprintf(stderr,"Cannot read file: %s\n",filename);
+            exit(1);
+        }
+        if(compressedFile(src->file) && !haveCodec(compressedFile(src->file))) {
+            fprintf(stderr,"Cannot decompress file: %s\n",filename);
+            exit(1);
+        }
+    }
+    src->eof = 0;
+    src->next = 0;
+    src->count = 0;
+    src->codec = readerCodec(ttm,src->file);
+    skipBytes(ttm,src->file,src->codec,skip);
+    src->offset = skip;
+#ifdef HAVE_PTHREADS
+    if(ttm->limits.pipeslots > 0)
+        startReaderPipe(ttm,src);
 #endif
+}
 
-/**************************************************/
-/* Utility functions */
+/* Skip the first n bytes of an input file: seek past them
+   if it is a plain file, else read and discard them */
+static void
+skipBytes(TTM* ttm, FILE* f, Codec* z, unsigned long long n)
+{
+    unsigned char block[READBLOCKSIZE];
+    size_t count;
+
+    if(n == 0) return;
+    if(z == NULL && n <= LONG_MAX && fseek(f,(long)n,SEEK_SET) == 0)
+        return;
+    while(n > 0) {
+        count = readBlock(ttm,f,z,block,
+                          (n < READBLOCKSIZE ? (size_t)n : READBLOCKSIZE));
+        if(count == 0) fail(ttm,ECHECKPOINT); /* the file is too short */
+        n -= count;
+    }
+}
 
+static void
+closeinput(TTM* ttm)
+{
+    struct Source* src = &ttm->source;
+#ifdef HAVE_PTHREADS
+    if(src->pipe != NULL)
+        stopReaderPipe(ttm,src);
+#endif
+    if(src->codec != NULL) closeCodec(src->codec);
+    src->codec = NULL;
+    if(src->file != NULL && src->file != stdin)
+        fclose(src->file);
+    src->file = NULL;
+}
 
 /**
-Convert a long long to a utf32 string
+At top level nothing between bb->passive and bb->active
+will be looked at again; slide the unscanned text down
+over that gap.
 */
+static void
+compact(TTM* ttm, Buffer* bb)
+{
+    size_t pending = (size_t)(bb->end - bb->active);
+    memmove((void*)bb->passive,(void*)bb->active,pending*sizeof(utf32));
+    bb->active = bb->passive;
+    setBufferLength(ttm,bb,(size_t)(bb->active - bb->content) + pending);
+}
 
+/**
+Append the next chunk of the -p file to bb.
+At top level the consumed gap is reclaimed first;
+inside a call the frames point into the buffer, so the
+chunk can only go into the space past bb->end.
+If passthrough is set, scan() is between tokens at top level;
+then, when output is being emitted and everything in the buffer
+has been scanned, call-free text (no NUL, escape, sharp or
+open character) is written straight through to the output
+without being decoded, and only a small window past it is
+decoded for scan() to look at.
+Return 0 if there is no more input.
+*/
 static int
-int2string(utf32* dst, long long n)
+refill(TTM* ttm, Buffer* bb, int passthrough)
 {
-    char result[MAXINTCHARS+1];
-    int count;
+    struct Source* src = &ttm->source;
+    size_t avail, room, limit, nbytes, used, span, count32;
 
-    snprintf(result,sizeof(result),"%lld",n);
-    count = toString32(dst,result,TOEOS);
-    return count;
+    if(src->file == NULL) return 0;
+    if(ttm->stacknext == 0 && bb->passive < bb->active)
+        compact(ttm,bb);
+    for(;;) {
+        avail = src->count - src->next;
+        if(avail < MAXCHARSIZE && !src->eof) {
+            memmove(src->bytes,src->bytes+src->next,avail);
+            src->next = 0;
+#ifdef HAVE_PTHREADS
+            if(src->pipe != NULL)
+                nbytes = pipeRead(ttm,src->pipe,src->bytes+avail);
+            else
+#endif
+            nbytes = readBlock(ttm,src->file,src->codec,
+                               src->bytes+avail,READBLOCKSIZE);
+            if(nbytes == 0) src->eof = 1;
+            src->offset += nbytes;
+            avail += nbytes;
+            src->count = avail;
+        }
+        if(avail == 0) return 0;
+        /* Each byte yields at most one character, so decoding
+           no more bytes than there is room for means every
+           complete character fits */
+        room = bb->alloc - bb->length - 1;
+        if(room < MAXCHARSIZE) fail(ttm,EBUFFERSIZE);
+        limit = (avail < room ? avail : room);
+        if(passthrough && (ttm->flags & FLAG_EMIT)
+           && ttm->stacknext == 0 && bb->active == bb->end && ttm->sharpc < 0x80
+           && ttm->openc < 0x80 && ttm->escapec < 0x80) {
+            span = span8(ttm,src->bytes+src->next,avail,
+                         ttm->sharpc,ttm->openc,ttm->escapec);
+            if(span > 0) {
+                emit(ttm,bb,0); /* keep the output in order */
+                writeBytes(ttm,outputWriter(ttm),
+                           (char_t*)src->bytes+src->next,span);
+                src->next += span;
+                continue;
+            }
+            if(limit > PASSWINDOW) limit = PASSWINDOW;
+        }
+        count32 = decode8(ttm,src->bytes+src->next,limit,bb->end,room,&used);
+        src->next += used;
+        if(count32 > 0) break;
+        /* else only part of a character is left */
+        if(src->eof) fail(ttm,EEOS); /* truncated last character */
+    }
+    setBufferLength(ttm,bb,bb->length + count32);
+    return 1;
 }
 
 /**
-Convert a string to a signed Long
-Use this regular expression:
-      [ \t]*[+-]?[0-9]+[MmKk]?[ \t]*
-    | [ \t]*0[Xx][0-9a-fA-F]+[ \t]*
-In the first case, the value must be in the inclusive range:
-    -9223372036854775807..9223372036854775807
-Note that this excludes the smallest possible value:
-    -9223372036854775808
-so that we do can detect overflow.
-In the second case, the value must be in the range:
-    0..18446744073709551615
-but the value will be treated as unsigned when returned; this
-allows one to create any arbitrary 8 byte bit pattern.
+At top level, everything before bb->passive is final output
+that will never be looked at again.  With FLAG_EMIT set, write
+it out once there are at least atleast characters of it and
+slide the unscanned text down to the start of the buffer.
+*/
+static void
+emit(TTM* ttm, Buffer* bb, unsigned int atleast)
+{
+    if(!(ttm->flags & FLAG_EMIT) || ttm->stacknext > 0) return;
+    if(bb->passive == bb->content
+       || (size_t)(bb->passive - bb->content) < atleast) return;
+    deliver(ttm,bb->passive);
+    bb->passive = bb->content;
+    ttm->diversions.sent = 0;
+    compact(ttm,bb);
+}
 
-Return ENOERR if conversion succeeded, err if failed.
+/**
+Called when a scan reaches a NUL; return 1 if more of the
+-p file was appended, 0 if this is the true end of the
+buffer (or an embedded NUL).  See refill() for passthrough.
+*/
+static int
+moreinput(TTM* ttm, Buffer* bb, int passthrough)
+{
+    if(bb->active < bb->end) return 0;
+    return refill(ttm,bb,passthrough);
+}
 
+/**
+Make sure that the n characters starting at bb->active
+are in the buffer, or that the input has run out.
 */
+static void
+lookahead(TTM* ttm, Buffer* bb, unsigned int n)
+{
+    while((size_t)(bb->end - bb->active) < n && refill(ttm,bb,0));
+}
 
-static ERR
-toInt64(utf32* s, long long* lp)
+/**
+Read from input until the
+read characters form a 
+balanced string with respect
+to the current open/close characters.
+Read past the final balancing character
+to the next end of line.
+Return 0 if the read was terminated
+by EOF. 1 otherwise.
+*/
+
+static int
+readbalanced(TTM* ttm)
 {
-    utf32* p = s;
-    utf32 c;
-    int negative = 1;
-    /* skip white space */
-    while((c=*p++)) {if(c != ' ' && c != '\t') break;}
-    if(c == NUL) return EDECIMAL; /* nothing but white space or just a sign*/
-    if(c == '-') {negative = -1; c=*p++;} else if(c == '+') {c=*p++;}
-    if(c == NUL) return EDECIMAL; /* just a +|- */
-    if(c == '0' && (*p == 'x' || *p == 'X')) { /* hex case */
-        unsigned long ul = 0;
-        int i;
-        for(i=0;i<16;i++) {/* allow no more than 16 hex digits */
-            c=*p++;
-            if(!ishex(c)) break;
-            ul = (ul<<8) | fromhex(c);
+    Buffer* bb;
+    utf32* content;
+    utf32 c32;
+    unsigned int depth;
+    size_t i,buffersize;
+
+    flushOutput(ttm);
+    bb = ttm->buffer;
+    resetBuffer(ttm,bb);
+    buffersize = bb->alloc;
+    content = bb->content;
+
+    /* Read character by character until EOF; take escapes and open/close
+       into account; keep outer <...> */
+    for(depth=0,i=0;i<buffersize-1;i++) {
+        c32 = fgetc32(stdin);
+        if(c32 == EOF) break;
+        if(c32 == ttm->escapec) {
+            *content++ = c32;
+            c32 = fgetc32(stdin);
         }
-        if(i==0)
-            return EDECIMAL; /* it was just "0x" */
-        if(i == 16) /* too big */
-            return EMANYDIGITS;
-        if(lp) {*lp = *(long long*)&ul;} /* return as signed value */
-        return ENOERR;
-    } else if(c >= '0' && c <= '9') { /* decimal */
-        unsigned long long ul;
-        ul = (c - '0');
-        while((c=*p++)) {
-            int digit;
-            if(c < '0' || c > '9') break;
-            digit = (c-'0');
-            ul = (ul * 10) + digit;
-            if((ul & 0x8000000000000000ULL) != 0) {
-                /* Sign bit was set => overflow */
-                return EMANYDIGITS;
-            }
-        }      
-        if(lp) {
-            /* convert back to signed */
-            long long l;
-            l = *(long long*)&ul;
-            l *= negative;
-            *lp = l;
+        *content++ = c32;
+        if(c32 == ttm->openc) {
+            depth++;
+        } else if(c32 == ttm->closec) {
+            depth--;
+            if(depth == 0) break;
+        }
+    }
+    /* skip to end of line */
+    while(c32 != EOF && c32 != '\n') {c32 = fgetc32(stdin);}
+    setBufferLength(ttm,bb,i);
+    return (i == 0 && c32 == EOF ? 0 : 1);
+}
+
+static void
+printbuffer(TTM* ttm)
+{
+    utf32* start = ttm->buffer->content + ttm->diversions.sent;
+    deliver(ttm,start+strlen32(start));
+    ttm->diversions.sent = 0;
+}
+
+/**
+Read all of a file into bb, replacing its contents.
+A regular file is mapped and decoded in one pass;
+anything else, including a compressed file,
+is read and decoded a block at a time.
+Return the number of characters read.
+*/
+static size_t
+readfile(TTM* ttm, FILE* file, Buffer* bb)
+{
+    unsigned char block[READBLOCKSIZE+MAXCHARSIZE];
+    size_t avail = bb->alloc - 1; /* leave room for the NUL */
+    size_t count32 = 0;
+    size_t nbytes, used, carry;
+    Codec* z = readerCodec(ttm,file);
+#ifndef MSWINDOWS
+    struct stat st;
+    int fd = fileno(file);
+#endif
+
+    if(z != NULL) holdScratch(ttm,SCRATCHCODEC,z,0);
+#ifndef MSWINDOWS
+    if(z == NULL && fstat(fd,&st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+       && ftell(file) == 0) {
+        size_t size = (size_t)st.st_size;
+        void* image = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+        if(image != MAP_FAILED) {
+            holdScratch(ttm,SCRATCHMAP,image,size);
+            count32 = decode8(ttm,(unsigned char*)image,size,
+                              bb->content,avail,&used);
+            dropScratch(ttm,image);
+            if(used < size) fail(ttm,EEOS); /* truncated last character */
+            setBufferLength(ttm,bb,count32);
+            return count32;
+        } /* else fall back to reading */
+    }
+#endif
+    carry = 0;
+    for(;;) {
+        nbytes = readBlock(ttm,file,z,block+carry,READBLOCKSIZE);
+        nbytes += carry;
+        if(nbytes == 0) break;
+        count32 += decode8(ttm,block,nbytes,bb->content+count32,
+                           avail-count32,&used);
+        carry = nbytes - used;
+        if(nbytes == carry) { /* nothing more was read */
+            if(carry > 0) fail(ttm,EEOS);
+            break;
         }
-        return ENOERR;
-    } /* else illegal */
-    return EDECIMAL;
+        memmove(block,block+used,carry);
+    }
+    if(z != NULL) {
+        keepScratch(ttm,z);
+        if(closeCodec(z) < 0) fail(ttm,ECODEC);
+    }
+    setBufferLength(ttm,bb,count32);
+    return count32;
 }
 
-/* Given a char, return its escaped value.
-Zero indicates it should be elided
+/**
+Return the next character from the -f file,
+decoding it a block at a time;
+stdin is read a character at a time so that
+interactive input is seen as it is typed.
 */
 static utf32
-convertEscapeChar(utf32 c)
+readc32(TTM* ttm)
 {
-    /* de-escape and store */
-    switch (c) {
-    case 'r': c = '\r'; break;
-    case 'n': c = '\n'; break;
-    case 't': c = '\t'; break;
-    case 'b': c = '\b'; break;
-    case 'f': c = '\f'; break;
-    case '\n': c = 0; break; /* escaped eol is elided */
-    default: break; /* no change */
+    struct Reader* rd = &ttm->reader;
+
+    if(ttm->isstdin) {
+        flushOutput(ttm); /* e.g. the prompt of #<psr> */
+        return fgetc32(ttm->input);
     }
-    return c;
+    if(rd->next >= rd->count && !fillReader(ttm))
+        return EOF;
+    return rd->chars[rd->next++];
 }
 
-static void
-traceframe(TTM* ttm, Frame* frame, int traceargs)
+/* Decode the next block of the -f file; return 0 at its end */
+static int
+fillReader(TTM* ttm)
+{
+    struct Reader* rd = &ttm->reader;
+    unsigned char block[READBLOCKSIZE+MAXCHARSIZE];
+    size_t nbytes, used;
+
+    if(ttm->input == NULL) return 0; /* see ttm_create() */
+    while(rd->next >= rd->count) {
+        memcpy(block,rd->carry,rd->ncarry);
+        nbytes = readBlock(ttm,ttm->input,rd->codec,
+                           block+rd->ncarry,READBLOCKSIZE);
+        if(nbytes == 0) {
+            if(rd->ncarry > 0) fail(ttm,EEOS);
+            return 0;
+        }
+        rd->offset += nbytes;
+        nbytes += rd->ncarry;
+        rd->next = 0;
+        rd->count = (unsigned int)decode8(ttm,block,nbytes,rd->chars,
+                                          READBLOCKSIZE,&used);
+        rd->ncarry = (unsigned int)(nbytes - used);
+        memcpy(rd->carry,block+used,rd->ncarry);
+    }
+    return 1;
+}
+
+/**
+The batch functions #<cd>, #<pk> and #<for> treat each line
+of the -f file as a card.  A card is read by finding the
+newline in the decoded block of the reader and copying the
+run before it, so there is no per character call; #<pk>
+leaves the card in TTM.cards for the next #<cd> or #<for>.
+Read the next card into TTM.cards unless it is there
+already; return 0 if the input has run out.
+*/
+static int
+readCard(TTM* ttm)
 {
-    char tag[4];
-    unsigned int i = 0;
+    struct Cards* cards = &ttm->cards;
+    struct Reader* rd = &ttm->reader;
+    utf32* p;
+    utf32* q;
+    utf32* end;
+    utf32 c;
 
-    if(frame->argc == 0) {
-	fprintf(stderr,"#<empty frame>");
-	return;
-    }
-    tag[i++] = (char)ttm->sharpc;
-    if(!frame->active)
-        tag[i++] = (char)ttm->sharpc;
-    tag[i++] = (char)ttm->openc;
-    tag[i] = NUL;
-    fprintf(stderr,"%s",tag);
-    dbgprint32(frame->argv[0],NUL);
-    if(traceargs) {
-        for(i=1;i<frame->argc;i++) {
-            fputc32(ttm->semic,stderr);
-            dbgprint32(frame->argv[i],NUL);
+    if(cards->ahead) return 1;
+    cards->length = 0;
+    for(;;) {
+        if(ttm->isstdin) {
+            c = readc32(ttm);
+            if(c == EOF) break;
+            if(c == '\n') {cards->ahead = 1; break;}
+            appendCard(ttm,&c,1);
+            continue;
         }
+        if(rd->next >= rd->count && !fillReader(ttm)) break;
+        p = rd->chars + rd->next;
+        end = rd->chars + rd->count;
+        for(q=p;q < end && *q != '\n';q++);
+        appendCard(ttm,p,(size_t)(q - p));
+        rd->next = (unsigned int)(q - rd->chars);
+        if(q < end) {rd->next++; cards->ahead = 1; break;}
     }
-    fputc32(ttm->closec,stderr);
-    fflush(stderr);
+    if(cards->length > 0) cards->ahead = 1; /* no final newline */
+    return cards->ahead;
 }
 
 static void
-trace1(TTM* ttm, int depth, int entering, int tracing)
+appendCard(TTM* ttm, utf32* s, size_t len)
 {
-    Frame* frame;
+    struct Cards* cards = &ttm->cards;
 
-    if(tracing && ttm->stacknext == 0) {
-        fprintf(stderr,"trace: no frame to trace\n");
-        return;
-    }   
-    frame = &ttm->stack[depth];
-    fprintf(stderr,"[%02d] ",depth);
-    if(tracing)
-        fprintf(stderr,"%s: ",(entering?"begin":"end"));
-    traceframe(ttm,frame,entering);
-    /* Dump the contents of result if !entering */
-    if(!entering) {
-        fprintf(stderr," => ");
-        dbgprint32(ttm->result->content,'"');
-    } 
-    fprintf(stderr,"\n");
+    if(cards->length + len + 1 > cards->alloc) {
+        size_t alloc = 2*(cards->length + len + 1);
+        if(alloc < CARDCOLUMNS+1) alloc = CARDCOLUMNS+1;
+        cards->text = (utf32*)realloc(cards->text,alloc*sizeof(utf32));
+        if(cards->text == NULL) fail(ttm,EMEMORY);
+        cards->alloc = alloc;
+    }
+    memcpy32(cards->text+cards->length,s,len);
+    cards->length += len;
 }
 
-/**
-Trace a top frame in the frame stack.
-*/
-static void
-trace(TTM* ttm, int entering, int tracing)
+/* Return the length of columns from+1 through cols of the card,
+   less any trailing blanks if sup is set */
+static unsigned int
+cardLength(TTM* ttm, unsigned int from, unsigned int cols, int sup)
 {
-    trace1(ttm, ttm->stacknext-1, entering, tracing);
+    struct Cards* cards = &ttm->cards;
+    unsigned int last = (cards->length < cols ? (unsigned int)cards->length : cols);
+
+    if(sup) {
+        while(last > from && cards->text[last-1] == ' ') last--;
+    }
+    return (last > from ? last - from : 0);
+}
+
+static long
+tagvalue(const char* p)
+{
+    long value;
+    long scale = 1;
+    int c;
+    if(p == NULL || p[0] == NUL)
+        return -1;
+    value = atol(p);
+    c = p[strlen(p)-1];
+    switch (c) {
+    case 0: break;
+    case 'g': case 'G': scale = (1L<<30); break;
+    case 'm': case 'M': scale = (1L<<20); break;
+    case 'k': case 'K': scale = (1L<<10); break;
+    default: break;
+    }
+    if(value < 0 || value > LONG_MAX / scale)
+        return -1; /* would overflow */
+    return value * scale;
 }
 
+static int
+setdebugflags(const char* flagstring)
+{
+    const char* p = flagstring;
+    int c;
+    int flags = 0;
+    if(flagstring == NULL) return flags;
+    while((c=*p++)) {
+	switch (c) {
+	case 't': flags |= FLAG_TRACE;
+	case 'b': flags |= FLAG_BARE;
+	default: break;
+	}
+    }
+    return flags;
+}
 
 /**************************************************/
-/* Debug Support */
+/* Library interface; see ttm.h */
+
 /**
-ump the stack
+An interpreter made by ttm_create() is set up as main() sets one
+up for "ttm -p" without -o: the finished text and the output of
+#<ps> both go through the stdout writer, which ttm_eval() points
+at the caller's sink (and at nosink between evaluations).
+There is no -f file, so #<rs> and #<cd> see the end of input.
+While the library has control, fail() longjmp's back to it
+instead of exiting; ttm_eval() then abandons the evaluation:
+the calls in progress, the text not yet scanned, and any output
+not yet handed to the sink are dropped.  Anything defined
+before the failure is kept.
 */
-static void
-dumpstack(TTM* ttm)
+
+static int
+discardOutput(void* closure, const char* bytes, size_t length)
 {
-    unsigned int i;
-    for(i=1;i<=ttm->stacknext;i++) {
-        Frame* frame;
-        frame = &ttm->stack[ttm->stacknext-i];
-        trace1(ttm,i,1,!TRACING);
+    return 0;
+}
+
+static TTMSink nosink = {discardOutput,NULL};
+
+TTM*
+ttm_create(void)
+{
+    jmp_buf jump;
+    TTM* volatile ttm = (TTM*)calloc(1,sizeof(TTM)); /* used after a longjmp */
+
+    if(ttm == NULL) return NULL;
+    ttm->recover.jump = &jump;
+    if(setjmp(jump) != 0) {
+        ttm->recover.jump = NULL;
+        freeTTM(ttm);
+        return NULL;
     }
-    fflush(stderr);
+    initTTM(ttm,DFALTBUFFERSIZE,DFALTSTACKSIZE,DFALTEXECCOUNT);
+    ttm->output = stdout;
+    ttm->isstdout = 1;
+    ttm->input = NULL;
+    ttm->isstdin = 0;
+    ttm->writers[WSTDOUT].sink = &nosink;
+    startupcommands(ttm);
+    lockup(ttm);
+    ttm->recover.jump = NULL;
+    return ttm;
 }
 
-static void
-dbgprint32c(utf32 c, char quote)
+int
+ttm_eval(TTM* ttm, const char* text, size_t length, TTMSink* sink)
 {
-    if(ismark(c)) {
-        char_t* p;
-        char info[16+1];
-        if(iscreate(c))
-            strcpy(info,"^00");
-        else /* segmark */
-            snprintf(info,sizeof(info),"^%02d",(int)(c & 0xFF));
-        for(p=info;*p;p++) fputc(*p,stderr);
-    } else if(iscontrol(c)) {
-        fputc32('\\',stderr);
-        switch (c) {
-        case '\r': fputc('r',stderr); break;
-        case '\n': fputc('n',stderr); break;
-        case '\t': fputc('t',stderr); break;
-        case '\b': fputc('b',stderr); break;
-        case '\f': fputc('f',stderr); break;
-        default: {
-            /* dump as a decimal character */
-            char digits[4];
-            snprintf(digits,sizeof(digits),"%d",(int)c);
-            fprintf(stderr,"%s",digits);
-            } break;
-        }
+    jmp_buf jump;
+    Buffer* bb = ttm->buffer;
+    size_t count, used;
+
+    ttm->recover.err = ENOERR;
+    ttm->recover.msg[0] = NUL;
+    ttm->writers[WSTDOUT].sink = (sink == NULL ? &nosink : sink);
+    ttm->recover.jump = &jump;
+    if(setjmp(jump) == 0) {
+        ttm->flags &= ~FLAG_EXIT;
+        ttm->limits.execcount = ttm->limits.execlimit;
+        resetBuffer(ttm,bb);
+        bb->passive = bb->content;
+        ttm->diversions.sent = 0;
+        setBufferLength(ttm,bb,length); /* temp */
+        count = decode8(ttm,(unsigned char*)text,length,bb->content,length,&used);
+        if(used < length) fail(ttm,EEOS);
+        setBufferLength(ttm,bb,count);
+        ttm->flags |= FLAG_EMIT;
+        scan(ttm);
+        *bb->passive = NUL32;
+        printbuffer(ttm);
+        flushOutput(ttm);
     } else {
-        if(c == quote) fputc('\\',stderr);
-        fputc32(c,stderr);
+        releaseScratch(ttm,0);
+        ttm->stacknext = 0;
+        ttm->value.text = NULL;
+        resetBuffer(ttm,bb);
+        bb->passive = bb->content;
+        resetBuffer(ttm,ttm->result);
+        ttm->diversions.sent = 0;
+        ttm->writers[WSTDOUT].length = 0;
+    }
+    ttm->flags &= ~FLAG_EMIT;
+    ttm->recover.jump = NULL;
+    ttm->writers[WSTDOUT].sink = &nosink;
+    return (int)ttm->recover.err;
+}
+
+TTM*
+ttm_clone(TTM* ttm)
+{
+    jmp_buf jump;
+    TTM* volatile clone = (TTM*)calloc(1,sizeof(TTM)); /* used after a longjmp */
+
+    if(clone == NULL) return NULL;
+    clone->spill.fd = -1; /* in case ttm fails first */
+    ttm->recover.jump = &jump;
+    clone->recover.jump = &jump;
+    if(setjmp(jump) != 0) {
+        ttm->recover.jump = NULL;
+        clone->recover.jump = NULL;
+        freeTTM(clone);
+        return NULL;
     }
+    freezeDictionary(ttm);
+    cloneTTM(clone,ttm);
+    clone->output = stdout;
+    clone->isstdout = 1;
+    clone->input = NULL;
+    clone->isstdin = 0;
+    clone->writers[WSTDOUT].sink = &nosink;
+    ttm->recover.jump = NULL;
+    clone->recover.jump = NULL;
+    return clone;
 }
 
-static void
-dbgprint32(utf32* s, char quote)
+const char*
+ttm_error(TTM* ttm)
 {
-    utf32 c;
-    if(quote != NUL)
-        fputc(quote,stderr);
-    while((c=*s++)) {
-	dbgprint32c(c,quote);
+    return ttm->recover.msg;
+}
+
+void
+ttm_destroy(TTM* ttm)
+{
+    jmp_buf jump;
+
+    if(ttm == NULL) return;
+    /* A file of #<fopen> that cannot be closed must not exit */
+    ttm->recover.jump = &jump;
+    if(setjmp(jump) == 0)
+        freeTTM(ttm);
+}
+
+/**************************************************/
+/* Output collected in memory, for --serve and --batch */
+
+struct Collector {
+    char* bytes;
+    size_t length;
+    size_t alloc;
+};
+
+/* A TTMSink write function for a Collector */
+static int
+collectWrite(void* closure, const char* bytes, size_t length)
+{
+    struct Collector* out = (struct Collector*)closure;
+
+    if(out->length + length > out->alloc) {
+        size_t alloc = 2*(out->length + length);
+        char* p = (char*)realloc(out->bytes,alloc);
+        if(p == NULL) return -1;
+        out->bytes = p;
+        out->alloc = alloc;
     }
-    if(quote != NUL)
-        fputc(quote,stderr);
-    fflush(stderr);
+    memcpy(out->bytes+out->length,bytes,length);
+    out->length += length;
+    return 0;
 }
 
 /**************************************************/
-/* Main() Support functions */
+/* Serving requests (--serve) */
+
+/**
+With --serve path, main() runs the -e strings and the -p file,
+which typically define a library of strings, locks everything
+then defined, and listens on a Unix domain socket at path.
+Each connection is handled by a process forked from the
+server, and each request on it by a process forked from that
+one, which evaluates the request with ttm_eval() and exits.
+So every request starts from the server's dictionary and
+buffers as they were after startup, shared copy-on-write with
+the server by fork(), and whatever a request defines or breaks
+goes away with its process.
+A request is a length:4 followed by that many bytes of utf-8
+text; the reply is a status:4, then a length:4 and that many
+bytes: the output if status is 0 (TTM_OK), else the error
+description.  Integers are big-endian.  A request whose
+process dies gets status EOTHER.
+*/
+
+#ifndef MSWINDOWS
+
+#define REPLYHEADER 8
+
+static void
+putBigEndian(unsigned char* p, unsigned int n)
+{
+    p[0] = (unsigned char)(n >> 24);
+    p[1] = (unsigned char)(n >> 16);
+    p[2] = (unsigned char)(n >> 8);
+    p[3] = (unsigned char)n;
+}
 
+static unsigned int
+getBigEndian(unsigned char* p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16)
+           | ((unsigned int)p[2] << 8) | (unsigned int)p[3];
+}
+
+/* Return 1 once n bytes are read, 0 at the end of input
+   before any byte, -1 on an error or a short read */
 static int
-getOptionNameLength(char** list)
+readFully(int fd, char* p, size_t n)
 {
-    unsigned int i;
-    char** p;
-    for(i=0,p=list;*p;i++,p++);
-    return i;
+    size_t got = 0;
+    while(got < n) {
+        ssize_t count = read(fd,p+got,n-got);
+        if(count <= 0) return (count == 0 && got == 0 ? 0 : -1);
+        got += (size_t)count;
+    }
+    return 1;
 }
 
 static int
-pushOptionName(char* option, unsigned int max, char** list)
+writeFully(int fd, const char* p, size_t n)
 {
-    unsigned int i;
-    for(i=0;i<max;i++) {
-        if(list[i] == NULL) {
-            list[i] = (char*)malloc(strlen(option)+1);
-            strcpy(list[i],option);
-            return 1;
-        }
+    while(n > 0) {
+        ssize_t count = write(fd,p,n);
+        if(count <= 0) return -1;
+        p += count;
+        n -= (size_t)count;
     }
     return 0;
 }
 
-static void
-initglobals()
+/* Send a reply with a text of its own */
+static int
+sendReply(int fd, unsigned int status, const char* text)
 {
-    memset((void*)eoptions,0,sizeof(eoptions));
-    memset((void*)argoptions,0,sizeof(argoptions));
+    unsigned char header[REPLYHEADER];
+    size_t len = strlen(text);
+    putBigEndian(header,status);
+    putBigEndian(header+4,(unsigned int)len);
+    if(writeFully(fd,(char*)header,REPLYHEADER) < 0) return -1;
+    return writeFully(fd,text,len);
 }
 
+/* In the process of one request: evaluate it and reply */
 static void
-usage(const char* msg)
-{
-    if(msg != NULL)
-        fprintf(stderr,"%s\n",msg);
-	fprintf(stderr,"%s\n",
-"usage: ttm "
-"[-d string]"
-"[-e string]"
-"[-p programfile]"
-"[-f inputfile]"
-"[-o file]"
-"[-i]"
-"[-V]"
-"[-q]"
-"[-X tag=value]"
-"[--]"
-"[arg...]");
-    fprintf(stderr,"\tOptions may be repeated\n");
-    if(msg != NULL) exit(1); else exit(0);
+serveRequest(TTM* ttm, int fd, char* text, size_t length)
+{
+    struct Collector reply; /* bytes starts with room for the header */
+    TTMSink sink;
+    int err;
+
+    reply.alloc = REPLYHEADER + WRITEBLOCKSIZE;
+    reply.bytes = (char*)malloc(reply.alloc);
+    if(reply.bytes == NULL) _exit(1);
+    reply.length = REPLYHEADER;
+    sink.write = collectWrite;
+    sink.closure = &reply;
+    err = ttm_eval(ttm,text,length,&sink);
+    if(err != TTM_OK) {
+        reply.length = REPLYHEADER;
+        collectWrite(&reply,ttm_error(ttm),strlen(ttm_error(ttm)));
+    }
+    putBigEndian((unsigned char*)reply.bytes,(unsigned int)err);
+    putBigEndian((unsigned char*)reply.bytes+4,
+                 (unsigned int)(reply.length - REPLYHEADER));
+    _exit(writeFully(fd,reply.bytes,reply.length) < 0 ? 1 : 0);
 }
 
+/* In the process of one connection: fork a process per request */
 static void
-readinput(TTM* ttm, const char* filename,Buffer* bb)
+serveConnection(TTM* ttm, int fd)
 {
-    utf32* content = NULL;
-    FILE* f = NULL;
-    int isstdin = 0;
-    unsigned int i;
-    unsigned int buffersize = bb->alloc;
+    unsigned char header[4];
+    char* text;
+    size_t length;
+    pid_t pid;
+    int status;
 
-    if(strcmp(filename,"-") == 0) {
-        /* Read from stdinput */
-        isstdin = 1;
-        f = stdin;      
-    } else {
-        f = fopen(filename,"r");
-        if(f == NULL) {
-            fprintf(stderr,"Cannot read file: %s\n",filename);
-            exit(1);
+    signal(SIGCHLD,SIG_DFL); /* so that waitpid() sees the child */
+    for(;;) {
+        if(readFully(fd,(char*)header,sizeof(header)) <= 0) break;
+        length = getBigEndian(header);
+        /* Refuse, without reading it, a request too long to fit
+           the buffer, rather than allocate whatever a client asks */
+        if(length > ttm->limits.buffersize * MAXCHARSIZE) {
+            sendReply(fd,EBUFFERSIZE,errstring(EBUFFERSIZE));
+            break;
+        }
+        text = (char*)malloc(length+1);
+        if(text == NULL) {
+            sendReply(fd,EMEMORY,errstring(EMEMORY));
+            break;
         }
+        if(readFully(fd,text,length) != 1) {
+            free(text);
+            break;
+        }
+        pid = fork();
+        if(pid == 0)
+            serveRequest(ttm,fd,text,length);
+        free(text);
+        if(pid < 0) {
+            if(sendReply(fd,EOTHER,"Cannot fork") < 0) break;
+            continue;
+        }
+        if(waitpid(pid,&status,0) < 0 || !WIFEXITED(status)) {
+            /* it died before replying */
+            if(sendReply(fd,EOTHER,errstring(EOTHER)) < 0) break;
+        } else if(WEXITSTATUS(status) != 0)
+            break;
     }
-    
-    resetBuffer(ttm,bb);
-    content = bb->content;
+    close(fd);
+}
 
-    /* Read char_t character by character until EOF */
-    for(i=0;i<buffersize-1;i++) {
-        utf32 c32;
-        c32 = fgetc32(f);
-        if(c32 == EOF) break;           
-        if(c32 == ttm->escapec) {
-            *content++ = c32;
-            c32 = fgetc32(f);
+/* Accept connections on the socket at path until killed */
+static void
+serve(TTM* ttm, const char* path)
+{
+    struct sockaddr_un addr;
+    int listener, fd;
+    pid_t pid;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) fail(ttm,EOPEN);
+    memset((void*)&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,path);
+    listener = socket(AF_UNIX,SOCK_STREAM,0);
+    if(listener < 0) fail(ttm,EIO);
+    unlink(path);
+    if(bind(listener,(struct sockaddr*)&addr,sizeof(addr)) < 0
+       || listen(listener,SOMAXCONN) < 0) {
+        close(listener);
+        fail(ttm,EOPEN);
+    }
+    signal(SIGCHLD,SIG_IGN); /* connection processes reap themselves */
+    signal(SIGPIPE,SIG_IGN); /* a client that goes away is an EPIPE */
+    for(;;) {
+        fd = accept(listener,NULL,NULL);
+        if(fd < 0) {
+            /* A signal or a client that gave up needs only a retry;
+               anything else, such as running out of descriptors,
+               will happen again at once, so wait a while first */
+            if(errno != SYSEINTR && errno != SYSECONNABORTED) {
+                fprintf(stderr,"ttm --serve: accept: %s\n",strerror(errno));
+                sleep(1);
+            }
+            continue;
         }
-        *content++ = c32;
+        pid = fork();
+        if(pid == 0) {
+            close(listener);
+            serveConnection(ttm,fd);
+            _exit(0);
+        }
+        close(fd);
     }
-    setBufferLength(ttm,bb,i);
-    if(!isstdin) fclose(f);
 }
 
+#endif /*!MSWINDOWS*/
+
+/**************************************************/
+/* Batches (--batch) */
+
 /**
-Read from input until the
-read characters form a 
-balanced string with respect
-to the current open/close characters.
-Read past the final balancing character
-to the next end of line.
-Return 0 if the read was terminated
-by EOF. 1 otherwise.
+With -p program --batch file..., main() runs the -e strings once,
+in what becomes the base TTM, and then runs the program against
+each of the files as "ttm -p program -f file" would, using -j
+threads.  Each file is run in a TTM of its own, cloned from the
+base, so that nothing one file defines is seen by another.
+The threads take the files largest first, so that a large file
+is not left running on its own at the end.
+The output of each file, including that of #<ps>, is collected
+and written to stdout in the order of the files, as soon as
+those before it are done.  With -o directory, the finished text
+of each file goes instead to the file of the same name in that
+directory; no thread starts if two files have the same name, or
+if that would overwrite one of the files or the program.
+An error ends only the file in which it happens.
 */
 
-static int
-readbalanced(TTM* ttm)
-{
-    Buffer* bb;
-    utf32* content;
-    utf32 c32;
-    unsigned int depth,i;
-    unsigned int buffersize;
+#ifdef HAVE_PTHREADS
 
-    bb = ttm->buffer;
-    resetBuffer(ttm,bb);
-    buffersize = bb->alloc;
-    content = bb->content;
+struct Job {
+    char* filename;
+    char* outpath; /* its file in the -o directory, if any */
+    long long size; /* bytes; <0 => cannot be stat'd */
+    struct Collector out; /* its stdout */
+    int done; /* 1 => out is complete */
+    int exitcode; /* 1 if it failed, else as set by #<exit> */
+};
 
-    /* Read character by character until EOF; take escapes and open/close
-       into account; keep outer <...> */
-    for(depth=0,i=0;i<buffersize-1;i++) {
-        c32 = fgetc32(stdin);
-        if(c32 == EOF) break;
-        if(c32 == ttm->escapec) {
-            *content++ = c32;
-            c32 = fgetc32(stdin);
+struct Batch {
+    TTM* base;
+    char* program; /* the -p file */
+    char* outdir; /* the -o directory, if any */
+    int quiet;
+    struct Job* jobs; /* in the order of the command line */
+    struct Job** queue; /* the jobs, largest first */
+    size_t njobs;
+    size_t next; /* next job in queue to run */
+    size_t written; /* jobs[0..written) are written out */
+    pthread_mutex_t lock;
+};
+
+/* Run one file in a clone of batch->base */
+static void
+runJob(struct Batch* batch, struct Job* job)
+{
+    jmp_buf jump;
+    TTMSink sink;
+    TTM* ttm;
+    Diversion* d;
+    char* path = job->outpath;
+
+    job->exitcode = 1;
+    ttm = (TTM*)calloc(1,sizeof(TTM));
+    if(ttm == NULL) {
+        fprintf(stderr,"Fatal error: %s: %s\n",job->filename,errstring(EMEMORY));
+        return;
+    }
+    sink.write = collectWrite;
+    sink.closure = &job->out;
+    ttm->recover.jump = &jump;
+    if(setjmp(jump) == 0) {
+        cloneTTM(ttm,batch->base);
+        ttm->output = stdout;
+        ttm->isstdout = 1;
+        ttm->writers[WSTDOUT].sink = &sink;
+        ttm->run.pfile = batch->program;
+        ttm->run.ffile = job->filename;
+        ttm->input = fopen(job->filename,"r");
+        if(ttm->input == NULL) fail(ttm,EOPEN);
+        ttm->reader.codec = readerCodec(ttm,ttm->input);
+        if(path != NULL) {
+            ttm->output = fopen(path,"w");
+            if(ttm->output == NULL) fail(ttm,EOPEN);
+            ttm->isstdout = 0;
+            initWriter(ttm,&ttm->writers[WOUTPUT],ttm->output,-1,WRITEBLOCKSIZE);
+            if(compressedName(path))
+                ttm->writers[WOUTPUT].codec =
+                    openCodec(ttm,ttm->output,compressedName(path),1);
         }
-        *content++ = c32;
-        if(c32 == ttm->openc) {
-            depth++;
-        } else if(c32 == ttm->closec) {
-            depth--;
-            if(depth == 0) break;
+        readinput(ttm,batch->program,ttm->buffer);
+        if(!batch->quiet) ttm->flags |= FLAG_EMIT;
+        scan(ttm);
+        ttm->flags &= ~FLAG_EMIT;
+        closeinput(ttm);
+        if(!batch->quiet) {
+            printbuffer(ttm);
+            ttm->diversions.current = NULL;
+            for(d=ttm->diversions.list;d != NULL;d=d->next)
+                undivert(ttm,d);
         }
+        flushOutput(ttm);
+        if(ttm->writers[WOUTPUT].codec != NULL
+           && closeCodec(ttm->writers[WOUTPUT].codec) < 0)
+            fail(ttm,ECODEC);
+        ttm->writers[WOUTPUT].codec = NULL;
+        job->exitcode = (int)ttm->exitcode;
+    } else {
+        fprintf(stderr,"Fatal error: %s: %s\n",job->filename,ttm->recover.msg);
+        /* Keep what was written before the failure, as fatal() does */
+        if(setjmp(jump) == 0)
+            flushOutput(ttm);
     }
-    /* skip to end of line */
-    while(c32 != EOF && c32 != '\n') {c32 = fgetc32(stdin);}
-    setBufferLength(ttm,bb,i);
-    return (i == 0 && c32 == EOF ? 0 : 1);
+    ttm->recover.jump = NULL;
+    if(ttm->writers[WOUTPUT].codec != NULL)
+        closeCodec(ttm->writers[WOUTPUT].codec);
+    ttm->writers[WOUTPUT].codec = NULL;
+    if(ttm->reader.codec != NULL) closeCodec(ttm->reader.codec);
+    if(ttm->output != NULL && !ttm->isstdout) fclose(ttm->output);
+    if(ttm->input != NULL) fclose(ttm->input);
+    closeinput(ttm); /* in case the failure left it open */
+    ttm_destroy(ttm);
 }
 
-static void
-printbuffer(TTM* ttm)
+/* Take jobs from batch->queue until it is empty */
+static void*
+batchWorker(void* arg)
 {
-    printstring(ttm,ttm->output,ttm->buffer->content);
+    struct Batch* batch = (struct Batch*)arg;
+    struct Job* job;
+
+    for(;;) {
+        pthread_mutex_lock(&batch->lock);
+        job = (batch->next < batch->njobs ? batch->queue[batch->next++] : NULL);
+        pthread_mutex_unlock(&batch->lock);
+        if(job == NULL) break;
+        runJob(batch,job);
+        pthread_mutex_lock(&batch->lock);
+        job->done = 1;
+        /* Write out every finished job that is next in order */
+        while(batch->written < batch->njobs && batch->jobs[batch->written].done) {
+            job = &batch->jobs[batch->written++];
+            if(job->out.length > 0)
+                fwrite(job->out.bytes,1,job->out.length,stdout);
+            if(job->out.bytes != NULL) free(job->out.bytes);
+            job->out.bytes = NULL;
+        }
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
 }
 
 static int
-readfile(TTM* ttm, FILE* file, Buffer* bb)
+largestFirst(const void* a, const void* b)
 {
-    long filesize;
-    utf32* p;
-    int count32;
+    const struct Job* x = *(const struct Job* const*)a;
+    const struct Job* y = *(const struct Job* const*)b;
+    if(x->size != y->size) return (x->size > y->size ? -1 : 1);
+    return (x < y ? -1 : x > y ? 1 : 0); /* keep the command line order */
+}
 
-    fseek(file,0,SEEK_SET); /* end of the file */
-    filesize = ftell(file); /* get file length */
-    rewind(file);
- 
-    setBufferLength(ttm,bb,filesize); /* temp */
-    count32 = 0;
-    p = bb->content;
-    for(;;) {
-        utf32 c = fgetc32(file);
-        if(ferror(file)) fail(ttm,EIO);
-        if(c == EOF) break;
-        *p++ = c;
-    }        
-    *p = NUL32;
-    count32 = (p - bb->content);
-    setBufferLength(ttm,bb,count32);
-    return count32;
+/* Return 1 if path names the same existing file as any of
+   files[0..nfiles) or program */
+static int
+overwrites(const char* path, const char* program, char** files, size_t nfiles)
+{
+    char* canon = realpath(path,NULL);
+    char* other;
+    size_t i;
+    int same = 0;
+
+    if(canon == NULL) return 0; /* does not exist yet */
+    for(i=0;i<=nfiles && !same;i++) {
+        other = realpath(i < nfiles ? files[i] : program,NULL);
+        if(other == NULL) continue;
+        same = (strcmp(canon,other) == 0);
+        free(other);
+    }
+    free(canon);
+    return same;
 }
 
-static long
-tagvalue(const char* p)
+/* Check, before any thread starts, that the program can be read
+   and that each job has an output file of its own; fill in
+   each job's outpath.  Return 0, or 1 after reporting why not. */
+static int
+checkBatch(struct Batch* batch, char** files, size_t nfiles)
 {
-    unsigned int value;
-    int c;
-    if(p == NULL || p[0] == NUL)
-        return -1;
-    value = atol(p);
-    c = p[strlen(p)-1];
-    switch (c) {
-    case 0: break;
-    case 'm': case 'M': value *= (1<<20); break;
-    case 'k': case 'K': value *= (1<<10); break;
-    default: break;
+    FILE* f;
+    const char* name;
+    char* path;
+    size_t i, j;
+
+    f = fopen(batch->program,"r");
+    if(f == NULL) {
+        fprintf(stderr,"Cannot read file: %s\n",batch->program);
+        return 1;
+    }
+    if(compressedFile(f) && !haveCodec(compressedFile(f))) {
+        fprintf(stderr,"Cannot decompress file: %s\n",batch->program);
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+    if(batch->outdir == NULL) return 0;
+    for(i=0;i<nfiles;i++) {
+        name = strrchr(files[i],'/');
+        name = (name == NULL ? files[i] : name+1);
+        path = (char*)malloc(strlen(batch->outdir)+strlen(name)+2);
+        if(path == NULL) {
+            fprintf(stderr,"Fatal error: %s\n",errstring(EMEMORY));
+            return 1;
+        }
+        sprintf(path,"%s/%s",batch->outdir,name);
+        batch->jobs[i].outpath = path;
+        if(compressedName(path) && !haveCodec(compressedName(path))) {
+            fprintf(stderr,"Cannot compress output file: %s\n",path);
+            return 1;
+        }
+        for(j=0;j<i;j++) {
+            if(strcmp(batch->jobs[j].outpath,path) == 0) {
+                fprintf(stderr,"--batch: %s and %s would both be written to %s\n",
+                        files[j],files[i],path);
+                return 1;
+            }
+        }
+        if(overwrites(path,batch->program,files,nfiles)) {
+            fprintf(stderr,"--batch: output %s would overwrite an input\n",path);
+            return 1;
+        }
     }
-    return value;
+    return 0;
 }
 
+/* Run program against each of files in nthreads threads;
+   return the exit code of the first file, in order,
+   that failed or set a nonzero one with #<exit> */
 static int
-setdebugflags(const char* flagstring)
-{
-    const char* p = flagstring;
-    int c;
-    int flags = 0;
-    if(flagstring == NULL) return flags;
-    while((c=*p++)) {
-	switch (c) {
-	case 't': flags |= FLAG_TRACE;
-	case 'b': flags |= FLAG_BARE;
-	default: break;
-	}
+runBatch(TTM* base, char* program, char* outdir, int quiet,
+         int nthreads, char** files, size_t nfiles)
+{
+    struct Batch batch;
+    pthread_t* threads;
+    struct stat st;
+    size_t i;
+    int started, exitcode;
+
+    memset((void*)&batch,0,sizeof(batch));
+    batch.base = base;
+    batch.program = program;
+    batch.outdir = outdir;
+    batch.quiet = quiet;
+    batch.njobs = nfiles;
+    batch.jobs = (struct Job*)calloc(nfiles+1,sizeof(struct Job));
+    batch.queue = (struct Job**)calloc(nfiles+1,sizeof(struct Job*));
+    threads = (pthread_t*)calloc((size_t)nthreads,sizeof(pthread_t));
+    if(batch.jobs == NULL || batch.queue == NULL || threads == NULL)
+        fail(base,EMEMORY);
+    for(i=0;i<nfiles;i++) {
+        batch.jobs[i].filename = files[i];
+        batch.jobs[i].size = (stat(files[i],&st) == 0 ? (long long)st.st_size : -1);
+        batch.queue[i] = &batch.jobs[i];
     }
-    return flags;
+    qsort(batch.queue,nfiles,sizeof(struct Job*),largestFirst);
+    if(checkBatch(&batch,files,nfiles)) {
+        exitcode = 1;
+        goto done;
+    }
+    /* The clones share the names of the base rather than copy them */
+    freezeDictionary(base);
+    pthread_mutex_init(&batch.lock,NULL);
+    /* This thread is one of the workers */
+    for(started=1;started<nthreads;started++) {
+        if(pthread_create(&threads[started],NULL,batchWorker,&batch) != 0)
+            break;
+    }
+    batchWorker(&batch);
+    while(--started > 0)
+        pthread_join(threads[started],NULL);
+    pthread_mutex_destroy(&batch.lock);
+    fflush(stdout);
+    exitcode = 0;
+    for(i=0;i<nfiles && exitcode == 0;i++)
+        exitcode = batch.jobs[i].exitcode;
+done:
+    for(i=0;i<nfiles;i++) {
+        if(batch.jobs[i].outpath != NULL) free(batch.jobs[i].outpath);
+    }
+    free(threads);
+    free(batch.queue);
+    free(batch.jobs);
+    return exitcode;
 }
 
+#endif /*HAVE_PTHREADS*/
+
 /**************************************************/
 /* Main() */
 
-static char* options = "d:e:f:iI:o:p:VX:-";
+#ifndef TTM_LIBRARY
+
+static char* options = "d:e:f:iI:j:L:o:p:R:S:VX:-";
 
 int
 main(int argc, char** argv)
@@ -3583,11 +8700,22 @@ main(int argc, char** argv)
     long buffersize = 0;
     long stacksize = 0;
     long execcount = 0;
+    long writesize = 0;
+    long pipeslots = 0;
+    long membudget = 0;
     char* debugargs = strdup("");
     int interactive = 0;
     char* outputfilename = NULL;
     char* executefilename = NULL; /* This is the ttm file to execute */
     char* inputfilename = NULL; /* This is data for #<rs> */
+    char* savefilename = NULL; /* -S snapshot to write */
+    char* loadfilename = NULL; /* -L snapshot to read */
+    char* resumefilename = NULL; /* -R checkpoint to resume */
+    char* servepath = NULL; /* --serve socket */
+    char** batchfiles = NULL; /* --batch files */
+    size_t nbatchfiles = 0;
+    long threads = 0; /* -j */
+    int resumep = 0;
     int isstdout = 1;
     FILE* outputfile = NULL;
     int isstdin = 1;
@@ -3597,14 +8725,44 @@ main(int argc, char** argv)
     char* p;
     int flags;
     int quiet = 0;
+    struct Options opts; /* handed to ttm once it exists */
+
+#ifdef GENBUILTINS
+    genbuiltins();
+    exit(0);
+#endif
+#ifdef DEBUG
+    checkBuiltins();
+#endif
 
     if(argc == 1)
         usage(NULL);
 
-    initglobals();
+    memset((void*)&opts,0,sizeof(opts));
 
     /* Stash argv[0] */
-    pushOptionName(argv[0],MAXARGS,argoptions);
+    pushOptionName(argv[0],MAXARGS,opts.args);
+
+    /* --serve and --batch are long options; take them out before getopt */
+    for(i=1;i<argc;i++) {
+        if(strcmp(argv[i],"--") == 0) break;
+        if(strcmp(argv[i],"--serve") == 0) {
+            if(i+1 >= argc) usage("Missing --serve socket path");
+            if(servepath != NULL) usage("--serve may not be repeated");
+            servepath = strdup(argv[i+1]);
+            for(c=i;c+2<=argc;c++) argv[c] = argv[c+2];
+            argc -= 2;
+            i--;
+        } else if(strcmp(argv[i],"--batch") == 0) {
+            /* The rest of the command line is the files */
+            batchfiles = &argv[i+1];
+            nbatchfiles = (size_t)(argc-(i+1));
+            if(nbatchfiles == 0) usage("Missing --batch files");
+            argv[i] = NULL;
+            argc = i;
+            break;
+        }
+    }
 
     while ((c = getopt(argc, argv, options)) != EOF) {
         switch(c) {
@@ -3626,6 +8784,18 @@ main(int argc, char** argv)
                 if(execcount == 0 && (execcount = tagvalue(p)) < 0)
                     usage("Illegal execcount");
                 break;
+            case 'w':
+                if(writesize == 0 && (writesize = tagvalue(p)) <= 0)
+                    usage("Illegal writesize");
+                break;
+            case 'p':
+                if(pipeslots == 0 && (pipeslots = tagvalue(p)) < 0)
+                    usage("Illegal pipeslots");
+                break;
+            case 'm':
+                if(membudget == 0 && (membudget = tagvalue(p)) < 0)
+                    usage("Illegal memory budget");
+                break;
             default: usage("Illegal -X option");
             }
 	    break;
@@ -3634,7 +8804,15 @@ main(int argc, char** argv)
                 debugargs = strdup(optarg);
             break;
         case 'e':
-            pushOptionName(optarg,MAXEOPTIONS,eoptions);
+            pushOptionName(optarg,MAXEOPTIONS,opts.e);
+            break;
+        case 'I':
+            if(!pushOptionName(optarg,MAXINCLUDES,opts.include))
+                usage("Too many -I options");
+            break;
+        case 'j':
+            if(threads == 0 && (threads = tagvalue(optarg)) <= 0)
+                usage("Illegal -j thread count");
             break;
         case 'p':
             if(executefilename == NULL)
@@ -3649,6 +8827,18 @@ main(int argc, char** argv)
             if(outputfilename == NULL)
                 outputfilename = strdup(optarg);
             break;
+        case 'S':
+            if(savefilename == NULL)
+                savefilename = strdup(optarg);
+            break;
+        case 'L':
+            if(loadfilename == NULL)
+                loadfilename = strdup(optarg);
+            break;
+        case 'R':
+            if(resumefilename == NULL)
+                resumefilename = strdup(optarg);
+            break;
         case 'V':
             printf("ttm version: %s\n",VERSION);
             exit(0);
@@ -3665,7 +8855,39 @@ main(int argc, char** argv)
     /* Collect any args for #<arg> */
     if(optind < argc) {
         for(;optind < argc;optind++)
-            pushOptionName(argv[optind],MAXARGS,argoptions);
+            pushOptionName(argv[optind],MAXARGS,opts.args);
+    }
+
+    if(loadfilename != NULL && resumefilename != NULL)
+        usage("-L and -R are exclusive");
+
+    if(servepath != NULL) {
+#ifdef MSWINDOWS
+        usage("--serve is not supported on Windows");
+#endif
+        if(outputfilename != NULL || inputfilename != NULL
+           || resumefilename != NULL || interactive)
+            usage("--serve is illegal with -o, -f, -R or -i");
+        /* Requests run in processes forked from the server */
+        if(pipeslots > 0 || membudget > 0)
+            usage("--serve is illegal with -Xp or -Xm");
+    }
+
+    if(threads > 0 && batchfiles == NULL)
+        usage("-j requires --batch");
+    if(batchfiles != NULL) {
+#ifndef HAVE_PTHREADS
+        usage("--batch requires POSIX threads");
+#endif
+        if(executefilename == NULL || strcmp(executefilename,"-") == 0)
+            usage("--batch requires a -p file");
+        if(inputfilename != NULL || resumefilename != NULL || savefilename != NULL
+           || servepath != NULL || interactive)
+            usage("--batch is illegal with -f, -R, -S, -i or --serve");
+        /* Each file is run in a clone of the base TTM */
+        if(pipeslots > 0 || membudget > 0)
+            usage("--batch is illegal with -Xp or -Xm");
+        if(threads == 0) threads = 1;
     }
 
     /* Complain if interactive and output file name specified */
@@ -3681,10 +8903,15 @@ main(int argc, char** argv)
     if(execcount < DFALTEXECCOUNT)
         execcount = DFALTEXECCOUNT;           
 
-    if(outputfilename == NULL) {
+    if(outputfilename == NULL || batchfiles != NULL) {
+        /* With --batch, -o names a directory */
         outputfile = stdout;
         isstdout = 1;
     } else {
+        if(compressedName(outputfilename) && !haveCodec(compressedName(outputfilename))) {
+            fprintf(stderr,"Cannot compress output file: %s\n",outputfilename);
+            exit(1);
+        }
         outputfile = fopen(outputfilename,"w");
         if(outputfile == NULL) {
             fprintf(stderr,"Output file is not writable: %s\n",outputfilename);
@@ -3693,7 +8920,11 @@ main(int argc, char** argv)
         isstdout = 0;
     }
 
-    if(inputfilename == NULL) {
+    if(servepath != NULL || batchfiles != NULL) {
+        /* Requests have no -f input, and batches one per file */
+        inputfile = NULL;
+        isstdin = 0;
+    } else if(inputfilename == NULL) {
         inputfile = stdin;
         isstdin = 1;
     } else {
@@ -3702,32 +8933,98 @@ main(int argc, char** argv)
             fprintf(stderr,"-f file is not readable: %s\n",inputfilename);
             exit(1);
         }           
+        if(compressedFile(inputfile) && !haveCodec(compressedFile(inputfile))) {
+            fprintf(stderr,"Cannot decompress -f file: %s\n",inputfilename);
+            exit(1);
+        }
         isstdin = 0;
     }
 
     /* Create the ttm state */
-    ttm = newTTM(buffersize,stacksize,execcount);
+    ttm = newTTM((size_t)buffersize,stacksize,execcount);
+    ttm->options = opts;
     ttm->output = outputfile;
     ttm->isstdout = isstdout;
     ttm->input = inputfile;
     ttm->isstdin = isstdin;    
+    ttm->limits.membudget = (size_t)membudget;
+    ttm->run.pfile = executefilename;
+    ttm->run.ffile = inputfilename;
+    if(inputfile != NULL && !isstdin)
+        ttm->reader.codec = readerCodec(ttm,inputfile);
+    if(!isstdout) {
+        /* With -Xw, write the -o file directly in blocks of that size */
+#ifndef MSWINDOWS
+        if(writesize > 0 && !compressedName(outputfilename)) {
+            fflush(outputfile);
+            initWriter(ttm,&ttm->writers[WOUTPUT],outputfile,
+                       fileno(outputfile),(size_t)writesize);
+        } else
+#endif
+            initWriter(ttm,&ttm->writers[WOUTPUT],outputfile,-1,WRITEBLOCKSIZE);
+        /* Compress the -o file if its name says to */
+        if(compressedName(outputfilename))
+            ttm->writers[WOUTPUT].codec =
+                openCodec(ttm,outputfile,compressedName(outputfilename),1);
+    }
+#ifdef HAVE_PTHREADS
+    /* With -Xp, read the -p file and write the output in threads */
+    if(pipeslots > 0) {
+        ttm->limits.pipeslots = (pipeslots < 2 ? 2 : (unsigned int)pipeslots);
+        startWriterPipe(ttm,writerFor(ttm,ttm->output));
+    }
+#endif
 
-    defineBuiltinFunctions(ttm);
-    
     /* Define flags */
     flags = setdebugflags(debugargs);
     ttm->flags |= flags;
 
-    if(!testMark(ttm->flags,FLAG_BARE))
-      startupcommands(ttm);
-    /* Lock up all the currently defined functions */
-    lockup(ttm);
+    if(resumefilename != NULL) {
+        /* The checkpoint holds the dictionary and the rest of the
+           state; the -p and -f files it names may be overridden */
+        restoreCheckpoint(ttm,resumefilename);
+        if(executefilename != NULL)
+            ttm->run.pfile = executefilename;
+        executefilename = ttm->run.pfile;
+        if(inputfilename != NULL)
+            ttm->run.ffile = inputfilename;
+        else if(ttm->run.ffile != NULL) {
+            ttm->input = fopen(ttm->run.ffile,"r");
+            if(ttm->input == NULL) {
+                fprintf(stderr,"-f file is not readable: %s\n",ttm->run.ffile);
+                exit(1);
+            }
+            ttm->isstdin = 0;
+            ttm->reader.codec = readerCodec(ttm,ttm->input);
+        }
+        if(!ttm->isstdin)
+            skipBytes(ttm,ttm->input,ttm->reader.codec,ttm->reader.offset);
+        resumep = (ttm->run.phase == RUN_P);
+        if(resumep && executefilename == NULL) fail(ttm,ECHECKPOINT);
+        /* Finish the -e string that was interrupted */
+        if(ttm->run.phase == RUN_E) {
+            resumeScan(ttm);
+            if(ttm->flags & FLAG_EXIT)
+                goto done;
+        }
+    } else if(loadfilename != NULL) {
+        /* The snapshot already holds the startup definitions,
+           with their locks as they were when it was taken */
+        loadSnapshot(ttm,loadfilename);
+    } else {
+        if(!testMark(ttm->flags,FLAG_BARE))
+          startupcommands(ttm);
+        /* Lock up all the currently defined functions */
+        lockup(ttm);
+    }
 
     /* Execute the -e strings in turn */
-    for(i=0;eoptions[i]!=NULL;i++) {
-        char* eopt = eoptions[i];
-        int count,elen = strlen(eopt);
+    for(i=0;ttm->options.e[i]!=NULL;i++) {
+        char* eopt = ttm->options.e[i];
+        int count,elen = (int)strlen(eopt);
 
+        ttm->run.phase = RUN_E;
+        ttm->run.rest = &ttm->options.e[i+1];
         resetBuffer(ttm,ttm->buffer);
         setBufferLength(ttm,ttm->buffer,elen); /* temp */
         count = toString32(ttm->buffer->content,eopt,elen);     
@@ -3737,13 +9034,48 @@ main(int argc, char** argv)
             goto done;
     }
 
+#ifdef HAVE_PTHREADS
+    if(batchfiles != NULL) {
+        flushOutput(ttm);
+        ttm->exitcode = (unsigned int)runBatch(ttm,executefilename,outputfilename,
+                                  quiet,(int)threads,batchfiles,nbatchfiles);
+        /* The output of the -e strings went to every file's output */
+        quiet = 1;
+        goto done;
+    }
+#endif
+
     /* Now execute the executefile, if any, and if -q, discard output */
     if(executefilename != NULL) {
-        readinput(ttm,executefilename,ttm->buffer);
-        scan(ttm);
+        ttm->run.phase = RUN_P;
+        if(resumep)
+            openinput(ttm,executefilename,ttm->source.offset);
+        else
+            readinput(ttm,executefilename,ttm->buffer);
+        if(!quiet) ttm->flags |= FLAG_EMIT;
+        if(resumep) resumeScan(ttm); else scan(ttm);
+        ttm->flags &= ~FLAG_EMIT;
+        closeinput(ttm);
         if(ttm->flags & FLAG_EXIT)
             goto done;
     }    
+    ttm->run.phase = RUN_NONE;
+
+    /* Dump the dictionary as it stands after -e and -p */
+    if(savefilename != NULL)
+        saveSnapshot(ttm,savefilename);
+
+#ifndef MSWINDOWS
+    if(servepath != NULL) {
+        /* Send whatever startup printed now, not with every reply */
+        if(!quiet && ttm->buffer->passive > ttm->buffer->content)
+            printbuffer(ttm);
+        flushOutput(ttm);
+        /* Lock the library so that no request can change it */
+        lockup(ttm);
+        serve(ttm,servepath);
+    }
+#endif
 
     /* If interactive, start read-eval loop */
     if(interactive) {
@@ -3763,23 +9095,43 @@ done:
     /* Dump any output left in the buffer */
     if(!quiet && ttm->buffer->passive > 0)
         printbuffer(ttm);
+    /* and then any left in the diversions */
+    ttm->diversions.current = NULL;
+    if(!quiet) {
+        Diversion* d;
+        for(d=ttm->diversions.list;d != NULL;d=d->next)
+            undivert(ttm,d);
+    }
 
     exitcode = ttm->exitcode;
 
     /* cleanup */
+    flushOutput(ttm);
+#ifdef HAVE_PTHREADS
+    for(i=0;i<NWRITERS;i++) {
+        if(ttm->writers[i].pipe != NULL)
+            stopWriterPipe(ttm,&ttm->writers[i]);
+    }
+#endif
+    if(ttm->writers[WOUTPUT].codec != NULL
+       && closeCodec(ttm->writers[WOUTPUT].codec) < 0)
+        fail(ttm,ECODEC);
+    ttm->writers[WOUTPUT].codec = NULL;
+    if(ttm->reader.codec != NULL) closeCodec(ttm->reader.codec);
     if(!ttm->isstdout) fclose(ttm->output);
-    if(!ttm->isstdin) fclose(ttm->input);
+    if(ttm->input != NULL && !ttm->isstdin) fclose(ttm->input);
 
     freeTTM(ttm);
 
     exit(exitcode);
 }
+#endif /*!TTM_LIBRARY*/
 
 /* Replacments for strcpy, strcmp ... */
-static unsigned int
+static size_t
 strlen32(utf32* s)
 {
-    unsigned int len = 0;
+    size_t len = 0;
     while(*s++)
         len++;
     return len;
@@ -3792,7 +9144,7 @@ strcpy32(utf32* dst, utf32* src)
 }
 
 static void
-strncpy32(utf32* dst, utf32* src, unsigned int len)
+strncpy32(utf32* dst, utf32* src, size_t len)
 {
     utf32 c32;
     for(;len>0 && (c32 = *src++);len--){*dst++ = c32;}
@@ -3812,7 +9164,7 @@ strcat32(utf32* dst, utf32* src)
 static utf32*
 strdup32(utf32* src)
 {
-    unsigned int len;
+    size_t len;
     utf32* dup;
 
     len = strlen32(src);
@@ -3836,7 +9188,7 @@ strcmp32(utf32* s1, utf32* s2)
 }
 
 static int
-strncmp32(utf32* s1, utf32* s2, unsigned int len)
+strncmp32(utf32* s1, utf32* s2, size_t len)
 {
     utf32 c1=0;
     utf32 c2=0;
@@ -3855,7 +9207,7 @@ strncmp32(utf32* s1, utf32* s2, unsigned int len)
 
 
 static void
-memcpy32(utf32* dst, utf32* src, int len)
+memcpy32(utf32* dst, utf32* src, size_t len)
 {
     memcpy((void*)dst,(void*)src,len*sizeof(utf32));
 }
@@ -3881,32 +9233,22 @@ Convert a string of utf32 characters to a string of char_t
 characters.  Stop when srclen characters are processed or
 end-of-string is encountered, or dstlen dst characters are processed,
 whichever comes first.
-WARNING: result is not nul-terminated.
+WARNING: result is nul-terminated only if there is room.
 Return: -1 if error, # of dst chars produced otherwise.
 */
 
 static int
 toString8(char_t* dst, utf32* src, int srclen, int dstlen)
 {
-    utf32* p32;
-    char_t* q8;
-    int i;
-    int avail = dstlen;
+    size_t len, used;
+    int count;
 
-    p32 = src;
-    q8 = dst;
-    for(i=0;i<srclen;i++) {
-        int count;
-        utf32 c=*p32++;
-        if(c == NUL32) break;
-        count = toChar8(q8,c);
-        if(count == 0) return -1;
-	avail -= count;
-	if(avail < 0)
-	    return -1;
-        q8 += count;
-    }
-    return (q8 - dst);
+    for(len=0;len < (size_t)srclen && src[len] != NUL32;len++);
+    count = encode8(src,len,dst,(size_t)dstlen,&used);
+    if(count < 0 || used < len)
+        return -1; /* invalid, or would not fit */
+    if(count < dstlen) dst[count] = NUL;
+    return count;
 }
 
 /**
@@ -3915,26 +9257,15 @@ characters.  Stop when len src bytes are processed or
 end-of-string is encountered, whichever comes first.
 WARNING: src length is in bytes, not characters.
 WARNING: result is not nul-terminated.
-Return: -1 if error, # of dst chars produced otherwise.
+Return: # of dst chars produced; invalid utf-8 is fatal.
 */
 static int
 toString32(utf32* dst, char_t* src, int len)
 {
-    utf32* q32;
-    char_t* p8;
-    int i,count;
-
-    p8 = src;
-    q32 = dst;
-    for(count=0,i=0;i<len;i+=count) {
-        char_t c = *p8;
-        if(c == NUL) break;
-        count = toChar32(q32, p8);
-        if(count == 0) return -1;
-        q32++;
-        p8 += count;
-    }
-    return (q32 - dst);
+    size_t n;
+    for(n=0;n < (size_t)len && src[n] != NUL;n++);
+    /* dst needs no more characters than src has bytes */
+    return (int)decode8(NOTTM,(unsigned char*)src,n,dst,n,NULL);
 }
 
 #ifndef ISO_8859
@@ -3998,7 +9329,7 @@ toChar32(utf32* codepointp, char_t* src)
     int i;
 
     p = src;
-    c0 = (unsigned int)*p;
+    c0 = (unsigned char)*p;
     charsize = utf8count(c0);
     if(charsize == 0) return -1; /* invalid */
     /* Process the 1st char in the char_t codepoint */
@@ -4007,6 +9338,7 @@ toChar32(utf32* codepointp, char_t* src)
         unsigned char c;
         p++;
         c = *p;
+        if((c & 0xC0) != 0x80) return -1; /* not a continuation byte */
         bytes[i] = (c & 0x3F);
     }
     codepoint = (bytes[0]);
@@ -4016,7 +9348,7 @@ toChar32(utf32* codepointp, char_t* src)
         codepoint |= (c & 0x3F);
     }
     if(codepointp) *codepointp = codepoint;
-    return 1;    
+    return charsize;
 }
 
 /* Assumes ismultibyte(c) is true */
@@ -4099,6 +9431,198 @@ fgetc32(FILE* f)
         c32 = c;
     return c32;
 }
+
+/**
+Decode srclen bytes of utf-8 into dst, which has room for
+dstlen characters.  Runs of ascii are widened 16 bytes at
+a time when SSE2 is available, one at a time otherwise;
+other sequences are validated (no stray continuation bytes,
+overlong forms, surrogates or codepoints past 0x10FFFF).
+A sequence cut off by the end of src is left unconsumed.
+Return the # of characters produced; *usedp is set to the
+# of bytes consumed.
+*/
+static size_t
+decode8(TTM* ttm, unsigned char* src, size_t srclen,
+        utf32* dst, size_t dstlen, size_t* usedp)
+{
+    static const utf32 minimum[5] = {0,0,0x80,0x800,0x10000};
+    unsigned char* p = src;
+    unsigned char* end = src + srclen;
+    utf32* q = dst;
+    utf32* qend = dst + dstlen;
+
+    while(p < end) {
+        unsigned int c = *p;
+        int count, i;
+        utf32 c32;
+        if(c < 0x80) {
+            /* ascii run, bounded by both src and dst */
+            size_t n = (size_t)(end - p);
+            if(n > (size_t)(qend - q)) n = (size_t)(qend - q);
+            if(n == 0) fail(ttm,EBUFFERSIZE);
+#ifdef HAVE_SSE2
+            while(n >= 16) {
+                __m128i zero = _mm_setzero_si128();
+                __m128i bytes = _mm_loadu_si128((__m128i*)p);
+                __m128i lo, hi;
+                if(_mm_movemask_epi8(bytes) != 0)
+                    break; /* some byte has its high bit set */
+                lo = _mm_unpacklo_epi8(bytes,zero);
+                hi = _mm_unpackhi_epi8(bytes,zero);
+                _mm_storeu_si128((__m128i*)(q+0),_mm_unpacklo_epi16(lo,zero));
+                _mm_storeu_si128((__m128i*)(q+4),_mm_unpackhi_epi16(lo,zero));
+                _mm_storeu_si128((__m128i*)(q+8),_mm_unpacklo_epi16(hi,zero));
+                _mm_storeu_si128((__m128i*)(q+12),_mm_unpackhi_epi16(hi,zero));
+                p += 16; q += 16; n -= 16;
+            }
+#endif
+            while(n-- > 0 && *p < 0x80)
+                *q++ = (utf32)*p++;
+            continue;
+        }
+        count = utf8count(c);
+        if(count == 0) fail(ttm,ECHAR8);
+        if(end - p < count) break; /* partial sequence */
+        c32 = (utf32)(c & (0x7F >> count));
+        for(i=1;i<count;i++) {
+            if((p[i] & 0xC0) != 0x80) fail(ttm,ECHAR8);
+            c32 = (c32 << 6) | (p[i] & 0x3F);
+        }
+        if(c32 < minimum[count] || c32 > 0x10FFFF
+           || (c32 >= 0xD800 && c32 <= 0xDFFF))
+            fail(ttm,ECHAR8);
+        if(q == qend) fail(ttm,EBUFFERSIZE);
+        *q++ = c32;
+        p += count;
+    }
+    if(usedp) *usedp = (size_t)(p - src);
+    return (size_t)(q - dst);
+}
+
+/**
+Return the length of the longest prefix of src that is made of
+complete, valid utf-8 characters, none of which is NUL or one
+of the ascii characters s1, s2 and s3.  Such text can be copied
+to the output without being decoded.  Invalid utf-8 fails just
+as it does in decode8.
+*/
+static size_t
+span8(TTM* ttm, unsigned char* src, size_t srclen, int s1, int s2, int s3)
+{
+    static const utf32 minimum[5] = {0,0,0x80,0x800,0x10000};
+    unsigned char* p = src;
+    unsigned char* end = src + srclen;
+
+    while(p < end) {
+        unsigned int c = *p;
+        int count, i;
+        utf32 c32;
+        if(c < 0x80) {
+#ifdef HAVE_SSE2
+            __m128i zero = _mm_setzero_si128();
+            __m128i v1 = _mm_set1_epi8((char)s1);
+            __m128i v2 = _mm_set1_epi8((char)s2);
+            __m128i v3 = _mm_set1_epi8((char)s3);
+            while(end - p >= 16) {
+                __m128i bytes = _mm_loadu_si128((__m128i*)p);
+                __m128i hit = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(bytes,zero),
+                                     _mm_cmpeq_epi8(bytes,v1)),
+                        _mm_or_si128(_mm_cmpeq_epi8(bytes,v2),
+                                     _mm_cmpeq_epi8(bytes,v3)));
+                /* stop at a stop character or a non-ascii byte */
+                if(_mm_movemask_epi8(_mm_or_si128(hit,bytes)) != 0)
+                    break;
+                p += 16;
+            }
+#endif
+            for(;p < end && (c = *p) < 0x80;p++) {
+                if(c == 0 || c == (unsigned int)s1
+                   || c == (unsigned int)s2 || c == (unsigned int)s3)
+                    return (size_t)(p - src);
+            }
+            continue;
+        }
+        count = utf8count(c);
+        if(count == 0) fail(ttm,ECHAR8);
+        if(end - p < count) break; /* partial sequence */
+        c32 = (utf32)(c & (0x7F >> count));
+        for(i=1;i<count;i++) {
+            if((p[i] & 0xC0) != 0x80) fail(ttm,ECHAR8);
+            c32 = (c32 << 6) | (p[i] & 0x3F);
+        }
+        if(c32 < minimum[count] || c32 > 0x10FFFF
+           || (c32 >= 0xD800 && c32 <= 0xDFFF))
+            fail(ttm,ECHAR8);
+        p += count;
+    }
+    return (size_t)(p - src);
+}
+
+/**
+Encode srclen utf32 characters into dst, which has room for
+dstlen bytes; the inverse of decode8, with the same ascii
+fast path.  Stop early if the next character will not fit.
+Return -1 if a character is not a valid codepoint, the # of
+bytes produced otherwise; *usedp is set to the # of
+characters consumed.
+*/
+static int
+encode8(utf32* src, size_t srclen, char_t* dst, size_t dstlen, size_t* usedp)
+{
+    utf32* p = src;
+    utf32* end = src + srclen;
+    unsigned char* q = (unsigned char*)dst;
+    unsigned char* qend = q + dstlen;
+
+    while(p < end) {
+        utf32 c = *p;
+        if(c >= 0 && c < 0x80) {
+            size_t n = (size_t)(end - p);
+            if(n > (size_t)(qend - q)) n = (size_t)(qend - q);
+            if(n == 0) break;
+#ifdef HAVE_SSE2
+            while(n >= 16) {
+                __m128i high = _mm_set1_epi32(~0x7F);
+                __m128i a = _mm_loadu_si128((__m128i*)(p+0));
+                __m128i b = _mm_loadu_si128((__m128i*)(p+4));
+                __m128i c4 = _mm_loadu_si128((__m128i*)(p+8));
+                __m128i d = _mm_loadu_si128((__m128i*)(p+12));
+                __m128i any = _mm_or_si128(_mm_or_si128(a,b),_mm_or_si128(c4,d));
+                any = _mm_and_si128(any,high);
+                if(_mm_movemask_epi8(_mm_cmpeq_epi32(any,_mm_setzero_si128())) != 0xFFFF)
+                    break; /* some character is not ascii */
+                _mm_storeu_si128((__m128i*)q,
+                    _mm_packus_epi16(_mm_packs_epi32(a,b),_mm_packs_epi32(c4,d)));
+                p += 16; q += 16; n -= 16;
+            }
+#endif
+            while(n-- > 0 && *p >= 0 && *p < 0x80)
+                *q++ = (unsigned char)*p++;
+            continue;
+        }
+        if(c < 0 || c > 0x10FFFF) return -1;
+        if(c <= 0x7FF) {
+            if(qend - q < 2) break;
+            *q++ = (unsigned char)(0xC0 | (c >> 6));
+        } else if(c <= 0xFFFF) {
+            if(qend - q < 3) break;
+            *q++ = (unsigned char)(0xE0 | (c >> 12));
+            *q++ = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+        } else {
+            if(qend - q < 4) break;
+            *q++ = (unsigned char)(0xF0 | (c >> 18));
+            *q++ = (unsigned char)(0x80 | ((c >> 12) & 0x3F));
+            *q++ = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+        }
+        *q++ = (unsigned char)(0x80 | (c & 0x3F));
+        p++;
+    }
+    if(usedp) *usedp = (size_t)(p - src);
+    return (int)(q - (unsigned char*)dst);
+}
+
 #endif /*!ISO_8859*/
 
 #ifdef ISO_8859
@@ -4119,6 +9643,45 @@ fgetc32(FILE* f)
     return c;
 }
 
+static size_t
+decode8(TTM* ttm, unsigned char* src, size_t srclen,
+        utf32* dst, size_t dstlen, size_t* usedp)
+{
+    size_t i;
+    if(srclen > dstlen) fail(ttm,EBUFFERSIZE);
+    for(i=0;i<srclen;i++) dst[i] = (utf32)src[i];
+    if(usedp) *usedp = srclen;
+    return srclen;
+}
+
+static size_t
+span8(TTM* ttm, unsigned char* src, size_t srclen, int s1, int s2, int s3)
+{
+    size_t i;
+    for(i=0;i<srclen;i++) {
+        int c = src[i];
+        if(c == 0 || c == s1 || c == s2 || c == s3) break;
+    }
+    return i;
+}
+
+static int
+encode8(utf32* src, size_t srclen, char_t* dst, size_t dstlen, size_t* usedp)
+{
+    char_t c8[MAXCHARSIZE+1];
+    char_t* q = dst;
+    size_t i;
+    int count;
+    for(i=0;i<srclen;i++) {
+        count = toChar8(c8,src[i]);
+        if((size_t)count > dstlen - (size_t)(q - dst)) break;
+        memcpy(q,c8,(size_t)count);
+        q += count;
+    }
+    if(usedp) *usedp = i;
+    return (int)(q - dst);
+}
+
 #endif
 /**************************************************/
 /**
@@ -0,0 +1,61 @@
+/**
+This software is released under the terms of the Apache License version 2.
+For details of the license, see http://www.apache.org/licenses/LICENSE-2.0.
+*/
+
+/**
+The ttm interpreter as a library (libttm; see "make libttm.a").
+All of the state of an interpreter is held in its TTM, so
+separate interpreters may be used by separate threads at the
+same time; a single TTM must be used by one thread at a time.
+Errors are returned, never exit the process.
+
+    TTM* ttm = ttm_create();
+    err = ttm_eval(ttm,"#<ds;f;hello>#<f>",17,&sink);
+    ...
+    ttm_destroy(ttm);
+*/
+
+#ifndef TTM_H
+#define TTM_H
+
+#include <stddef.h>
+
+typedef struct TTM TTM;
+
+/* Receives the output of ttm_eval as utf-8 bytes:
+   the finished text and anything printed by #<ps>.
+   Return 0, or -1 to fail the evaluation with an I/O error. */
+typedef struct TTMSink {
+    int (*write)(void* closure, const char* bytes, size_t length);
+    void* closure;
+} TTMSink;
+
+#define TTM_OK 0
+
+/* Create an interpreter with the standard definitions locked in;
+   return NULL if it cannot be created */
+extern TTM* ttm_create(void);
+
+/* Create an interpreter that starts with everything ttm has defined.
+   The first clone freezes ttm's definitions into a layer that ttm
+   and all of its clones then share; each keeps only its own changes
+   to them, so a clone costs memory for what it defines, not for what
+   it inherits.  ttm must not be in use by another thread meanwhile.
+   Return NULL if the clone cannot be created. */
+extern TTM* ttm_clone(TTM* ttm);
+
+/* Evaluate length bytes of utf-8 text and send its output to sink,
+   or discard it if sink is NULL.  Definitions carry over from one
+   evaluation to the next.  Return TTM_OK or the number of the error
+   that ended the evaluation; see ttm_error() for its description. */
+extern int ttm_eval(TTM* ttm, const char* text, size_t length, TTMSink* sink);
+
+/* The description of the error returned by the last ttm_eval,
+   or "" if it succeeded */
+extern const char* ttm_error(TTM* ttm);
+
+/* Free the interpreter and everything it holds */
+extern void ttm_destroy(TTM* ttm);
+
+#endif /*TTM_H*/
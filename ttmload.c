@@ -0,0 +1,226 @@
+/**
+This software is released under the terms of the Apache License version 2.
+For details of the license, see http://www.apache.org/licenses/LICENSE-2.0.
+*/
+
+/**
+Load-test a "ttm --serve" socket; see "make serveload".
+Each of -c connections sends -n requests of the text of -e,
+one at a time, and times each from sending the request to
+reading the whole reply.  The latencies then come back to
+the parent through a pipe, which reports the median, the
+99th percentile, the worst, and the total requests per second.
+With -x, every reply must also be the given text.
+
+    ttmload [-c connections] [-n requests] [-e text] [-x reply] socketpath
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+static long long
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+readFully(int fd, char* p, size_t n)
+{
+    while(n > 0) {
+        ssize_t count = read(fd,p,n);
+        if(count <= 0) return -1;
+        p += count;
+        n -= (size_t)count;
+    }
+    return 0;
+}
+
+static int
+writeFully(int fd, const char* p, size_t n)
+{
+    while(n > 0) {
+        ssize_t count = write(fd,p,n);
+        if(count <= 0) return -1;
+        p += count;
+        n -= (size_t)count;
+    }
+    return 0;
+}
+
+static unsigned int
+getBigEndian(unsigned char* p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16)
+           | ((unsigned int)p[2] << 8) | (unsigned int)p[3];
+}
+
+static int
+connectTo(const char* path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX,SOCK_STREAM,0);
+
+    if(fd < 0) return -1;
+    memset((void*)&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path,path,sizeof(addr.sun_path)-1);
+    if(connect(fd,(struct sockaddr*)&addr,sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* One connection: send n requests and write their latencies to out */
+static int
+client(const char* path, const char* text, const char* expected, long n, int out)
+{
+    unsigned char header[8];
+    size_t len = strlen(text);
+    char* request = (char*)malloc(4+len);
+    char* reply = NULL;
+    size_t replyalloc = 0;
+    unsigned int status, length;
+    long long start, latency;
+    long i;
+    int fd = connectTo(path);
+
+    if(fd < 0 || request == NULL) {
+        fprintf(stderr,"ttmload: cannot connect to %s\n",path);
+        return 1;
+    }
+    request[0] = (char)(len >> 24);
+    request[1] = (char)(len >> 16);
+    request[2] = (char)(len >> 8);
+    request[3] = (char)len;
+    memcpy(request+4,text,len);
+    for(i=0;i<n;i++) {
+        start = now();
+        if(writeFully(fd,request,4+len) < 0
+           || readFully(fd,(char*)header,sizeof(header)) < 0) {
+            fprintf(stderr,"ttmload: connection lost\n");
+            return 1;
+        }
+        status = getBigEndian(header);
+        length = getBigEndian(header+4);
+        if(length > replyalloc) {
+            replyalloc = length;
+            reply = (char*)realloc(reply,replyalloc);
+            if(reply == NULL) return 1;
+        }
+        if(readFully(fd,reply,length) < 0) {
+            fprintf(stderr,"ttmload: connection lost\n");
+            return 1;
+        }
+        latency = now() - start;
+        if(status != 0) {
+            fprintf(stderr,"ttmload: error %u: %.*s\n",status,(int)length,reply);
+            return 1;
+        }
+        if(expected != NULL
+           && (length != strlen(expected) || memcmp(reply,expected,length) != 0)) {
+            fprintf(stderr,"ttmload: reply %ld: %.*s\n  expected: %s\n",
+                    i,(int)length,reply,expected);
+            return 1;
+        }
+        if(i == 0 && out == -1) {
+            fwrite(reply,1,length,stdout);
+            printf("\n");
+        }
+        if(out >= 0 && writeFully(out,(char*)&latency,sizeof(latency)) < 0)
+            return 1;
+    }
+    close(fd);
+    free(request);
+    free(reply);
+    return 0;
+}
+
+static int
+compare(const void* a, const void* b)
+{
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,"usage: ttmload [-c connections] [-n requests] [-e text] [-x reply] socketpath\n");
+    exit(1);
+}
+
+int
+main(int argc, char** argv)
+{
+    long connections = 1;
+    long requests = 1000;
+    const char* text = "#<ps;hello>";
+    const char* expected = NULL;
+    const char* path;
+    long long* latencies;
+    long long start, elapsed;
+    long total, count, i;
+    int fds[2];
+    int c, status, failed;
+
+    while((c = getopt(argc,argv,"c:n:e:x:")) != EOF) {
+        switch(c) {
+        case 'c': connections = atol(optarg); break;
+        case 'n': requests = atol(optarg); break;
+        case 'e': text = optarg; break;
+        case 'x': expected = optarg; break;
+        default: usage();
+        }
+    }
+    if(optind != argc-1 || connections <= 0 || requests <= 0) usage();
+    path = argv[optind];
+
+    /* Show the reply to one request first */
+    if(client(path,text,expected,1,-1) != 0) return 1;
+
+    total = connections * requests;
+    latencies = (long long*)malloc(sizeof(long long)*(size_t)total);
+    if(latencies == NULL || pipe(fds) < 0) return 1;
+    start = now();
+    for(i=0;i<connections;i++) {
+        if(fork() == 0) {
+            close(fds[0]);
+            _exit(client(path,text,expected,requests,fds[1]));
+        }
+    }
+    close(fds[1]);
+    /* Each latency is written whole, since it is less than PIPE_BUF */
+    for(count=0;count<total;count++) {
+        if(readFully(fds[0],(char*)&latencies[count],sizeof(long long)) < 0)
+            break;
+    }
+    elapsed = now() - start;
+    failed = 0;
+    while(wait(&status) > 0) {
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+    }
+    if(failed || count < total) {
+        fprintf(stderr,"ttmload: %ld of %ld requests completed\n",count,total);
+        return 1;
+    }
+    qsort(latencies,(size_t)count,sizeof(long long),compare);
+    printf("%ld requests over %ld connections: p50 %.1f us, p99 %.1f us, max %.1f us, %.0f requests/s\n",
+           count,connections,
+           latencies[count/2]/1e3,
+           latencies[(count*99)/100]/1e3,
+           latencies[count-1]/1e3,
+           count/(elapsed/1e9));
+    free(latencies);
+    return 0;
+}